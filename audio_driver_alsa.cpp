@@ -1,4 +1,5 @@
 #include "audio_driver_alsa.h"
+#include "audio_driver_alsa_util.h"
 
 #include <vector>
 #include <fstream>
@@ -8,6 +9,9 @@
 #include <exception>
 #include <chrono>
 
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include "signal_buffer.h"
 
 #include "test.h"
@@ -19,18 +23,136 @@ namespace autil {
  */
  /* 192khz @ 16 => 150sd => 0.78ms*/
  /* 96khz @ 32 => 175sd => 1.82ms*/
-	snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
-	int rate = 96000;
-	int channels = 2;
 	int buffer_size = 0;		/* auto */
 	int period_size = 0;		/* auto */
-	int latency_min = 32; //32;		/* in frames / 2 */
-	int latency_max = 2048;		/* in frames / 2 */
+	int latency_max = 2048;		/* in frames / 2, hard cap for the latency controller */
 	int block = 0;			/* block mode */
 	int resample = 1;
+	int xrun_recover_max = 4;	/* in-place xrun recoveries per second before falling back to a full reconfiguration */
+
+	/*
+	 * Sample converters between the float SignalBuffers and the interleaved PCM buffers.
+	 * stride is the frame size in bytes. Plain loops without aliasing so the compiler can vectorize them.
+	 */
+	inline float clip(float f) { return (f > 1.0f) ? 1.0f : ((f < -1.0f) ? -1.0f : f); }
+
+	void float2s16(uint8_t *out, size_t stride, const float *in, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			*reinterpret_cast<int16_t*>(out + i*stride) = (int16_t)lrintf(clip(in[i]) * 32767.0f);
+	}
+
+	void s162float(float *out, const uint8_t *in, size_t stride, size_t n) {
+		const float scaling = 1.0f / 32768.0f;
+		for (size_t i = 0; i < n; i++)
+			out[i] = *reinterpret_cast<const int16_t*>(in + i*stride) * scaling;
+	}
+
+	// S24_LE: 24 bit in the lower bytes of a 32 bit container
+	void float2s24(uint8_t *out, size_t stride, const float *in, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			*reinterpret_cast<int32_t*>(out + i*stride) = (int32_t)lrintf(clip(in[i]) * 8388607.0f);
+	}
+
+	void s242float(float *out, const uint8_t *in, size_t stride, size_t n) {
+		const float scaling = 1.0f / 2147483648.0f;
+		for (size_t i = 0; i < n; i++)
+			out[i] = (int32_t)((uint32_t)*reinterpret_cast<const int32_t*>(in + i*stride) << 8) * scaling;
+	}
+
+	// S24_3LE: packed 3 byte little endian
+	void float2s24p(uint8_t *out, size_t stride, const float *in, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			int32_t v = (int32_t)lrintf(clip(in[i]) * 8388607.0f);
+			uint8_t *o = out + i*stride;
+			o[0] = (uint8_t)(v);
+			o[1] = (uint8_t)(v >> 8);
+			o[2] = (uint8_t)(v >> 16);
+		}
+	}
+
+	void s24p2float(float *out, const uint8_t *in, size_t stride, size_t n) {
+		const float scaling = 1.0f / 2147483648.0f;
+		for (size_t i = 0; i < n; i++) {
+			const uint8_t *s = in + i*stride;
+			out[i] = (int32_t)(((uint32_t)s[0] << 8) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 24)) * scaling;
+		}
+	}
+
+	// float only carries 24 bits, so scale to 24 bit and shift up
+	void float2s32(uint8_t *out, size_t stride, const float *in, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			*reinterpret_cast<int32_t*>(out + i*stride) = (int32_t)((uint32_t)lrintf(clip(in[i]) * 8388607.0f) << 8);
+	}
+
+	void s322float(float *out, const uint8_t *in, size_t stride, size_t n) {
+		const float scaling = 1.0f / 2147483648.0f;
+		for (size_t i = 0; i < n; i++)
+			out[i] = *reinterpret_cast<const int32_t*>(in + i*stride) * scaling;
+	}
+
+	void float2float(uint8_t *out, size_t stride, const float *in, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			*reinterpret_cast<float*>(out + i*stride) = in[i];
+	}
+
+	void float2floatIn(float *out, const uint8_t *in, size_t stride, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			out[i] = *reinterpret_cast<const float*>(in + i*stride);
+	}
+
+	// in order of preference: highest resolution native formats first, S16 as the last resort
+	const AudioDriverAlsa::SampleConverter sampleConverters[] = {
+		{ SND_PCM_FORMAT_S32_LE, &float2s32, &s322float },
+		{ SND_PCM_FORMAT_S24_3LE, &float2s24p, &s24p2float },
+		{ SND_PCM_FORMAT_S24_LE, &float2s24, &s242float },
+		{ SND_PCM_FORMAT_FLOAT_LE, &float2float, &float2floatIn },
+		{ SND_PCM_FORMAT_S16_LE, &float2s16, &s162float },
+	};
+
+	const AudioDriverAlsa::SampleConverter *findConverter(snd_pcm_format_t format) {
+		for (auto &c : sampleConverters) {
+			if (c.format == format)
+				return &c;
+		}
+		return nullptr;
+	}
+
+	int setparams_format(snd_pcm_t *handle,
+		snd_pcm_hw_params_t *params,
+		snd_pcm_format_t *format,
+		const char *id)
+	{
+		if (*format == SND_PCM_FORMAT_UNKNOWN) {
+			for (auto &c : sampleConverters) {
+				if (snd_pcm_hw_params_test_format(handle, params, c.format) == 0) {
+					*format = c.format;
+					break;
+				}
+			}
+			if (*format == SND_PCM_FORMAT_UNKNOWN) {
+				printf("No supported sample format for %s\n", id);
+				return -EINVAL;
+			}
+		}
+		else if (!findConverter(*format)) {
+			printf("No converter for sample format %s (%s)\n", snd_pcm_format_name(*format), id);
+			return -EINVAL;
+		}
+
+		int err = snd_pcm_hw_params_set_format(handle, params, *format);
+		if (err < 0) {
+			printf("Sample format not available for %s: %s\n", id, snd_strerror(err));
+			return err;
+		}
+		std::cout << "Sample format (" << id << "):" << snd_pcm_format_name(*format) << std::endl;
+		return 0;
+	}
 
 	int setparams_stream(snd_pcm_t *handle,
 		snd_pcm_hw_params_t *params,
+		snd_pcm_format_t *format,
+		int channels,
+		int rate,
 		const char *id)
 	{
 		int err;
@@ -51,11 +173,9 @@ namespace autil {
 			printf("Access type not available for %s: %s\n", id, snd_strerror(err));
 			return err;
 		}
-		err = snd_pcm_hw_params_set_format(handle, params, format);
-		if (err < 0) {
-			printf("Sample format not available for %s: %s\n", id, snd_strerror(err));
+		err = setparams_format(handle, params, format, id);
+		if (err < 0)
 			return err;
-		}
 		err = snd_pcm_hw_params_set_channels(handle, params, channels);
 		if (err < 0) {
 			printf("Channels count (%i) not available for %s: %s\n", channels, id, snd_strerror(err));
@@ -106,6 +226,7 @@ namespace autil {
 	int setparams_set(snd_pcm_t *handle,
 		snd_pcm_hw_params_t *params,
 		snd_pcm_sw_params_t *swparams,
+		int availMin,
 		const char *id)
 	{
 		int err;
@@ -126,8 +247,9 @@ namespace autil {
 			printf("Unable to set start threshold mode for %s: %s\n", id, snd_strerror(err));
 			return err;
 		}
-		if (!block)
-			val = 4;
+		// poll() wakes us once avail_min frames are ready, one period by default
+		if (availMin > 0)
+			val = availMin;
 		else
 			snd_pcm_hw_params_get_period_size(params, &val, NULL);
 		err = snd_pcm_sw_params_set_avail_min(handle, swparams, val);
@@ -135,6 +257,17 @@ namespace autil {
 			printf("Unable to set avail min for %s: %s\n", id, snd_strerror(err));
 			return err;
 		}
+		// status timestamps on the same clock as DllClock
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+		if (err < 0) {
+			printf("Unable to set timestamp mode for %s: %s\n", id, snd_strerror(err));
+			return err;
+		}
+		err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+		if (err < 0) {
+			printf("Unable to set timestamp type for %s: %s\n", id, snd_strerror(err));
+			return err;
+		}
 		err = snd_pcm_sw_params(handle, swparams);
 		if (err < 0) {
 			printf("Unable to set sw params for %s: %s\n", id, snd_strerror(err));
@@ -143,7 +276,10 @@ namespace autil {
 		return 0;
 	}
 
-	int setparams(snd_pcm_t *phandle, snd_pcm_t *chandle, int *bufsize)
+	int setparams(snd_pcm_t *phandle, snd_pcm_t *chandle,
+		snd_pcm_format_t *pformat, snd_pcm_format_t *cformat,
+		int pchannels, int cchannels, int rate,
+		int *bufsize, int availMin)
 	{
 		int err, last_bufsize = *bufsize;
 		snd_pcm_hw_params_t *pt_params, *ct_params;	/* templates with rate, format and channels */
@@ -159,19 +295,19 @@ namespace autil {
 		snd_pcm_hw_params_alloca(&ct_params);
 		snd_pcm_sw_params_alloca(&p_swparams);
 		snd_pcm_sw_params_alloca(&c_swparams);
-		if ((err = setparams_stream(phandle, pt_params, "playback")) < 0) {
+		if ((err = setparams_stream(phandle, pt_params, pformat, pchannels, rate, "playback")) < 0) {
 			printf("Unable to set parameters for playback stream: %s\n", snd_strerror(err));
 			exit(0);
 		}
-		if ((err = setparams_stream(chandle, ct_params, "capture")) < 0) {
+		if ((err = setparams_stream(chandle, ct_params, cformat, cchannels, rate, "capture")) < 0) {
 			printf("Unable to set parameters for playback stream: %s\n", snd_strerror(err));
 			exit(0);
 		}
 
-		if (buffer_size > 0) {
+		// start with the requested size, only grow if the devices don't agree on it
+		if (buffer_size > 0)
 			*bufsize = buffer_size;
-			goto __set_it;
-		}
+		goto __set_it;
 
 	__again:
 		if (buffer_size > 0)
@@ -220,11 +356,11 @@ namespace autil {
 			}
 			goto __again;
 		}
-		if ((err = setparams_set(phandle, p_params, p_swparams, "playback")) < 0) {
+		if ((err = setparams_set(phandle, p_params, p_swparams, availMin, "playback")) < 0) {
 			printf("Unable to set sw parameters for playback stream: %s\n", snd_strerror(err));
 			exit(0);
 		}
-		if ((err = setparams_set(chandle, c_params, c_swparams, "capture")) < 0) {
+		if ((err = setparams_set(chandle, c_params, c_swparams, availMin, "capture")) < 0) {
 			printf("Unable to set sw parameters for playback stream: %s\n", snd_strerror(err));
 			exit(0);
 		}
@@ -240,75 +376,11 @@ namespace autil {
 		return 0;
 	}
 
-void setscheduler(void)
-{
-        struct sched_param sched_param;
-        if (sched_getparam(0, &sched_param) < 0) {
-                printf("Scheduler getparam failed...\n");
-                return;
-        }
-        sched_param.sched_priority = sched_get_priority_max(SCHED_RR);
-        if (!sched_setscheduler(0, SCHED_RR, &sched_param)) {
-                printf("Scheduler set to Round Robin with priority %i...\n", sched_param.sched_priority);
-                fflush(stdout);
-                return;
-        }
-        printf("!!!Scheduler set to Round Robin with priority %i FAILED!!!\n", sched_param.sched_priority);
-}
-
-long readbuf(snd_pcm_t *handle, char *buf, long len, size_t *frames, size_t *max)
-{
-        long r;
-        if (!block) {
-                do {
-                        r = snd_pcm_readi(handle, buf, len);
-                } while (r == -EAGAIN);
-                if (r > 0) {
-                        *frames += r;
-                        if ((long)*max < r)
-                                *max = r;
-                }
-                // printf("read = %li\n", r);
-        } else {
-                int frame_bytes = (snd_pcm_format_width(format) / 8) * channels;
-                do {
-                        r = snd_pcm_readi(handle, buf, len);
-                        if (r > 0) {
-                                buf += r * frame_bytes;
-                                len -= r;
-                                *frames += r;
-                                if ((long)*max < r)
-                                        *max = r;
-                        }
-                        // printf("r = %li, len = %li\n", r, len);
-                } while (r >= 1 && len > 0);
-        }
-        // showstat(handle, 0);
-        return r;
-}
-long writebuf(snd_pcm_t *handle, char *buf, long len, size_t *frames)
-{
-        long r;
-        while (len > 0) {
-                r = snd_pcm_writei(handle, buf, len);
-                if (r == -EAGAIN)
-                        continue;
-                // printf("write = %li\n", r);
-                if (r < 0)
-                        return r;
-                // showstat(handle, 0);
-                buf += r * 4;
-                len -= r;
-                *frames += r;
-        }
-        return 0;
-}
-
-
 int throwIfError(int err, const std::string &msg) {
     if(err < 0) {
         throw std::runtime_error(msg + " ("+std::string(snd_strerror(err))+")");
     }
+    return err;
 }
 
     AudioDriverAlsa::AudioDriverAlsa(const std::string &deviceName, const StreamProperties &props)
@@ -317,15 +389,32 @@ int throwIfError(int err, const std::string &msg) {
 		capture_handle = nullptr;
 		playback_handle = nullptr;
 		
-		m_poll = false;
+		m_poll = props.poll;
+		m_availMin = props.availMin;
+		m_numPollFdsCapture = m_numPollFdsPlayback = 0;
 
         throwIfError(snd_pcm_open(&playback_handle, deviceName.c_str(), SND_PCM_STREAM_PLAYBACK, block ? 0 : SND_PCM_NONBLOCK),
                      "cannot open output audio device "+deviceName);
 
-         throwIfError(snd_pcm_open(&capture_handle, deviceName.c_str(), SND_PCM_STREAM_CAPTURE, block ? 0 : SND_PCM_NONBLOCK),
-                 "cannot open input audio device "+deviceName);
+        int err = snd_pcm_open(&capture_handle, deviceName.c_str(), SND_PCM_STREAM_CAPTURE, block ? 0 : SND_PCM_NONBLOCK);
+        if (err < 0)
+            snd_pcm_close(playback_handle);
+        throwIfError(err, "cannot open input audio device "+deviceName);
+
+		// after the PCMs, a throwing constructor runs no destructor to close it
+		m_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (m_wakeupFd < 0) {
+			snd_pcm_close(capture_handle);
+			snd_pcm_close(playback_handle);
+			throw std::runtime_error("cannot create wakeup eventfd");
+		}
 
-         rate = m_sampleRate = props.sampleRate;
+         m_sampleRate = props.sampleRate;
+         m_formatCapture = m_formatPlayback = props.format;
+         m_frameBytesCapture = m_frameBytesPlayback = 0;
+         m_blockSize = props.blockSize;
+         m_rtConfig = props.rt;
+         setLatencyPolicyInternal(props.latency);
          m_numChannelsCapture = props.numChannelsCapture;
          m_numChannelsPlayback = props.numChannelsPlayback;
         //setBlockSize(props.blockSize);
@@ -343,8 +432,11 @@ int throwIfError(int err, const std::string &msg) {
     {
 		m_running = false;
 		std::cout << "close audio" << std::endl;
+		wakeupAudioThread();
         delete m_audioThread;
 
+		close(m_wakeupFd);
+
         if(playback_handle)
             snd_pcm_close(playback_handle);
         if(capture_handle)
@@ -354,6 +446,22 @@ int throwIfError(int err, const std::string &msg) {
 		capture_handle = nullptr;
     }
 
+	void AudioDriverAlsa::setLatencyPolicyInternal(LatencyController::Policy policy)
+	{
+		// buffers are allocated for latency_max
+		policy.maxPeriod = (std::min)(policy.maxPeriod, latency_max);
+		policy.minPeriod = (std::min)(policy.minPeriod, policy.maxPeriod);
+		m_latencyController.setPolicy(policy);
+	}
+
+	void AudioDriverAlsa::setLatencyPolicy(const LatencyController::Policy &policy)
+	{
+		RttLocalLock ll(m_mtxActionQueue);
+		sync();
+		m_actionQueue.push([this, policy]() { setLatencyPolicyInternal(policy); });
+		commit();
+	}
+
     void AudioDriverAlsa::setBlockSize(int blockSize) {
         m_blockSize = blockSize;
 		//throw std::runtime_error("not implemented");
@@ -371,20 +479,138 @@ int throwIfError(int err, const std::string &msg) {
     }
 
 
-	void float2short(uint8_t *out, size_t stride, const float *in, size_t n)
+	void AudioDriverAlsa::wakeupAudioThread()
 	{
-		stride = stride * sizeof(uint8_t) / sizeof(int16_t);
-		for(size_t i = 0; i < n; i++) {
-			reinterpret_cast<int16_t*>(out)[i*stride] = lrintf(in[i] * 32767.0f);
+		uint64_t one = 1;
+		if (write(m_wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			printf("Audio thread wakeup failed: %s\n", strerror(errno));
+	}
+
+	void AudioDriverAlsa::fillTelemetryInAudioThread(TelemetryData &t)
+	{
+		t.numXruns = state.xruns();
+		t.numRecoveries = state.numRecoveries + state.numReconfigurations;
+		t.framesLost = state.framesLost;
+		t.maxDelayCapture = (int32_t)state.maxDelayCapture;
+		t.maxDelayPlayback = (int32_t)state.maxDelayPlayback;
+	}
+
+	void AudioDriverAlsa::setupPollDescriptors()
+	{
+		m_numPollFdsCapture = snd_pcm_poll_descriptors_count(capture_handle);
+		m_numPollFdsPlayback = snd_pcm_poll_descriptors_count(playback_handle);
+		throwIfError(m_numPollFdsCapture, "capture poll descriptors error");
+		throwIfError(m_numPollFdsPlayback, "playback poll descriptors error");
+
+		m_pollFds.resize(m_numPollFdsCapture + m_numPollFdsPlayback + 1);
+		throwIfError(snd_pcm_poll_descriptors(capture_handle, &m_pollFds[0], m_numPollFdsCapture), "capture poll descriptors error");
+		throwIfError(snd_pcm_poll_descriptors(playback_handle, &m_pollFds[m_numPollFdsCapture], m_numPollFdsPlayback), "playback poll descriptors error");
+
+		auto &wakeup = m_pollFds.back();
+		wakeup.fd = m_wakeupFd;
+		wakeup.events = POLLIN;
+		wakeup.revents = 0;
+	}
+
+	/*
+	 * Sleep until the requested streams are ready or a control command arrives.
+	 * Returns 1 if ready, 0 on wakeup/timeout and a negative error code otherwise.
+	 * Streams we don't wait for are masked out (poll ignores negative fds), otherwise an
+	 * always-writable playback stream would turn this into a busy loop again.
+	 */
+	int AudioDriverAlsa::waitForStreams(bool capture, bool playback, int timeoutMs)
+	{
+		AUTIL_TRACE_SCOPE("poll");
+		struct pollfd *pfdCapture = &m_pollFds[0];
+		struct pollfd *pfdPlayback = &m_pollFds[m_numPollFdsCapture];
+		struct pollfd *pfdWakeup = &m_pollFds.back();
+
+		auto mask = [](struct pollfd *pfds, int n) {
+			for (int i = 0; i < n; i++)
+				pfds[i].fd = ~pfds[i].fd;
+		};
+
+		if (!capture) mask(pfdCapture, m_numPollFdsCapture);
+		if (!playback) mask(pfdPlayback, m_numPollFdsPlayback);
+
+		int r = poll(m_pollFds.data(), m_pollFds.size(), timeoutMs);
+
+		if (!capture) mask(pfdCapture, m_numPollFdsCapture);
+		if (!playback) mask(pfdPlayback, m_numPollFdsPlayback);
+
+		if (r < 0)
+			return (errno == EINTR) ? 0 : -errno;
+		if (r == 0)
+			return 0;
+
+		if (pfdWakeup->revents & POLLIN) {
+			uint64_t cnt;
+			if (read(m_wakeupFd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+				return -errno;
+			processActionQueueInAudioThread();
 		}
+
+		unsigned short revents;
+		bool ready = true;
+		if (capture) {
+			int err = snd_pcm_poll_descriptors_revents(capture_handle, pfdCapture, m_numPollFdsCapture, &revents);
+			if (err < 0)
+				return err;
+			// on POLLERR the following read reports the xrun
+			ready = ready && (revents & (POLLIN | POLLERR));
+		}
+		if (playback) {
+			int err = snd_pcm_poll_descriptors_revents(playback_handle, pfdPlayback, m_numPollFdsPlayback, &revents);
+			if (err < 0)
+				return err;
+			ready = ready && (revents & (POLLOUT | POLLERR));
+		}
+
+		return ready ? 1 : 0;
 	}
 
-	void short2float(float *out, const uint8_t *in, size_t stride, size_t n) {
-		const float scaling = 1.0f / 32767.0f;
-		stride = stride * sizeof(uint8_t) / sizeof(int16_t);
-		for (size_t i = 0; i < n; i++) {
-			out[i] = reinterpret_cast<const int16_t*>(in)[i*stride] * scaling;
+	long AudioDriverAlsa::readbuf(snd_pcm_t *handle, char *buf, long len, size_t *frames, size_t *max)
+	{
+		AUTIL_TRACE_SCOPE("alsa read", (uint32_t)len);
+		long r;
+		int frame_bytes = m_frameBytesCapture;
+		while (len > 0 && m_running) {
+			r = snd_pcm_readi(handle, buf, len);
+			if (r == -EAGAIN) {
+				if (m_poll && (r = waitForStreams(true, false, 1000)) < 0)
+					return r;
+				continue;
+			}
+			if (r < 0)
+				return r;
+			buf += r * frame_bytes;
+			len -= r;
+			*frames += r;
+			if ((long)*max < r)
+				*max = r;
+		}
+		return 0;
+	}
+
+	long AudioDriverAlsa::writebuf(snd_pcm_t *handle, char *buf, long len, size_t *frames)
+	{
+		AUTIL_TRACE_SCOPE("alsa write", (uint32_t)len);
+		long r;
+		int frame_bytes = m_frameBytesPlayback;
+		while (len > 0 && m_running) {
+			r = snd_pcm_writei(handle, buf, len);
+			if (r == -EAGAIN) {
+				if (m_poll && (r = waitForStreams(false, true, 1000)) < 0)
+					return r;
+				continue;
+			}
+			if (r < 0)
+				return r;
+			buf += r * frame_bytes;
+			len -= r;
+			*frames += r;
 		}
+		return 0;
 	}
 
 	void gettimestamp(snd_pcm_t *handle, snd_timestamp_t *timestamp)
@@ -399,6 +625,118 @@ int throwIfError(int err, const std::string &msg) {
         snd_pcm_status_get_trigger_tstamp(status, timestamp);
 }
 
+	/*
+	 * Feed a stream's DLL with the hardware position at the status timestamp, in driver frames:
+	 * capture is ahead of what we read by avail, playback behind what we wrote by delay.
+	 */
+	void AudioDriverAlsa::updateStreamClock(snd_pcm_t *handle, DllClock &clock, int64_t position, bool capture)
+	{
+		snd_pcm_status_t *status;
+		snd_pcm_status_alloca(&status);
+		if (snd_pcm_status(handle, status) < 0)
+			return;
+
+		snd_htimestamp_t ts;
+		snd_pcm_status_get_htstamp(status, &ts);
+		int64_t t = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		if (t == 0)
+			t = DllClock::now();
+
+		int64_t frame = capture ? position + (int64_t)snd_pcm_status_get_avail(status)
+		                        : position - (int64_t)snd_pcm_status_get_delay(status);
+		if (frame > 0)
+			clock.update((uint64_t)frame, t);
+	}
+
+	void AudioDriverAlsa::showClocks()
+	{
+		std::cout << "clock drift {capture|playback}: " << m_captureClock.getDriftPpm() << "ppm | " << m_playbackClock.getDriftPpm() << "ppm"
+			<< (m_captureClock.isLocked() && m_playbackClock.isLocked() ? "" : " (not locked)") << std::endl;
+	}
+
+	/*
+	 * In-place xrun recovery: recover the failed stream, prepare the linked pair and re-prime the
+	 * playback buffer at the current period size. No hw_free, no re-negotiation, latency is unchanged.
+	 * Returns the number of frames lost in the gap or a negative error if a full restart is needed.
+	 */
+	long AudioDriverAlsa::recoverXrun(snd_pcm_t *handle, int err, char *pcmOutBufferPtr, int latency)
+	{
+		auto t0 = std::chrono::high_resolution_clock::now();
+
+		if ((err = snd_pcm_recover(handle, err, 1)) < 0) {
+			printf("Xrun recovery failed: %s\n", snd_strerror(err));
+			return err;
+		}
+
+		// linked streams: drop and prepare the whole group, then refill as on the initial start
+		snd_pcm_drop(capture_handle);
+		if ((err = snd_pcm_prepare(capture_handle)) < 0)
+			return err;
+		if (snd_pcm_state(playback_handle) != SND_PCM_STATE_PREPARED && (err = snd_pcm_prepare(playback_handle)) < 0)
+			return err;
+
+		if ((err = snd_pcm_format_set_silence(m_formatPlayback, pcmOutBufferPtr, latency*m_numChannelsPlayback)) < 0)
+			return err;
+		for (int i = 0; i < 2; i++) {
+			if ((err = writebuf(playback_handle, pcmOutBufferPtr, latency, &state.numFramesOut)) < 0)
+				return err;
+		}
+		if ((err = snd_pcm_start(capture_handle)) < 0)
+			return err;
+
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		// frames that passed since the last completed period
+		std::chrono::duration<double> gap = t1 - state.tLastPeriod;
+		long lost = lrint(gap.count() * m_sampleRate);
+		if (lost < 0)
+			lost = 0;
+
+		std::chrono::duration<double, std::micro> took = t1 - t0;
+		state.numRecoveries++;
+		state.framesLost += lost;
+		state.lastRecoveryUs = took.count();
+		state.sumRecoveryUs += took.count();
+		if (took.count() > state.maxRecoveryUs)
+			state.maxRecoveryUs = took.count();
+
+		return lost;
+	}
+
+	/*
+	 * Handle a read/write error. Tries the in-place recovery first and only requests a full
+	 * restart (re-negotiation with a larger period) if that fails or xruns keep piling up.
+	 */
+	void AudioDriverAlsa::handleXrun(snd_pcm_t *handle, int err, char *pcmOutBufferPtr, int latency)
+	{
+		AUTIL_TRACE_INSTANT(handle == capture_handle ? "overrun" : "underrun");
+		AUTIL_TRACE_SCOPE("xrun recovery");
+		auto now = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double> sinceBurst = now - state.tRecoveryBurst;
+		if (sinceBurst.count() > 1.0) {
+			state.tRecoveryBurst = now;
+			state.numRecoveriesInBurst = 0;
+		}
+
+		long lost = -1;
+		if (state.numRecoveriesInBurst++ < xrun_recover_max)
+			lost = recoverXrun(handle, err, pcmOutBufferPtr, latency);
+
+		// a larger period for xruns recovered in place waits for the next restart
+		m_latencyController.xrun(lost >= 0);
+
+		if (lost < 0) {
+			state.numReconfigurations++;
+			state.restart = true;
+			return;
+		}
+
+		// keep SignalBuffer positions and the frame clock aligned with real time across the gap
+		skipFramesInAudioThread((uint32_t)lost);
+		m_captureClock.reset();
+		m_playbackClock.reset();
+	}
+
     void AudioDriverAlsa::process()
     {
 		
@@ -408,11 +746,13 @@ int throwIfError(int err, const std::string &msg) {
 		
 		state.reset();
 
-		// create buffers
-		std::vector<int16_t> pcmIn, pcmOut;
+		applyRtConfigInAudioThread();
+
+		// create buffers, large enough for the widest (32 bit) sample format
+		std::vector<uint8_t> pcmIn, pcmOut;
 		
-		pcmIn.resize(m_numChannelsCapture * blockSizeMax);
-		pcmOut.resize(m_numChannelsPlayback * blockSizeMax);
+		pcmIn.resize(m_numChannelsCapture * blockSizeMax * sizeof(int32_t));
+		pcmOut.resize(m_numChannelsPlayback * blockSizeMax * sizeof(int32_t));
 		auto pcmInPtr = pcmIn.data();
 		auto pcmOutPtr = pcmOut.data();		
 		auto pcmInBufferPtr = (char*)pcmIn.data();
@@ -420,7 +760,7 @@ int throwIfError(int err, const std::string &msg) {
 
 
 		
-		int latency = latency_min - 4;
+		int latency;
 		int err;
 		snd_pcm_sframes_t delay;
 
@@ -432,9 +772,9 @@ int throwIfError(int err, const std::string &msg) {
 			std::chrono::duration<double, std::milli> passedMs = std::chrono::high_resolution_clock::now() - state.tStarted;
 
 
-			// ignore xruns first 8 seconds to let the CPU exit from power saving state
-			if (passedMs.count() < 6000.0) {
-				latency = latency_min - 4;
+			// the controller ignores xruns during warmup to let the CPU exit from power saving state
+			latency = m_latencyController.getTarget();
+			if (passedMs.count() < 1000.0 * m_latencyController.getPolicy().warmupSeconds) {
 				// reset buffer observers on XRUN
 				for (int ip = 0; ip < MAX_SIGNAL_BUFFERS; ip++) {
 					auto bufferPool = m_bufferPool[ip];
@@ -445,20 +785,36 @@ int throwIfError(int err, const std::string &msg) {
 			}
 			else {
 				state.show();
+				showClocks();
 			}
 			
-                if (setparams(playback_handle, capture_handle, &latency) < 0)
+                if (setparams(playback_handle, capture_handle, &m_formatPlayback, &m_formatCapture,
+                              m_numChannelsPlayback, m_numChannelsCapture, m_sampleRate, &latency, m_availMin) < 0)
                         break;
-				m_sampleRate = rate;
+
+				auto convPlayback = findConverter(m_formatPlayback);
+				auto convCapture = findConverter(m_formatCapture);
+				int sampleBytesPlayback = snd_pcm_format_physical_width(m_formatPlayback) / 8;
+				int sampleBytesCapture = snd_pcm_format_physical_width(m_formatCapture) / 8;
+				m_frameBytesPlayback = sampleBytesPlayback * m_numChannelsPlayback;
+				m_frameBytesCapture = sampleBytesCapture * m_numChannelsCapture;
 
                 //showlatency(latency);				
 				std::cout << "Block Size:" << latency << std::endl;
+				m_latencyController.reset(latency, m_sampleRate);
+				m_blockSize = latency;
+
+				m_captureClock.setNominalRate(m_sampleRate);
+				m_playbackClock.setNominalRate(m_sampleRate);
+				m_captureClock.reset();
+				m_playbackClock.reset();
 				
                 throwIfError(snd_pcm_link(capture_handle, playback_handle), "streams link error");	
+				setupPollDescriptors();
 				
 				// 0-set frames
-                throwIfError(snd_pcm_format_set_silence(format, pcmOutBufferPtr, latency*channels), "silence error");
-				throwIfError(snd_pcm_format_set_silence(format, pcmInBufferPtr, latency*channels), "silence error");               
+                throwIfError(snd_pcm_format_set_silence(m_formatPlayback, pcmOutBufferPtr, latency*m_numChannelsPlayback), "silence error");
+				throwIfError(snd_pcm_format_set_silence(m_formatCapture, pcmInBufferPtr, latency*m_numChannelsCapture), "silence error");               
 				
 				// fill playback buffer
                 throwIfError(writebuf(playback_handle, pcmOutBufferPtr, latency, &state.numFramesOut), "write error");				
@@ -469,16 +825,15 @@ int throwIfError(int err, const std::string &msg) {
 
 				gettimestamp(playback_handle, &state.tPlaybackStarted);
 				gettimestamp(capture_handle, &state.tCaptureStarted);
+				state.tLastPeriod = std::chrono::high_resolution_clock::now();
 
 					
 					ssize_t r;
                 size_t in_max = 0;
+				const double periodUs = 1e6 * latency / m_sampleRate;
+				auto tLastWakeup = std::chrono::high_resolution_clock::time_point();
                 while (m_running && !state.restart) {
 					processActionQueueInAudioThread();   
-					
-                        if (m_poll) {
-                                snd_pcm_wait(capture_handle, 1000);
-                        }
 						
 
 						snd_pcm_delay(capture_handle, &delay);
@@ -489,32 +844,44 @@ int throwIfError(int err, const std::string &msg) {
                         if ((r = readbuf(capture_handle, pcmInBufferPtr, latency, &state.numFramesIn, &state.maxInLatency)) < 0) {
 							// overrun
 							state.numOverruns++;
-							state.restart = true;
+							handleXrun(capture_handle, r, pcmOutBufferPtr, latency);
+							tLastWakeup = std::chrono::high_resolution_clock::time_point();
+							continue;
 						}
+
+						// the capture period just completed, compare with the nominal period
+						auto tWakeup = std::chrono::high_resolution_clock::now();
+						if (tLastWakeup.time_since_epoch().count() != 0) {
+							std::chrono::duration<double, std::micro> dt = tWakeup - tLastWakeup;
+							double jitter = std::abs(dt.count() - periodUs);
+							state.numWakeups++;
+							state.sumWakeupJitterUs += jitter;
+							if (jitter > state.maxWakeupJitterUs)
+								state.maxWakeupJitterUs = jitter;
+						}
+						tLastWakeup = tWakeup;
+						state.tLastPeriod = tWakeup;
+						beginPeriodInAudioThread(latency);
+						updateStreamClock(capture_handle, m_captureClock, m_totalFramesProcessed + latency, true);
 						
 						
 						            // signal buffers
 
 			// stride (byte-unit)
-			size_t stride = (snd_pcm_format_width(format) / 8) * m_numChannelsPlayback;
-
-            for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++) {
-                SignalBuffer *signalBuffer = m_buffers[ib];
-
-                if (!signalBuffer)
-                    continue;
+			size_t strideOut = m_frameBytesPlayback, strideIn = m_frameBytesCapture;
 
+            processScheduledPeriodInAudioThread(latency, [&](int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n) {
                 for (uint32_t ic = 0; ic < signalBuffer->channels; ic++) {
                     auto con = getBufferPortConnection(ib, ic);
 
                     // interleaved RW of PCM data (c0c1c2c0c1c3 ...)
                     if (con->isOutput) {
-                        signalBuffer->getBlock(ic, reinterpret_cast<uint8_t*>(pcmOutPtr + ic), stride, latency, &float2short);
+                        signalBuffer->getBlock(ic, pcmOutPtr + offset * strideOut + ic * sampleBytesPlayback, strideOut, n, convPlayback->fromFloat);
                     } else {
-                        signalBuffer->addBlock(ic, reinterpret_cast<uint8_t*>(pcmInPtr + ic), stride, latency, &short2float);
+                        signalBuffer->addBlock(ic, pcmInPtr + offset * strideIn + ic * sampleBytesCapture, strideIn, n, convCapture->toFloat);
                     }
                 }
-            }
+            });
 						
 							// test noise
 		//for (int ii = 0; ii < latency; ii++) {
@@ -528,11 +895,20 @@ int throwIfError(int err, const std::string &msg) {
 			
 						
 						// write playback samples                        
-                        if (writebuf(playback_handle, pcmOutBufferPtr, latency, &state.numFramesOut) < 0) {
+                        if ((r = writebuf(playback_handle, pcmOutBufferPtr, latency, &state.numFramesOut)) < 0) {
 							// underrun
 							state.numUnderruns++;
-							state.restart = true;						
+							handleXrun(playback_handle, r, pcmOutBufferPtr, latency);
+							tLastWakeup = std::chrono::high_resolution_clock::time_point();
                         }
+						else {
+							updateStreamClock(playback_handle, m_playbackClock, m_totalFramesProcessed + latency, false);
+						}
+
+						// closed-loop latency: callback time and playback delay margin of this period
+						std::chrono::duration<double> callbackTime = std::chrono::high_resolution_clock::now() - tWakeup;
+						if (m_latencyController.update(latency, callbackTime.count(), delay))
+							state.restart = true;
 						
 						processSignalBufferObserverInAudioThread(latency);
                 }
@@ -549,6 +925,8 @@ int throwIfError(int err, const std::string &msg) {
         }
 
 		state.show();
+		showClocks();
+		m_callbackStats.show();
 		
         snd_pcm_close(playback_handle);
         snd_pcm_close(capture_handle);
@@ -590,6 +968,9 @@ void AudioDriverAlsa::ProcessState::show() {
 	std::cout << "maxDelay{Playback|Capture}:" << maxDelayPlayback << " | " << maxDelayCapture << std::endl;
 	std::cout << "total {over|under}Runs: " << numOverruns << " | " << numUnderruns << std::endl;
 	std::cout << "hwSync: " << isHwSync() << std::endl;
+	std::cout << "recoveries {in-place|reconfig}: " << numRecoveries << " | " << numReconfigurations << ", frames lost: " << framesLost << std::endl;
+	std::cout << "recovery time {mean|max}: " << (numRecoveries ? sumRecoveryUs / numRecoveries : 0.0) << "us | " << maxRecoveryUs << "us" << std::endl;
+	std::cout << "wakeup jitter {mean|max}: " << meanWakeupJitterUs() << "us | " << maxWakeupJitterUs << "us" << std::endl;
 }
 
 bool AudioDriverAlsa::ProcessState::isHwSync() {
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <chrono>
+#include <vector>
 #include "audio_driver_base.h"
+#include "latency_controller.h"
+
+#include <poll.h>
 
 #include <alsa/asoundlib.h>
 
@@ -23,11 +27,22 @@ namespace autil {
             int sampleRate;
             int blockSize;
 
+            snd_pcm_format_t format; // SND_PCM_FORMAT_UNKNOWN = negotiate the device's native format
+
+            bool poll; // sleep in poll() until the device is ready instead of spinning on -EAGAIN
+            int availMin; // wakeup threshold in frames, 0 = one period
+
+            LatencyController::Policy latency;
+            RtConfig rt;
+
             StreamProperties() {
                 blockSize = 256;
                 numChannelsCapture = 2;
                 numChannelsPlayback = 2;
                 sampleRate = 48000;
+                format = SND_PCM_FORMAT_UNKNOWN;
+                poll = true;
+                availMin = 0;
             }
         };
             AudioDriverAlsa(const std::string &deviceName, const StreamProperties &props);
@@ -35,6 +50,20 @@ namespace autil {
 
 
 		void setBlockSize(int blockSize);
+
+		// current period size in frames, as chosen by the latency controller
+		inline int getLatency() const { return m_latencyController.getPeriod(); }
+		inline const LatencyController::Policy &getLatencyPolicy() const { return m_latencyController.getPolicy(); }
+		void setLatencyPolicy(const LatencyController::Policy &policy);
+
+		inline snd_pcm_format_t getCaptureFormat() const { return m_formatCapture; }
+		inline snd_pcm_format_t getPlaybackFormat() const { return m_formatPlayback; }
+
+		struct SampleConverter {
+			snd_pcm_format_t format;
+			void(*fromFloat)(uint8_t *out, size_t outStride, const float *in, size_t n);
+			void(*toFloat)(float *out, const uint8_t *in, size_t inStride, size_t n);
+		};
     protected:
         void addSignal(SignalBuffer *buffer, std::vector<void*> ports);
 
@@ -59,6 +88,18 @@ namespace autil {
 			//int m_numShortReads;
 			
 			snd_timestamp_t tPlaybackStarted, tCaptureStarted;
+
+			// xrun recovery
+			int numRecoveries; // in-place (recover/prepare, same period size)
+			int numReconfigurations; // full teardown and re-negotiation
+			size_t framesLost;
+			double lastRecoveryUs, maxRecoveryUs, sumRecoveryUs;
+			int numRecoveriesInBurst;
+			std::chrono::high_resolution_clock::time_point tRecoveryBurst, tLastPeriod;
+
+			// deviation of the period wakeups from the nominal period length
+			size_t numWakeups;
+			double sumWakeupJitterUs, maxWakeupJitterUs;
 			
 			inline void reset() { memset(this, 0, sizeof(*this)); }
 			inline ProcessState() { reset(); }
@@ -66,14 +107,39 @@ namespace autil {
 			void show();
 			bool isHwSync();
 			inline int xruns() { return numOverruns + numUnderruns; }
+			inline double meanWakeupJitterUs() { return numWakeups ? sumWakeupJitterUs / numWakeups : 0.0; }
 		};
 
 
         ProcessState state;
 		
 		bool m_poll;//energy saving
+		int m_availMin;
 
-		
+		snd_pcm_format_t m_formatCapture, m_formatPlayback;
+		int m_frameBytesCapture, m_frameBytesPlayback;
+
+		LatencyController m_latencyController;
+		void setLatencyPolicyInternal(LatencyController::Policy policy);
+
+		// combined poll set: [capture descriptors | playback descriptors | wakeup eventfd]
+		std::vector<struct pollfd> m_pollFds;
+		int m_numPollFdsCapture, m_numPollFdsPlayback;
+		int m_wakeupFd;
+
+		void setupPollDescriptors();
+		int waitForStreams(bool capture, bool playback, int timeoutMs);
+		void wakeupAudioThread();
+		void fillTelemetryInAudioThread(TelemetryData &t);
+
+		void updateStreamClock(snd_pcm_t *handle, DllClock &clock, int64_t position, bool capture);
+		void showClocks();
+
+		long recoverXrun(snd_pcm_t *handle, int err, char *pcmOutBufferPtr, int latency);
+		void handleXrun(snd_pcm_t *handle, int err, char *pcmOutBufferPtr, int latency);
+
+		long readbuf(snd_pcm_t *handle, char *buf, long len, size_t *frames, size_t *max);
+		long writebuf(snd_pcm_t *handle, char *buf, long len, size_t *frames);
 
 		snd_pcm_t      *playback_handle;
 		snd_pcm_t      *capture_handle;
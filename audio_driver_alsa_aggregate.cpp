@@ -0,0 +1,556 @@
+#include "audio_driver_alsa_aggregate.h"
+#include "audio_driver_alsa_util.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#include "signal_buffer.h"
+
+namespace autil {
+	AudioDriverAlsaAggregate::AudioDriverAlsaAggregate(const std::string &name, const StreamProperties &props)
+		: AudioDriverBase(name)
+	{
+		if (props.devices.empty())
+			throw std::invalid_argument("Aggregate device without devices!");
+		if (props.blockSize <= 0 || props.blockSize > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("Invalid block size " + std::to_string(props.blockSize));
+
+		memset(m_bufferPortConnections, 0, sizeof(m_bufferPortConnections));
+
+		m_sampleRate = props.sampleRate;
+		m_blockSize = props.blockSize;
+		m_rtConfig = props.rt;
+		m_numChannelsCapture = 0;
+		m_numChannelsPlayback = 0;
+		m_tLastPeriod = 0;
+
+		int maxChannels = 0;
+		for (auto &dev : props.devices) {
+			DeviceStream *d = new DeviceStream();
+			d->dev = dev;
+			d->index = (int)m_devices.size();
+			d->captureOffset = m_numChannelsCapture;
+			d->playbackOffset = m_numChannelsPlayback;
+			m_numChannelsCapture += dev.numChannelsCapture;
+			m_numChannelsPlayback += dev.numChannelsPlayback;
+			maxChannels = std::max(maxChannels, dev.numChannelsPlayback);
+			m_devices.push_back(d);
+		}
+
+		m_capture.assign(m_numChannelsCapture, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_playback.assign(m_numChannelsPlayback, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_silence.assign(MAX_BLOCK_SIZE, 0.0f);
+		m_discard.assign(MAX_BLOCK_SIZE, 0.0f);
+		m_scratch.assign(maxChannels, std::vector<float>(2 * MAX_BLOCK_SIZE, 0.0f));
+		for (auto &s : m_scratch)
+			m_scratchPtrs.push_back(s.data());
+
+		try {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				DeviceStream &d = *m_devices[i];
+				openDevice(d);
+
+				if (i == 0) {
+					// the master period is the aggregate period
+					m_blockSize = d.period;
+					continue;
+				}
+
+				// a few periods of both devices, the fill level is held at 1-2 periods
+				uint32_t capacity = 4 * (std::max(d.period, m_blockSize) + 64);
+				if (d.capture) {
+					d.fifoCapture = new ResamplingFifo(d.dev.numChannelsCapture, capacity);
+					for (int c = 0; c < d.dev.numChannelsCapture; c++)
+						d.fifoCaptureOut.push_back(m_capture[d.captureOffset + c].data());
+				}
+				if (d.playback) {
+					d.fifoPlayback = new ResamplingFifo(d.dev.numChannelsPlayback, capacity);
+					for (int c = 0; c < d.dev.numChannelsPlayback; c++)
+						d.fifoPlaybackIn.push_back(m_playback[d.playbackOffset + c].data());
+				}
+			}
+		}
+		catch (...) {
+			for (auto d : m_devices) {
+				closeDevice(*d);
+				delete d;
+			}
+			m_devices.clear();
+			throw;
+		}
+
+		showDevices();
+
+		m_running = true;
+
+		m_audioThread = new RttThread([this]() {
+			std::cout << "audioThread started!" << std::endl;
+			process();
+		}, true, "audio");
+	}
+
+	AudioDriverAlsaAggregate::~AudioDriverAlsaAggregate()
+	{
+		m_running = false;
+		delete m_audioThread;
+
+		for (auto d : m_devices) {
+			closeDevice(*d);
+			delete d;
+		}
+	}
+
+	void AudioDriverAlsaAggregate::openDevice(DeviceStream &d)
+	{
+		const char *id = d.dev.name.c_str();
+		snd_pcm_hw_params_t *tparams, *params;
+		snd_pcm_sw_params_t *swparams;
+		snd_pcm_hw_params_alloca(&tparams);
+		snd_pcm_hw_params_alloca(&params);
+		snd_pcm_sw_params_alloca(&swparams);
+
+		d.formatCapture = d.formatPlayback = SND_PCM_FORMAT_UNKNOWN;
+		d.period = 0;
+
+		snd_pcm_t **handles[2] = { &d.capture, &d.playback };
+		for (int dir = 0; dir < 2; dir++) {
+			bool capture = dir == 0;
+			int channels = capture ? d.dev.numChannelsCapture : d.dev.numChannelsPlayback;
+			if (channels <= 0)
+				continue;
+
+			snd_pcm_format_t *format = capture ? &d.formatCapture : &d.formatPlayback;
+			throwIfError(snd_pcm_open(handles[dir], id, capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK),
+				"Cannot open " + d.dev.name);
+			throwIfError(setparams_stream(*handles[dir], tparams, format, channels, m_sampleRate, id),
+				"Cannot configure " + d.dev.name);
+			throwIfError(setparams_bufsize(*handles[dir], params, tparams, m_blockSize, id),
+				"Cannot set period size of " + d.dev.name);
+			throwIfError(setparams_set(*handles[dir], params, swparams, 0, id),
+				"Cannot set parameters of " + d.dev.name);
+
+			snd_pcm_uframes_t period;
+			snd_pcm_hw_params_get_period_size(params, &period, NULL);
+			if ((int)period > MAX_BLOCK_SIZE)
+				throw std::runtime_error("Period size of " + d.dev.name + " too large (" + std::to_string(period) + ")");
+			d.period = std::max(d.period, (int)period);
+
+			const AudioDriverAlsa::SampleConverter *conv = findConverter(*format);
+			int frameBytes = snd_pcm_format_physical_width(*format) / 8 * channels;
+			// room for two periods, slaves may catch up on a late read
+			if (capture) {
+				d.convCapture = conv;
+				d.frameBytesCapture = frameBytes;
+				d.pcmIn.assign(2 * MAX_BLOCK_SIZE * frameBytes, 0);
+			}
+			else {
+				d.convPlayback = conv;
+				d.frameBytesPlayback = frameBytes;
+				d.pcmOut.assign(2 * MAX_BLOCK_SIZE * frameBytes, 0);
+			}
+		}
+
+		// capture and playback of one device share a clock, start and stop them together
+		if (d.capture && d.playback && snd_pcm_link(d.capture, d.playback) < 0)
+			printf("Streams of %s not linked\n", id);
+
+		d.clock.setNominalRate(m_sampleRate);
+	}
+
+	void AudioDriverAlsaAggregate::closeDevice(DeviceStream &d)
+	{
+		if (d.capture) {
+			if (d.playback)
+				snd_pcm_unlink(d.capture);
+			snd_pcm_close(d.capture);
+			d.capture = nullptr;
+		}
+		if (d.playback) {
+			snd_pcm_close(d.playback);
+			d.playback = nullptr;
+		}
+		delete d.fifoCapture;
+		delete d.fifoPlayback;
+		d.fifoCapture = d.fifoPlayback = nullptr;
+	}
+
+	bool AudioDriverAlsaAggregate::startDevice(DeviceStream &d)
+	{
+		snd_pcm_t *handle = d.capture ? d.capture : d.playback;
+		int err;
+
+		if ((err = snd_pcm_prepare(handle)) < 0) {
+			printf("Prepare error (%s): %s\n", d.dev.name.c_str(), snd_strerror(err));
+			return false;
+		}
+
+		d.framesRead = d.framesWritten = 0;
+		d.capturePrimed = d.playbackPrimed = false;
+		d.clock.reset();
+		if (d.fifoCapture)
+			d.fifoCapture->clear();
+		if (d.fifoPlayback)
+			d.fifoPlayback->clear();
+
+		// two periods of silence, the playback buffer is full when the streams start
+		if (d.playback) {
+			memset(d.pcmOut.data(), 0, 2 * d.period * d.frameBytesPlayback);
+			snd_pcm_sframes_t r = snd_pcm_writei(d.playback, d.pcmOut.data(), 2 * d.period);
+			if (r < 0) {
+				printf("Priming error (%s): %s\n", d.dev.name.c_str(), snd_strerror((int)r));
+				return false;
+			}
+			d.framesWritten = r;
+		}
+
+		if ((err = snd_pcm_start(handle)) < 0) {
+			printf("Start error (%s): %s\n", d.dev.name.c_str(), snd_strerror(err));
+			return false;
+		}
+		return true;
+	}
+
+	void AudioDriverAlsaAggregate::stopDevice(DeviceStream &d)
+	{
+		snd_pcm_drop(d.capture ? d.capture : d.playback);
+	}
+
+	static void updateStreamClock(snd_pcm_t *handle, DllClock &clock, int64_t position, bool capture)
+	{
+		snd_pcm_status_t *status;
+		snd_pcm_status_alloca(&status);
+		if (snd_pcm_status(handle, status) < 0)
+			return;
+
+		snd_htimestamp_t ts;
+		snd_pcm_status_get_htstamp(status, &ts);
+		int64_t t = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		if (t == 0)
+			t = DllClock::now();
+
+		int64_t frame = capture ? position + (int64_t)snd_pcm_status_get_avail(status)
+		                        : position - (int64_t)snd_pcm_status_get_delay(status);
+		if (frame > 0)
+			clock.update((uint64_t)frame, t);
+	}
+
+	void AudioDriverAlsaAggregate::updateClocks(DeviceStream &d, bool master)
+	{
+		if (d.capture)
+			updateStreamClock(d.capture, d.clock, d.framesRead, true);
+		else
+			updateStreamClock(d.playback, d.clock, d.framesWritten, false);
+
+		// the master clock is the driver clock
+		if (master) {
+			if (d.capture)
+				updateStreamClock(d.capture, m_captureClock, d.framesRead, true);
+			if (d.playback)
+				updateStreamClock(d.playback, m_playbackClock, d.framesWritten, false);
+		}
+	}
+
+	double AudioDriverAlsaAggregate::clockRatio(const DeviceStream &d) const
+	{
+		const DeviceStream &master = *m_devices[0];
+		if (&d == &master || !d.clock.isLocked() || !master.clock.isLocked())
+			return 1.0;
+		return d.clock.getRate() / master.clock.getRate();
+	}
+
+	void AudioDriverAlsaAggregate::fillTelemetryInAudioThread(TelemetryData &t)
+	{
+		t.numXruns = 0;
+		for (auto d : m_devices)
+			t.numXruns += d->numXruns;
+	}
+
+	double AudioDriverAlsaAggregate::getClockRatio(int device) const
+	{
+		return clockRatio(*m_devices.at(device));
+	}
+
+	uint32_t AudioDriverAlsaAggregate::getCaptureFifoFill(int device) const
+	{
+		const DeviceStream &d = *m_devices.at(device);
+		return d.fifoCapture ? d.fifoCapture->available() : 0;
+	}
+
+	uint32_t AudioDriverAlsaAggregate::getPlaybackFifoFill(int device) const
+	{
+		const DeviceStream &d = *m_devices.at(device);
+		return d.fifoPlayback ? d.fifoPlayback->available() : 0;
+	}
+
+	void AudioDriverAlsaAggregate::showDevices()
+	{
+		for (size_t i = 0; i < m_devices.size(); i++) {
+			const DeviceStream &d = *m_devices[i];
+			std::cout << (i == 0 ? "master " : "slave  ") << d.dev.name
+				<< " in:" << d.dev.numChannelsCapture << "@" << d.captureOffset
+				<< " out:" << d.dev.numChannelsPlayback << "@" << d.playbackOffset
+				<< " period:" << d.period
+				<< " ratio:" << clockRatio(d)
+				<< " fifo:" << (d.fifoCapture ? d.fifoCapture->available() : 0) << "|" << (d.fifoPlayback ? d.fifoPlayback->available() : 0)
+				<< " xruns:" << d.numXruns << std::endl;
+		}
+	}
+
+	/*
+	 * Master device: blocking (poll) period I/O, paces the aggregate.
+	 */
+	int AudioDriverAlsaAggregate::readMaster(int nframes)
+	{
+		AUTIL_TRACE_SCOPE("alsa read", 0);
+		DeviceStream &d = *m_devices[0];
+		if (!d.capture)
+			return 0;
+
+		uint8_t *buf = d.pcmIn.data();
+		int len = nframes;
+		while (len > 0 && m_running) {
+			snd_pcm_sframes_t r = snd_pcm_readi(d.capture, buf, len);
+			if (r == -EAGAIN) {
+				snd_pcm_wait(d.capture, 1000);
+				continue;
+			}
+			if (r < 0)
+				return (int)r;
+			buf += r * d.frameBytesCapture;
+			len -= r;
+			d.framesRead += r;
+		}
+
+		size_t sampleBytes = d.frameBytesCapture / d.dev.numChannelsCapture;
+		for (int c = 0; c < d.dev.numChannelsCapture; c++)
+			d.convCapture->toFloat(m_capture[d.captureOffset + c].data(), d.pcmIn.data() + c * sampleBytes, d.frameBytesCapture, nframes);
+		return 0;
+	}
+
+	int AudioDriverAlsaAggregate::writeMaster(int nframes)
+	{
+		AUTIL_TRACE_SCOPE("alsa write", 0);
+		DeviceStream &d = *m_devices[0];
+		if (!d.playback)
+			return 0;
+
+		size_t sampleBytes = d.frameBytesPlayback / d.dev.numChannelsPlayback;
+		for (int c = 0; c < d.dev.numChannelsPlayback; c++)
+			d.convPlayback->fromFloat(d.pcmOut.data() + c * sampleBytes, d.frameBytesPlayback, m_playback[d.playbackOffset + c].data(), nframes);
+
+		uint8_t *buf = d.pcmOut.data();
+		int len = nframes;
+		while (len > 0 && m_running) {
+			snd_pcm_sframes_t r = snd_pcm_writei(d.playback, buf, len);
+			if (r == -EAGAIN) {
+				snd_pcm_wait(d.playback, 1000);
+				continue;
+			}
+			if (r < 0)
+				return (int)r;
+			buf += r * d.frameBytesPlayback;
+			len -= r;
+			d.framesWritten += r;
+		}
+		return 0;
+	}
+
+	void AudioDriverAlsaAggregate::recoverMaster(int err, int nframes)
+	{
+		AUTIL_TRACE_INSTANT("xrun", 0);
+		AUTIL_TRACE_SCOPE("xrun recovery", 0);
+		DeviceStream &d = *m_devices[0];
+		d.numXruns++;
+		printf("xrun on master %s: %s\n", d.dev.name.c_str(), snd_strerror(err));
+
+		stopDevice(d);
+		if (!startDevice(d)) {
+			m_running = false;
+			return;
+		}
+		m_captureClock.reset();
+		m_playbackClock.reset();
+
+		// keep the buffers aligned with the wall clock over the gap
+		int64_t lost = (DllClock::now() - m_tLastPeriod) * m_sampleRate / 1000000000LL - nframes;
+		if (lost > 0)
+			skipFramesInAudioThread((uint32_t)lost);
+	}
+
+	/*
+	 * Slave devices: non-blocking, drained and filled through the resampling FIFOs.
+	 */
+	void AudioDriverAlsaAggregate::readSlave(DeviceStream &d, int nframes)
+	{
+		AUTIL_TRACE_SCOPE("alsa read", d.index);
+		if (!d.capture)
+			return;
+
+		ResamplingFifo &fifo = *d.fifoCapture;
+		size_t sampleBytes = d.frameBytesCapture / d.dev.numChannelsCapture;
+		snd_pcm_uframes_t chunk = d.pcmIn.size() / d.frameBytesCapture;
+
+		for (;;) {
+			snd_pcm_uframes_t len = std::min(chunk, (snd_pcm_uframes_t)(fifo.getCapacity() - fifo.available()));
+			if (len == 0)
+				break;
+			snd_pcm_sframes_t r = snd_pcm_readi(d.capture, d.pcmIn.data(), len);
+			if (r == -EAGAIN)
+				break;
+			if (r < 0) {
+				recoverSlave(d, d.capture, (int)r);
+				break;
+			}
+			fifo.write(d.pcmIn.data(), d.frameBytesCapture, sampleBytes, r, d.convCapture->toFloat);
+			d.framesRead += r;
+			if ((snd_pcm_uframes_t)r < len)
+				break;
+		}
+
+		// one slave period of slack for its wakeup phase plus one aggregate period
+		uint32_t target = d.period + nframes;
+		if (!d.capturePrimed && fifo.available() >= target) {
+			d.capturePrimed = true;
+			fifo.resetControl();
+		}
+
+		if (!d.capturePrimed) {
+			for (auto out : d.fifoCaptureOut)
+				memset(out, 0, nframes * sizeof(float));
+			return;
+		}
+
+		// input: slave frames, output: master frames
+		double ratio = fifo.controlRatio(clockRatio(d), target, nframes);
+		if (fifo.read(d.fifoCaptureOut.data(), nframes, ratio) < (uint32_t)nframes)
+			d.capturePrimed = false;
+	}
+
+	void AudioDriverAlsaAggregate::writeSlave(DeviceStream &d, int nframes)
+	{
+		AUTIL_TRACE_SCOPE("alsa write", d.index);
+		if (!d.playback)
+			return;
+
+		ResamplingFifo &fifo = *d.fifoPlayback;
+		fifo.write(d.fifoPlaybackIn.data(), nframes);
+
+		uint32_t target = d.period + nframes;
+		if (!d.playbackPrimed && fifo.available() >= target) {
+			d.playbackPrimed = true;
+			fifo.resetControl();
+		}
+		if (!d.playbackPrimed)
+			return;
+
+		// keep the device buffer full, the FIFO absorbs the difference in period phase
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(d.playback);
+		if (avail < 0) {
+			recoverSlave(d, d.playback, (int)avail);
+			return;
+		}
+		uint32_t len = std::min((uint32_t)avail, (uint32_t)m_scratch[0].size());
+		if (len == 0)
+			return;
+
+		// input: master frames, output: slave frames
+		double ratio = fifo.controlRatio(1.0 / clockRatio(d), target, len);
+		if (fifo.read(m_scratchPtrs.data(), len, ratio) < len)
+			d.playbackPrimed = false;
+
+		size_t sampleBytes = d.frameBytesPlayback / d.dev.numChannelsPlayback;
+		for (int c = 0; c < d.dev.numChannelsPlayback; c++)
+			d.convPlayback->fromFloat(d.pcmOut.data() + c * sampleBytes, d.frameBytesPlayback, m_scratch[c].data(), len);
+
+		snd_pcm_sframes_t r = snd_pcm_writei(d.playback, d.pcmOut.data(), len);
+		if (r == -EAGAIN)
+			return;
+		if (r < 0) {
+			recoverSlave(d, d.playback, (int)r);
+			return;
+		}
+		d.framesWritten += r;
+	}
+
+	void AudioDriverAlsaAggregate::recoverSlave(DeviceStream &d, snd_pcm_t *handle, int err)
+	{
+		AUTIL_TRACE_INSTANT("xrun", d.index);
+		d.numXruns++;
+		printf("xrun on %s (%s): %s\n", d.dev.name.c_str(), handle == d.capture ? "capture" : "playback", snd_strerror(err));
+
+		// restart the linked pair, the FIFOs refill from scratch
+		stopDevice(d);
+		startDevice(d);
+	}
+
+	void AudioDriverAlsaAggregate::process()
+	{
+		applyRtConfigInAudioThread();
+
+		m_captureClock.setNominalRate(m_sampleRate);
+		m_playbackClock.setNominalRate(m_sampleRate);
+
+		for (auto d : m_devices) {
+			if (!startDevice(*d)) {
+				m_running = false;
+				return;
+			}
+		}
+		m_tLastPeriod = DllClock::now();
+
+		int nframes = m_blockSize;
+
+		while (m_running) {
+			processActionQueueInAudioThread();
+
+			int err = readMaster(nframes);
+			if (err < 0) {
+				recoverMaster(err, nframes);
+				continue;
+			}
+			beginPeriodInAudioThread(nframes);
+
+			for (size_t i = 1; i < m_devices.size(); i++)
+				readSlave(*m_devices[i], nframes);
+
+			// the devices keep running while paused, the buffers don't advance
+			if (m_paused) {
+				for (auto &out : m_playback)
+					memset(out.data(), 0, nframes * sizeof(float));
+			}
+			else processScheduledPeriodInAudioThread(nframes, [this](int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n) {
+				for (uint32_t ic = 0; ic < signalBuffer->channels; ic++) {
+					auto con = getBufferPortConnection(ib, ic);
+
+					if (con->isOutput) {
+						float *block = ((int)ic >= m_numChannelsPlayback) ? m_discard.data() : m_playback[ic].data();
+						signalBuffer->getBlock(ic, block + offset, n);
+					}
+					else {
+						float *block = ((int)ic >= m_numChannelsCapture) ? m_silence.data() : m_capture[ic].data();
+						signalBuffer->addBlock(ic, block + offset, n);
+					}
+				}
+			});
+
+			if ((err = writeMaster(nframes)) < 0) {
+				recoverMaster(err, nframes);
+				continue;
+			}
+
+			for (size_t i = 1; i < m_devices.size(); i++)
+				writeSlave(*m_devices[i], nframes);
+
+			for (auto d : m_devices)
+				updateClocks(*d, d == m_devices[0]);
+			m_tLastPeriod = DllClock::now();
+
+			if (!m_paused)
+				processSignalBufferObserverInAudioThread(nframes);
+		}
+
+		for (auto d : m_devices)
+			stopDevice(*d);
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "audio_driver_base.h"
+#include "audio_driver_alsa.h"
+#include "resampler.h"
+
+#include <alsa/asoundlib.h>
+
+namespace autil {
+	/*
+	 * Several ALSA devices presented as one driver. devices[0] is the clock master and drives
+	 * the period loop, every other device runs on its own crystal and is resampled into the
+	 * master clock domain: capture and playback of a slave device go through a ResamplingFifo
+	 * whose ratio follows the DllClock estimates of both devices, trimmed by the FIFO fill level.
+	 *
+	 * Aggregate channels are the devices' channels concatenated in order
+	 * (device 0 channels 0..n0-1, device 1 channels n0.., ...), buffer channel i maps to
+	 * aggregate channel i.
+	 */
+	class AudioDriverAlsaAggregate : public AudioDriverBase
+	{
+	public:
+		struct Device {
+			std::string name;
+			int numChannelsCapture;
+			int numChannelsPlayback;
+
+			Device(const std::string &name = "", int numChannelsCapture = 2, int numChannelsPlayback = 2)
+				: name(name), numChannelsCapture(numChannelsCapture), numChannelsPlayback(numChannelsPlayback) {}
+		};
+
+		struct StreamProperties {
+			std::vector<Device> devices; // devices[0] is the clock master
+			int sampleRate;
+			int blockSize;
+
+			RtConfig rt;
+
+			StreamProperties() {
+				sampleRate = 48000;
+				blockSize = 256;
+			}
+		};
+
+		AudioDriverAlsaAggregate(const std::string &name, const StreamProperties &props);
+		~AudioDriverAlsaAggregate();
+
+		inline int getNumDevices() const { return (int)m_devices.size(); }
+		// estimated rate of a device relative to the master, 1.0 until both clocks are locked
+		double getClockRatio(int device) const;
+		// FIFO fill levels of a slave device in frames (0 for the master)
+		uint32_t getCaptureFifoFill(int device) const;
+		uint32_t getPlaybackFifoFill(int device) const;
+
+		void showDevices();
+
+		static const int MAX_BLOCK_SIZE = 4096;
+
+	private:
+		struct DeviceStream {
+			Device dev;
+			int index; // in m_devices, 0 = master
+			snd_pcm_t *capture, *playback;
+			snd_pcm_format_t formatCapture, formatPlayback;
+			const AudioDriverAlsa::SampleConverter *convCapture, *convPlayback;
+			int frameBytesCapture, frameBytesPlayback;
+			int period; // device period in frames
+			int captureOffset, playbackOffset; // first aggregate channel of this device
+
+			std::vector<uint8_t> pcmIn, pcmOut; // interleaved
+			ResamplingFifo *fifoCapture, *fifoPlayback; // slaves only
+			std::vector<float*> fifoCaptureOut, fifoPlaybackIn; // planar pointers into the aggregate blocks
+
+			bool capturePrimed, playbackPrimed; // FIFO filled to its target since the last start
+
+			DllClock clock;
+			int64_t framesRead, framesWritten;
+			int numXruns;
+
+			DeviceStream() : index(0), capture(nullptr), playback(nullptr), convCapture(nullptr), convPlayback(nullptr),
+				period(0), captureOffset(0), playbackOffset(0), fifoCapture(nullptr), fifoPlayback(nullptr),
+				capturePrimed(false), playbackPrimed(false), framesRead(0), framesWritten(0), numXruns(0) {}
+		};
+
+		RttThread *m_audioThread;
+		std::vector<DeviceStream*> m_devices;
+
+		// planar aggregate blocks, one per aggregate channel
+		std::vector<std::vector<float>> m_capture, m_playback;
+		std::vector<float> m_silence, m_discard;
+		// resampled slave playback before interleaving
+		std::vector<std::vector<float>> m_scratch;
+		std::vector<float*> m_scratchPtrs;
+
+		int64_t m_tLastPeriod;
+
+		void openDevice(DeviceStream &d);
+		void closeDevice(DeviceStream &d);
+		bool startDevice(DeviceStream &d);
+		void stopDevice(DeviceStream &d);
+
+		void updateClocks(DeviceStream &d, bool master);
+		double clockRatio(const DeviceStream &d) const;
+
+		int readMaster(int nframes);
+		int writeMaster(int nframes);
+		void recoverMaster(int err, int nframes);
+		void readSlave(DeviceStream &d, int nframes);
+		void writeSlave(DeviceStream &d, int nframes);
+		void recoverSlave(DeviceStream &d, snd_pcm_t *handle, int err);
+
+		void fillTelemetryInAudioThread(TelemetryData &t);
+		void process();
+	};
+}
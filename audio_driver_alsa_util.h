@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include "audio_driver_alsa.h"
+
+/*
+ * ALSA stream setup helpers shared by the ALSA drivers (audio_driver_alsa.cpp).
+ */
+namespace autil {
+	const AudioDriverAlsa::SampleConverter *findConverter(snd_pcm_format_t format);
+
+	// access, format (negotiated if *format is SND_PCM_FORMAT_UNKNOWN), channels and rate into params
+	int setparams_stream(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_format_t *format,
+		int channels, int rate, const char *id);
+	// copy tparams to params and request a period of bufsize frames, two periods per buffer
+	int setparams_bufsize(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_hw_params_t *tparams,
+		snd_pcm_uframes_t bufsize, const char *id);
+	// install hw params, sw params (manual start, avail_min, monotonic timestamps)
+	int setparams_set(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_sw_params_t *swparams,
+		int availMin, const char *id);
+
+	int throwIfError(int err, const std::string &msg);
+}
@@ -10,33 +10,81 @@
 
 namespace autil {
 AudioDriverBase::AudioDriverBase(const std::string &name) :
-    m_totalFramesProcessed(0),
+    m_name(name),
     m_running(false),
-    m_newActions(false),
     m_paused(false),
-    m_name(name)
+    m_freewheel(false),
+    m_totalFramesProcessed(0),
+    m_actionFrame(0),
+    m_newActions(false)
 {
     memset(m_buffers, 0, sizeof(m_buffers));
     memset(m_bufferPool, 0, sizeof(m_bufferPool));
+
+    m_scheduledActions.reserve(MAX_SCHEDULED_ACTIONS);
+    m_numScheduledActions = 0;
+    m_scheduledSeq = 0;
+    m_numLateActions = 0;
+    m_numActionOverflows = 0;
+
+    static_assert(MAX_SIGNAL_BUFFERS <= CallbackStats::MAX_BUFFERS, "CallbackStats::MAX_BUFFERS too small");
+    m_tPeriodBegin = m_tLastPeriodBegin = 0;
+    m_lastPeriodFrames = 0;
+    memset(m_stageNs, 0, sizeof(m_stageNs));
+    memset(m_bufferNs, 0, sizeof(m_bufferNs));
+    m_lastJitterNs = 0;
+
+    m_telemetry = m_telemetryOld = nullptr;
+    m_telemetryRegistryChanged = false;
+    m_numCommitFailures = 0;
 }
 
 
 AudioDriverBase::~AudioDriverBase()
 {
     m_running = false;
+    delete m_telemetry;
+    delete m_telemetryOld;
 }
 
 void AudioDriverBase::pauseAudioProcessing()
 {
     m_paused = true;
     m_newActions = true;
+    wakeupAudioThread();
     m_evtActionQueueProcessed.Wait();
 }
 
+void AudioDriverBase::setRtConfig(const RtConfig &config)
+{
+    RttLocalLock ll(m_mtxActionQueue);
+    sync();
+    m_rtConfig = config;
+    m_actionQueue.push([this]() { applyRtConfigInAudioThread(); });
+    commit();
+}
+
+void AudioDriverBase::applyRtConfigInAudioThread()
+{
+    AUTIL_TRACE_THREAD("audio");
+    RtReport report = applyRtConfig(m_rtConfig);
+    report.show();
+
+    RttLocalLock ll(m_mtxRtReport);
+    m_rtReport = report;
+}
+
+RtReport AudioDriverBase::getRtReport() const
+{
+    RttLocalLock ll(m_mtxRtReport);
+    return m_rtReport;
+}
+
 void AudioDriverBase::addObserver(SignalBufferObserver *pool)
 {
     _uniquePtrArrayAdd((void**)m_bufferPool, MAX_SIGNAL_BUFFERS, pool);
-    pool->lastUpdate = -1;
+    pool->lastUpdate = m_actionFrame;
+    m_telemetryRegistryChanged = true;
 }
 
 void AudioDriverBase::removeSignal(SignalBuffer *buffer)
@@ -54,6 +102,7 @@ void AudioDriverBase::removeSignal(SignalBuffer *buffer)
         con->port = nullptr;
         con->isOutput = false;
     }
+    m_telemetryRegistryChanged = true;
 }
 
 void AudioDriverBase::removeObserver(SignalBufferObserver *observer)
@@ -62,6 +111,7 @@ void AudioDriverBase::removeObserver(SignalBufferObserver *observer)
     if (io < 0)
         throw std::runtime_error("Tried to remove unknown SignalBufferObserver");
     m_bufferPool[io] = nullptr;
+    m_telemetryRegistryChanged = true;
 }
 
 int AudioDriverBase::_uniquePtrArrayAdd(void **array, int len, void* ptr)
@@ -89,7 +139,11 @@ int AudioDriverBase::_uniquePtrArrayIndexOf(void **array, int len, void* ptr)
 }
 
 void AudioDriverBase::processActionQueueInAudioThread() {
+    m_actionFrame = m_totalFramesProcessed;
+
     if (m_newActions) {
+        AUTIL_TRACE_SCOPE("actions");
+        int64_t t0 = DllClock::now();
         //printf("AudioDriver: processing queue...\n");
 
         while (m_actionQueue.size()) {
@@ -111,27 +165,276 @@ void AudioDriverBase::processActionQueueInAudioThread() {
 
         m_newActions = false;
         m_evtActionQueueProcessed.Signal();
+
+        m_stageNs[CallbackStats::ActionQueue] = DllClock::now() - t0;
+        m_callbackStats.stages[CallbackStats::ActionQueue].record(m_stageNs[CallbackStats::ActionQueue]);
     }
 }
 
-void AudioDriverBase::processSignalBufferObserverInAudioThread(uint32_t nframes) {
-    // signal buffer observers
+void AudioDriverBase::beginPeriodInAudioThread(uint32_t nframes) {
+    int64_t t = DllClock::now();
+
+    if (m_tLastPeriodBegin != 0 && m_lastPeriodFrames != 0) {
+        int64_t expected = (int64_t)m_lastPeriodFrames * 1000000000LL / m_sampleRate;
+        int64_t jitter = (t - m_tLastPeriodBegin) - expected;
+        m_lastJitterNs = jitter < 0 ? -jitter : jitter;
+        m_callbackStats.wakeupJitter.record(m_lastJitterNs);
+    }
+
+    m_tPeriodBegin = m_tLastPeriodBegin = t;
+    m_lastPeriodFrames = nframes;
+}
+
+void AudioDriverBase::scheduleActionInAudioThread(uint64_t frame, std::function<void()> &&action) {
+    // capacity is checked in Request::execute(), this never allocates
+    if (m_scheduledActions.size() == m_scheduledActions.capacity()) {
+        m_numActionOverflows++;
+        action();
+        return;
+    }
+
+    m_scheduledActions.push_back(ScheduledAction{ frame, m_scheduledSeq++, std::move(action) });
+    std::push_heap(m_scheduledActions.begin(), m_scheduledActions.end());
+    m_numScheduledActions.store((uint32_t)m_scheduledActions.size(), std::memory_order_release);
+}
+
+void AudioDriverBase::runScheduledActionsInAudioThread(uint64_t frame) {
+    while (!m_scheduledActions.empty() && m_scheduledActions.front().frame <= frame) {
+        std::pop_heap(m_scheduledActions.begin(), m_scheduledActions.end());
+        ScheduledAction &sa = m_scheduledActions.back();
+
+        if (sa.frame < frame)
+            m_numLateActions++;
+
+        AUTIL_TRACE_INSTANT("scheduled action", (uint32_t)frame);
+
+        m_actionFrame = frame;
+        try {
+            sa.action();
+        }
+        catch (const std::exception &ex) {
+            std::cout << "AudioDriver exception:" << ex.what() << std::endl;
+        }
+        m_scheduledActions.pop_back();
+        m_numScheduledActions.store((uint32_t)m_scheduledActions.size(), std::memory_order_release);
+    }
+}
+
+uint64_t AudioDriverBase::nextObserverCommitFrame() const {
+    uint64_t next = UINT64_MAX;
+    for (int ip = 0; ip < MAX_SIGNAL_BUFFERS; ip++) {
+        auto bufferPool = m_bufferPool[ip];
+        if (!bufferPool || bufferPool->lastUpdate == (uint64_t)-1 || bufferPool->updateInterval == (uint32_t)-1)
+            continue;
+        next = (std::min)(next, bufferPool->lastUpdate + bufferPool->updateInterval);
+    }
+    return next;
+}
+
+// commit every observer whose next commit point is at or before frame (the buffers' current position)
+void AudioDriverBase::commitObserversInAudioThread(uint64_t frame) {
+    int64_t t0 = DllClock::now();
+
     for (int ip = 0; ip < MAX_SIGNAL_BUFFERS; ip++) {
         auto bufferPool = m_bufferPool[ip];
 
         if (!bufferPool)
             continue;
 
-        if (bufferPool->lastUpdate == -1)
-            bufferPool->lastUpdate = m_totalFramesProcessed;
+        if (bufferPool->lastUpdate == (uint64_t)-1)
+            bufferPool->lastUpdate = frame;
+
+        if (bufferPool->updateInterval == (uint32_t)-1 || frame < bufferPool->lastUpdate + bufferPool->updateInterval)
+            continue;
+
+        // on the hop grid when the period was split at the commit point, otherwise (paused, one-piece routing) the grid restarts here
+        bufferPool->lastUpdate = frame;
+
+        // no deadline while freewheeling (or Overflow::Block): hold the graph until the consumer made room
+        // (or a request is waiting for the audio thread, e.g. to remove this observer)
+        while ((m_freewheel || bufferPool->blocksWhenFull()) && m_running && !m_newActions && !bufferPool->canCommit())
+            bufferPool->waitForRelease(100);
 
-        if (bufferPool->updateInterval >= 0 && (m_totalFramesProcessed - bufferPool->lastUpdate) > bufferPool->updateInterval) {
-            bufferPool->lastUpdate = m_totalFramesProcessed;
-            if (!bufferPool->commit()) {
+        AUTIL_TRACE_SCOPE("commit", ip);
+        // queued observers count their losses, see getNumLostWindows()
+        if (!bufferPool->commit(frame)) {
+            AUTIL_TRACE_INSTANT("commit failed", ip);
+            m_numCommitFailures++;
+            if (!bufferPool->m_queue)
                 printf("History comit failed! Update thread is too slow.\n");
-                bufferPool->lastUpdate += bufferPool->updateInterval; // add penalty time
+        }
+    }
+
+    addStageTime(CallbackStats::Observers, t0);
+}
+
+void AudioDriverBase::routePlanarInAudioThread(int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n,
+    std::vector<std::vector<float>> &capture, std::vector<std::vector<float>> &playback, float *silence, float *discard)
+{
+    for (uint32_t ic = 0; ic < signalBuffer->channels; ic++) {
+        auto con = getBufferPortConnection(ib, ic);
+        if (con->isOutput) {
+            float *block = (ic < playback.size()) ? playback[ic].data() : discard;
+            signalBuffer->getBlock(ic, block + offset, n);
+        }
+        else {
+            float *block = (ic < capture.size()) ? capture[ic].data() : silence;
+            signalBuffer->addBlock(ic, block + offset, n);
+        }
+    }
+}
+
+void AudioDriverBase::processSignalBufferObserverInAudioThread(uint32_t nframes) {
+    // observers not yet committed by processScheduledPeriodInAudioThread() (drivers routing the period in one piece)
+    commitObserversInAudioThread(m_totalFramesProcessed + nframes);
+
+    m_totalFramesProcessed += nframes;
+
+    // end of the period: record the stage times accumulated since beginPeriodInAudioThread()
+    uint64_t buffersNs = 0;
+    for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++) {
+        if (m_buffers[ib])
+            m_callbackStats.buffers[ib].record(m_bufferNs[ib]);
+        buffersNs += m_bufferNs[ib];
+    }
+    m_stageNs[CallbackStats::Buffers] = buffersNs;
+
+    for (int s = CallbackStats::Buffers; s < CallbackStats::NUM_STAGES; s++)
+        m_callbackStats.stages[s].record(m_stageNs[s]);
+
+    uint32_t load = 0;
+    if (m_tPeriodBegin != 0) {
+        int64_t callbackNs = DllClock::now() - m_tPeriodBegin;
+        load = (uint32_t)((uint64_t)callbackNs * m_sampleRate / ((uint64_t)nframes * 100000));
+        m_stageNs[CallbackStats::Callback] = callbackNs;
+        m_callbackStats.stages[CallbackStats::Callback].record(callbackNs);
+        m_callbackStats.load.record(load);
+        m_tPeriodBegin = 0;
+    }
+
+    if (m_telemetry)
+        publishTelemetryInAudioThread(nframes, load);
+
+    memset(m_stageNs, 0, sizeof(m_stageNs));
+    memset(m_bufferNs, 0, sizeof(m_bufferNs));
+    m_lastJitterNs = 0;
+}
+
+void AudioDriverBase::enableTelemetry(const std::string &name)
+{
+    // the segment is created here, the audio thread only stores to it
+    TelemetrySegment *segment = new TelemetrySegment(name.empty() ? m_name : name, m_name);
+
+    RttLocalLock ll(m_mtxActionQueue);
+    sync();
+    m_actionQueue.push([this, segment]() {
+        m_telemetryOld = m_telemetry;
+        m_telemetry = segment;
+        m_telemetryRegistryChanged = true;
+    });
+    commit();
+    // not running: the action runs at start, nothing else uses the previous segment
+    delete m_telemetryOld;
+    m_telemetryOld = nullptr;
+}
+
+void AudioDriverBase::disableTelemetry()
+{
+    RttLocalLock ll(m_mtxActionQueue);
+    sync();
+    m_actionQueue.push([this]() {
+        m_telemetryOld = m_telemetry;
+        m_telemetry = nullptr;
+    });
+    commit();
+    delete m_telemetryOld;
+    m_telemetryOld = nullptr;
+}
+
+// one seqlock write per period: counters, timing and (when changed) the buffer/observer registry
+void AudioDriverBase::publishTelemetryInAudioThread(uint32_t nframes, uint32_t load) {
+    TelemetryData &t = m_telemetry->beginWrite();
+
+    t.sampleRate = m_sampleRate;
+    t.blockSize = m_blockSize;
+    t.period = nframes;
+    t.numChannelsCapture = m_numChannelsCapture;
+    t.numChannelsPlayback = m_numChannelsPlayback;
+    t.running = m_running;
+    t.paused = m_paused;
+    t.freewheel = m_freewheel;
+    t.frame = m_totalFramesProcessed;
+    t.numPeriods++;
+    t.tUpdate = DllClock::now();
+    t.numLateActions = m_numLateActions;
+    t.numActionOverflows = m_numActionOverflows;
+    t.numCommitFailures = m_numCommitFailures;
+
+    for (int s = 0; s < CallbackStats::NUM_STAGES; s++) {
+        t.stages[s].last = m_stageNs[s];
+        t.stages[s].max = (std::max)(t.stages[s].max, m_stageNs[s]);
+        t.stages[s].sum += m_stageNs[s];
+    }
+    t.jitterLast = m_lastJitterNs;
+    t.jitterMax = (std::max)(t.jitterMax, m_lastJitterNs);
+    t.jitterSum += m_lastJitterNs;
+    t.load = load;
+    t.loadMax = (std::max)(t.loadMax, load);
+
+    static_assert(MAX_SIGNAL_BUFFERS <= TelemetryData::MAX_ENTRIES, "TelemetryData::MAX_ENTRIES too small");
+    for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++)
+        t.buffers[ib].nsSum += m_bufferNs[ib];
+
+    if (m_telemetryRegistryChanged) {
+        t.numBuffers = t.numObservers = 0;
+        for (int i = 0; i < MAX_SIGNAL_BUFFERS; i++) {
+            auto &tb = t.buffers[i];
+            SignalBuffer *buffer = m_buffers[i];
+            if (buffer) {
+                strncpy(tb.name, buffer->name.c_str(), TelemetryData::MAX_NAME - 1);
+                tb.name[TelemetryData::MAX_NAME - 1] = 0;
+                tb.channels = buffer->channels;
+                tb.size = buffer->size;
+                tb.isOutput = getBufferPortConnection(i, 0)->isOutput;
+                t.numBuffers++;
             }
+            else {
+                tb.name[0] = 0;
+                tb.channels = tb.size = tb.isOutput = 0;
+            }
+            t.observers[i].used = m_bufferPool[i] != nullptr;
+            t.numObservers += t.observers[i].used;
         }
+        m_telemetryRegistryChanged = false;
+    }
+
+    for (int i = 0; i < MAX_SIGNAL_BUFFERS; i++) {
+        SignalBufferObserver *observer = m_bufferPool[i];
+        if (!observer)
+            continue;
+        auto &to = t.observers[i];
+        to.numBuffers = (uint32_t)observer->m_hists.size();
+        to.hopSize = observer->updateInterval;
+        to.windowEnd = observer->windowEnd;
+        to.numLost = observer->getNumLostWindows();
+    }
+
+    fillTelemetryInAudioThread(t);
+
+    m_telemetry->endWrite();
+}
+
+// Frames the device dropped (e.g. xrun): advance the frame clock and all signal buffers
+// so positions and timestamps stay consistent with real time.
+void AudioDriverBase::skipFramesInAudioThread(uint32_t nframes) {
+    if (nframes == 0)
+        return;
+
+    for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++) {
+        SignalBuffer *signalBuffer = m_buffers[ib];
+        if (!signalBuffer)
+            continue;
+        signalBuffer->skip(nframes, !getBufferPortConnection(ib, 0)->isOutput);
     }
 
     m_totalFramesProcessed += nframes;
@@ -152,6 +455,7 @@ void AudioDriverBase::addSignal(SignalBuffer *buffer, const std::vector<BufferPo
     }
 
     buffer->resetIterator();
+    m_telemetryRegistryChanged = true;
 }
 
 
@@ -2,6 +2,9 @@
 
 #include <vector>
 #include <queue>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
 
 #include <functional>
 
@@ -10,6 +13,11 @@
 
 #include "signal_buffer.h"
 #include "signal_processor.h"
+#include "rt_config.h"
+#include "dll_clock.h"
+#include "callback_stats.h"
+#include "telemetry.h"
+#include "tracer.h"
 
 namespace autil {
     class AudioDriverBase
@@ -50,8 +58,19 @@ namespace autil {
 
 			std::vector<SignalBuffer *> buffers;
 
+			bool scheduled;
+			uint64_t frame;
+
 		public:
-            Request(AudioDriverBase *driver) : driver(driver) {}
+            Request(AudioDriverBase *driver) : driver(driver), scheduled(false), frame(0) {}
+
+			// execute() takes effect at this absolute frame (getFrame() clock) instead of the next period,
+			// the audio thread splits the period at the exact sample
+			Request &at(uint64_t frame) {
+				this->scheduled = true;
+				this->frame = frame;
+				return *this;
+			}
 
 			Request &addBuffer(SignalBuffer *buffer, Connect connection) {
                 std::vector<BufferPortConnection> cons;
@@ -59,7 +78,8 @@ namespace autil {
                 for (uint32_t c = 0; c < buffer->channels; c++) {
                     cons.push_back(BufferPortConnection{driver->signalPortNew(connection, c, buffer->name), isPlayback});
                 }
-                actions.push([this, buffer, cons]() { driver->addSignal(buffer, cons); });
+                auto d = driver; // scheduled actions may outlive the Request
+                actions.push([d, buffer, cons]() { d->addSignal(buffer, cons); });
 
                 undoActions.push(std::bind(&AudioDriverBase::removeSignal, driver, buffer));
 				buffers.push_back(buffer);
@@ -83,12 +103,24 @@ namespace autil {
 
 
 			void execute() {
+				AUTIL_TRACE_SCOPE("request");
 				RttLocalLock ll(driver->m_mtxActionQueue);
 
 				driver->sync();
 
+				if (scheduled && driver->m_numScheduledActions.load() + actions.size() > (size_t)MAX_SCHEDULED_ACTIONS)
+					throw std::runtime_error("Too many scheduled actions!");
+
 				while (actions.size()) {
-					driver->m_actionQueue.push(actions.front());
+					if (scheduled) {
+						auto d = driver;
+						auto f = frame;
+						auto a = actions.front();
+						driver->m_actionQueue.push([d, f, a]() mutable { d->scheduleActionInAudioThread(f, std::move(a)); });
+					}
+					else {
+						driver->m_actionQueue.push(actions.front());
+					}
 					actions.pop();
 				}
 				driver->commit();
@@ -128,11 +160,40 @@ namespace autil {
 		inline int getSampleRate() const { return m_sampleRate; }
 		inline int getBlockSize() const { return m_blockSize; }
 		inline uint32_t getClock() const { return m_totalFramesProcessed; }
+		// 64-bit frame clock, the time base of Request::at()
+		inline uint64_t getFrame() const { return m_totalFramesProcessed; }
+		// scheduled actions that ran after their frame (scheduled in the past or while paused)
+		inline uint32_t getNumLateActions() const { return m_numLateActions; }
+		// scheduled actions that ran right away because MAX_SCHEDULED_ACTIONS were pending
+		inline uint32_t getNumActionOverflows() const { return m_numActionOverflows; }
+		// running faster than real time (JACK freewheel, free-running Null driver): observer commits block instead of dropping
+		inline bool isFreewheeling() const { return m_freewheel; }
 
         virtual void setBlockSize(int blockSize) = 0;
 
+        // smoothed mapping between the frame clock (SignalBuffer positions) and CLOCK_MONOTONIC, per stream
+        inline const DllClock &getCaptureClock() const { return m_captureClock; }
+        inline const DllClock &getPlaybackClock() const { return m_playbackClock; }
+
+        // applied in the audio thread at start and whenever changed
+        void setRtConfig(const RtConfig &config);
+        inline const RtConfig &getRtConfig() const { return m_rtConfig; }
+        // copy of the report of the last apply, the audio thread replaces it
+        RtReport getRtReport() const;
+
+        // per-callback stage timing, jitter and load; take snapshots from any thread
+        inline const CallbackStats &getCallbackStats() const { return m_callbackStats; }
+
+        // publish the driver state in shared memory (/dev/shm/autil-<name>, default: the driver name)
+        // for external monitors such as autil-telemetry, updated every period without syscalls
+        void enableTelemetry(const std::string &name = "");
+        void disableTelemetry();
+        // observer windows dropped because the consumer was too slow, all observers
+        inline uint64_t getNumCommitFailures() const { return m_numCommitFailures; }
+
 		static const int MAX_SIGNAL_BUFFERS = 16;
 		static const int MAX_CHANNELS_PER_BUFFER = 4;
+		static const int MAX_SCHEDULED_ACTIONS = 256;
     protected:
         struct BufferPortConnection {
             void *port;
@@ -163,14 +224,82 @@ namespace autil {
 		inline void commit(bool async = false) {
 			sync();
 			m_newActions = true;
+			wakeupAudioThread();
             if (!async && m_running) {
 				m_evtActionQueueProcessed.Wait();
 			}
 		}
 
+        // drivers that block on the device (poll) override this so queued actions don't wait for the next period
+        virtual void wakeupAudioThread() {}
+
         void processActionQueueInAudioThread();
         void processSignalBufferObserverInAudioThread(uint32_t nframes);
 
+        // Runs route(ib, buffer, offset, n) for each signal buffer over the period [0, nframes), split at the frames
+        // of scheduled actions, which run right before the first sample they apply to, and at observer commit points,
+        // so each commit stages the window ending exactly on its hop grid. Call before processSignalBufferObserverInAudioThread().
+        template<typename Route>
+        void processScheduledPeriodInAudioThread(uint32_t nframes, Route route) {
+            uint32_t offset = 0;
+            do {
+                uint64_t frame = m_totalFramesProcessed + offset;
+                runScheduledActionsInAudioThread(frame);
+
+                uint32_t n = nframes - offset;
+                if (!m_scheduledActions.empty() && m_scheduledActions.front().frame < frame + n)
+                    n = (uint32_t)(m_scheduledActions.front().frame - frame);
+
+                uint64_t commitFrame = nextObserverCommitFrame();
+                if (commitFrame > frame && commitFrame < frame + n)
+                    n = (uint32_t)(commitFrame - frame);
+
+                for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++) {
+                    SignalBuffer *signalBuffer = m_buffers[ib];
+                    if (!signalBuffer)
+                        continue;
+                    int64_t t0 = DllClock::now();
+                    AUTIL_TRACE_SCOPE("buffer", ib);
+                    route(ib, signalBuffer, offset, n);
+                    m_bufferNs[ib] += DllClock::now() - t0;
+                }
+                offset += n;
+
+                commitObserversInAudioThread(frame + n);
+            } while (offset < nframes);
+        }
+
+        // route for drivers with one planar block per device channel (null, net): buffer channel ic reads capture[ic]
+        // or writes playback[ic], channels beyond the device channels read silence or write to discard so they still advance
+        void routePlanarInAudioThread(int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n,
+            std::vector<std::vector<float>> &capture, std::vector<std::vector<float>> &playback, float *silence, float *discard);
+
+        // the audio thread woke up for a period of nframes (device ready, timer, JACK callback)
+        void beginPeriodInAudioThread(uint32_t nframes);
+        inline void addStageTime(int stage, int64_t t0) { m_stageNs[stage] += DllClock::now() - t0; }
+        void skipFramesInAudioThread(uint32_t nframes);
+        void applyRtConfigInAudioThread();
+
+        RtConfig m_rtConfig;
+        RtReport m_rtReport;
+        mutable RttMutex m_mtxRtReport;
+
+        DllClock m_captureClock, m_playbackClock;
+
+        CallbackStats m_callbackStats;
+        int64_t m_tPeriodBegin, m_tLastPeriodBegin;
+        uint32_t m_lastPeriodFrames;
+        uint64_t m_stageNs[CallbackStats::NUM_STAGES]; // accumulated over the current period
+        uint64_t m_bufferNs[MAX_SIGNAL_BUFFERS];
+        uint64_t m_lastJitterNs;
+
+        TelemetrySegment *m_telemetry, *m_telemetryOld;
+        bool m_telemetryRegistryChanged;
+        volatile uint64_t m_numCommitFailures;
+        void publishTelemetryInAudioThread(uint32_t nframes, uint32_t load);
+        // driver specific counters (xruns, recoveries, ...), inside the seqlock write
+        virtual void fillTelemetryInAudioThread(TelemetryData &) {}
+
 
 		int m_sampleRate;
 		int m_blockSize;
@@ -184,7 +313,9 @@ namespace autil {
 
         volatile bool m_running;
         volatile bool m_paused;
-		unsigned long m_totalFramesProcessed;
+        volatile bool m_freewheel;
+		uint64_t m_totalFramesProcessed;
+		uint64_t m_actionFrame; // frame at which the action being run takes effect
 		
 
 		// we use bare arrays here
@@ -198,12 +329,34 @@ namespace autil {
 		RttEvent m_evtActionQueueProcessed;
 		std::queue<std::function<void()>> m_actionQueue;
 
+		// min-heap on (frame, seq), preallocated to MAX_SCHEDULED_ACTIONS, audio thread only
+		struct ScheduledAction {
+			uint64_t frame;
+			uint64_t seq;
+			std::function<void()> action;
+
+			// std::push_heap builds a max-heap, invert for the earliest frame on top
+			inline bool operator<(const ScheduledAction &other) const {
+				return frame > other.frame || (frame == other.frame && seq > other.seq);
+			}
+		};
+		std::vector<ScheduledAction> m_scheduledActions;
+		std::atomic<uint32_t> m_numScheduledActions; // size of m_scheduledActions, for the capacity check of other threads
+		uint64_t m_scheduledSeq;
+		volatile uint32_t m_numLateActions, m_numActionOverflows;
+
+		void scheduleActionInAudioThread(uint64_t frame, std::function<void()> &&action);
+		void runScheduledActionsInAudioThread(uint64_t frame);
+
+		uint64_t nextObserverCommitFrame() const;
+		void commitObserversInAudioThread(uint64_t frame);
+
 
 
         BufferPortConnection m_bufferPortConnections[MAX_SIGNAL_BUFFERS*MAX_CHANNELS_PER_BUFFER];
 
         inline BufferPortConnection *getBufferPortConnection(int bufferId, int channel) {
-            return &m_bufferPortConnections[MAX_SIGNAL_BUFFERS * bufferId + channel];
+            return &m_bufferPortConnections[MAX_CHANNELS_PER_BUFFER * bufferId + channel];
         }
 
 
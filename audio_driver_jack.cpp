@@ -14,6 +14,9 @@ namespace autil {
     AudioDriverJack::AudioDriverJack(const std::string &name) : AudioDriverBase(name)
 	{
 		memset(m_bufferPortConnections, 0, sizeof(m_bufferPortConnections));
+
+		// JACK already runs the process thread with RT scheduling
+		m_rtConfig.policy = -1;
 		
 		m_jackClient = initJack();
 
@@ -135,6 +138,8 @@ namespace autil {
 
 		jack_set_process_callback(client, &AudioDriver::jackProcess, this);
 		jack_on_shutdown(client, &AudioDriver::jackShutdown, this);
+		jack_set_thread_init_callback(client, &AudioDriverJack::jackThreadInit, this);
+		jack_set_freewheel_callback(client, &AudioDriverJack::jackFreewheel, this);
 
 		m_portsCapture = jack_get_ports(client, nullptr, nullptr, JackPortIsOutput | JackPortIsPhysical);
 		if (m_portsCapture == nullptr) {
@@ -171,6 +176,9 @@ namespace autil {
 		if (!ad->m_running)
 			return 1;
 
+		AUTIL_TRACE_SCOPE("jack process", nframes);
+		ad->beginPeriodInAudioThread(nframes);
+
         processActionQueueInAudioThread();
 
 		if (ad->m_paused)
@@ -178,12 +186,7 @@ namespace autil {
 
 
 		// signal buffers
-		for (int ib = 0; ib < MAX_SIGNAL_BUFFERS; ib++) {
-			SignalBuffer *signalBuffer = ad->m_buffers[ib];
-
-			if (!signalBuffer)
-				continue;
-
+		ad->processScheduledPeriodInAudioThread(nframes, [ad, nframes](int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n) {
 			for (uint32_t ic = 0; ic < signalBuffer->channels; ic++) {
 				auto con = ad->getBufferPortConnection(ib, ic);
 
@@ -192,23 +195,22 @@ namespace autil {
 
 				jack_default_audio_sample_t * block = (jack_default_audio_sample_t *)jack_port_get_buffer(con->port, nframes);
 
-				
-
 				if (block == NULL) {
 					continue;
 					//throw "Block is NULL!";
 				}
 
 				if (con->isOutput) {
-					signalBuffer->getBlock(ic, block, nframes);
+					signalBuffer->getBlock(ic, block + offset, n);
 				}
 				else {
-					signalBuffer->addBlock(ic, block, nframes);
-				}				
+					signalBuffer->addBlock(ic, block + offset, n);
+				}
 			}
-		}
+		});
 
 		// stream processors
+		int64_t tProcessors = DllClock::now();
 		for (auto streamerPtr : ad->m_streamers) {
 			auto &streamer(*streamerPtr);
 
@@ -223,6 +225,7 @@ namespace autil {
 				ad->m_newActions = true;
 			}
 		}
+		ad->addStageTime(CallbackStats::Processors, tProcessors);
 
         processSignalBufferObserverInAudioThread(nframes);
 
@@ -236,6 +239,19 @@ namespace autil {
 		ad->m_running = false;
 	}
 
+	void AudioDriverJack::jackThreadInit(void *arg)
+	{
+		auto ad = (AudioDriverJack*)arg;
+		ad->applyRtConfigInAudioThread();
+	}
+
+	void AudioDriverJack::jackFreewheel(int starting, void *arg)
+	{
+		auto ad = (AudioDriverJack*)arg;
+		ad->m_freewheel = starting != 0;
+		printf("Jack freewheel %s\n", starting ? "started" : "stopped");
+	}
+
 	std::string getError(int rc) {
 		char errmsg[1024];
 #ifdef _WIN32
@@ -254,6 +270,13 @@ namespace autil {
 		m_blockSize = jack_get_buffer_size(m_jackClient);
 	}
 
+	void AudioDriverJack::setFreewheel(bool freewheel)
+	{
+		auto rc = jack_set_freewheel(m_jackClient, freewheel ? 1 : 0);
+		if (rc)
+			throw std::runtime_error("jack_set_freewheel(): " + getError(rc));
+	}
+
 
     /*
 	AudioDriver::Request &AudioDriver::Request::addStreamer(SignalStreamer *streamer, const std::string &name, Connect connection, int channel) {
@@ -32,6 +32,10 @@ namespace autil {
 
 		void muteOthers(bool mute = true);
 
+		// offline rendering: JACK runs the graph as fast as possible, without the audio interface.
+		// isFreewheeling() follows the server state (other clients may switch it too).
+		void setFreewheel(bool freewheel);
+
 	private:
 		std::vector<jack_port_t*> newPorts(std::string baseName, int nChannels, bool outputNotInput);
 
@@ -42,6 +46,8 @@ namespace autil {
 
 		static int jackProcess(jack_nframes_t nframes, void *arg);
 		static void jackShutdown(void *arg);
+		static void jackThreadInit(void *arg);
+		static void jackFreewheel(int starting, void *arg);
 
 		jack_client_t* initJack();
 
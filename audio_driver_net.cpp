@@ -0,0 +1,327 @@
+#include "audio_driver_net.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#include "signal_buffer.h"
+#include "udp_receiver.h"
+#include "debug_stream.h"
+
+namespace autil {
+	static const int MASTER_TIMEOUT_MS = 20; // actions are still processed while the master stream pauses
+	static const uint32_t INTERPOLATION_FRAMES = 3; // ResamplingFifo::read() needs x[-1] .. x[2]
+	// packet arrival times jitter by milliseconds (device timestamps by microseconds): a narrower loop
+	// that follows larger errors without re-locking
+	static const double NETWORK_BANDWIDTH = 0.02;
+	static const double NETWORK_MAX_ERROR = 0.25;
+
+	AudioDriverNet::AudioDriverNet(const std::string &name, const StreamProperties &props)
+		: AudioDriverBase(name), m_playbackStream(nullptr)
+	{
+		if (props.sources.empty())
+			throw std::invalid_argument("Network driver without sources!");
+		if (props.blockSize <= 0 || props.blockSize > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("Invalid block size " + std::to_string(props.blockSize));
+
+		memset(m_bufferPortConnections, 0, sizeof(m_bufferPortConnections));
+
+		m_sampleRate = props.sampleRate;
+		m_blockSize = props.blockSize;
+		m_rtConfig = props.rt;
+		m_latency = props.latency;
+		m_numChannelsCapture = 0;
+		m_numChannelsPlayback = props.playbackAddress.empty() ? 0 : props.numChannelsPlayback;
+
+		for (auto &src : props.sources) {
+			if (src.numChannels <= 0)
+				throw std::invalid_argument("Invalid channel count for source port " + std::to_string(src.port));
+			SourceStream *s = new SourceStream();
+			s->src = src;
+			s->index = (int)m_sources.size();
+			s->captureOffset = m_numChannelsCapture;
+			m_numChannelsCapture += src.numChannels;
+			m_sources.push_back(s);
+		}
+
+		m_capture.assign(m_numChannelsCapture, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_playback.assign(m_numChannelsPlayback, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_silence.assign(MAX_BLOCK_SIZE, 0.0f);
+		m_discard.assign(MAX_BLOCK_SIZE, 0.0f);
+
+		try {
+			for (auto sp : m_sources) {
+				SourceStream &s = *sp;
+				uint32_t nc = s.src.numChannels;
+
+				s.chunk.assign(nc * CHUNK, 0.0f);
+				s.slot.assign(nc * CHUNK, 0.0f);
+				for (uint32_t c = 0; c < nc; c++)
+					s.slotPtrs.push_back(&s.slot[c * CHUNK]);
+				s.queue = new CommitQueue(QUEUE_CHUNKS, nc * CHUNK, CommitQueue::Overflow::DropNewest);
+
+				// a few of the largest blocks, the fill level is held at the latency target
+				s.fifo = new ResamplingFifo(nc, 4 * (MAX_BLOCK_SIZE + CHUNK));
+				for (uint32_t c = 0; c < nc; c++)
+					s.fifoOut.push_back(m_capture[s.captureOffset + c].data());
+				s.clock.setNominalRate(m_sampleRate);
+				s.clock.setBandwidth(NETWORK_BANDWIDTH);
+				s.clock.setMaxError(NETWORK_MAX_ERROR);
+
+				s.receiver = new UdpReceiver(s.src.port, nc, [this, sp](const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames, uint64_t frame) {
+					collect(*sp, samples, numChannels, stride, frames, frame);
+				}, s.src.bindAddress);
+			}
+
+			if (m_numChannelsPlayback > 0)
+				m_playbackStream = new DebugStream(props.playbackAddress, props.playbackPort, m_numChannelsPlayback, MAX_BLOCK_SIZE, 16, props.playbackFormat);
+		}
+		catch (...) {
+			for (auto s : m_sources) {
+				delete s->receiver;
+				delete s->queue;
+				delete s->fifo;
+				delete s;
+			}
+			m_sources.clear();
+			throw;
+		}
+
+		showSources();
+
+		m_running = true;
+
+		m_audioThread = new RttThread([this]() {
+			std::cout << "audioThread started!" << std::endl;
+			process();
+		}, true, "audio");
+	}
+
+	AudioDriverNet::~AudioDriverNet()
+	{
+		m_running = false;
+		delete m_audioThread;
+
+		for (auto s : m_sources) {
+			// the receiver thread writes to the queue
+			delete s->receiver;
+			delete s->queue;
+			delete s->fifo;
+			delete s;
+		}
+		delete m_playbackStream;
+	}
+
+	void AudioDriverNet::setBlockSize(int blockSize)
+	{
+		if (blockSize <= 0 || blockSize > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("Invalid block size " + std::to_string(blockSize));
+
+		RttLocalLock ll(m_mtxActionQueue);
+		sync();
+		m_actionQueue.push([this, blockSize]() { m_blockSize = blockSize; });
+		commit();
+	}
+
+	double AudioDriverNet::getClockRatio(int source) const
+	{
+		return clockRatio(*m_sources.at(source));
+	}
+
+	uint32_t AudioDriverNet::getBufferedFrames(int source) const
+	{
+		const SourceStream &s = *m_sources.at(source);
+		return s.fifo->available() + s.queue->size() * CHUNK;
+	}
+
+	uint64_t AudioDriverNet::getNumUnderruns(int source) const
+	{
+		return m_sources.at(source)->numUnderruns;
+	}
+
+	uint64_t AudioDriverNet::getNumDroppedChunks(int source) const
+	{
+		return m_sources.at(source)->queue->getNumLost();
+	}
+
+	const UdpReceiver &AudioDriverNet::getReceiver(int source) const
+	{
+		return *m_sources.at(source)->receiver;
+	}
+
+	void AudioDriverNet::showSources()
+	{
+		for (size_t i = 0; i < m_sources.size(); i++) {
+			const SourceStream &s = *m_sources[i];
+			std::cout << (i == 0 ? "master " : "slave  ") << s.src.bindAddress << ":" << s.src.port
+				<< " in:" << s.src.numChannels << "@" << s.captureOffset
+				<< " ratio:" << clockRatio(s)
+				<< " buffered:" << getBufferedFrames((int)i)
+				<< " underruns:" << s.numUnderruns
+				<< " dropped:" << s.queue->getNumLost()
+				<< " concealed:" << s.receiver->getNumConcealedFrames() << std::endl;
+		}
+	}
+
+	double AudioDriverNet::clockRatio(const SourceStream &s) const
+	{
+		const SourceStream &master = *m_sources[0];
+		if (&s == &master || !s.clock.isLocked() || !master.clock.isLocked())
+			return 1.0;
+		return s.clock.getRate() / master.clock.getRate();
+	}
+
+	void AudioDriverNet::fillTelemetryInAudioThread(TelemetryData &t)
+	{
+		t.numXruns = 0;
+		for (auto s : m_sources)
+			t.numXruns += s->numUnderruns + s->queue->getNumLost();
+	}
+
+	// receiver thread: consecutive frames of a source into CHUNK sized queue slots
+	void AudioDriverNet::collect(SourceStream &s, const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames, uint64_t frame)
+	{
+		uint32_t nc = s.src.numChannels;
+		uint32_t done = 0;
+		while (done < frames) {
+			if (s.chunkFill == 0)
+				s.chunkFrame = frame + done;
+
+			uint32_t n = std::min(frames - done, CHUNK - s.chunkFill);
+			for (uint32_t c = 0; c < nc; c++) {
+				float *dst = &s.chunk[c * CHUNK + s.chunkFill];
+				if (samples && c < numChannels)
+					memcpy(dst, samples + (size_t)c * stride + done, n * sizeof(float));
+				else
+					memset(dst, 0, n * sizeof(float));
+			}
+			s.chunkFill += n;
+			done += n;
+
+			if (s.chunkFill == CHUNK) {
+				float *slot = s.queue->beginWrite();
+				if (slot) {
+					memcpy(slot, s.chunk.data(), s.chunk.size() * sizeof(float));
+					s.queue->endWrite(s.chunkFrame, (uint64_t)DllClock::now());
+				}
+				s.chunkFill = 0;
+			}
+		}
+	}
+
+	// audio thread: queued chunks into the FIFO, true if any arrived
+	bool AudioDriverNet::drain(SourceStream &s, int timeoutMs)
+	{
+		bool any = false;
+		uint64_t frame, arrival;
+		while (s.queue->read(s.slot.data(), &frame, &arrival, any ? 0 : timeoutMs)) {
+			any = true;
+			// a full FIFO drops the chunk, the fill level control catches up
+			s.fifo->write(s.slotPtrs.data(), CHUNK);
+			s.framesReceived += CHUNK;
+			s.clock.update(s.framesReceived, (int64_t)arrival);
+		}
+		return any;
+	}
+
+	void AudioDriverNet::readMaster(int nframes)
+	{
+		SourceStream &s = *m_sources[0];
+		// the master clock is the driver clock: no resampling
+		if (s.fifo->read(s.fifoOut.data(), nframes, 1.0) < (uint32_t)nframes)
+			s.numUnderruns++;
+	}
+
+	void AudioDriverNet::readSlave(SourceStream &s, int nframes)
+	{
+		AUTIL_TRACE_SCOPE("net read", s.index);
+
+		// arrival jitter: a chunk and two driver periods
+		uint32_t target = m_latency > 0 ? (uint32_t)m_latency : 2 * nframes + CHUNK;
+		if (!s.primed && s.fifo->available() >= target) {
+			s.primed = true;
+			s.fifo->resetControl();
+		}
+
+		if (!s.primed) {
+			for (auto out : s.fifoOut)
+				memset(out, 0, nframes * sizeof(float));
+			return;
+		}
+
+		// input: source frames, output: master frames
+		double ratio = s.fifo->controlRatio(clockRatio(s), target, nframes);
+		if (s.fifo->read(s.fifoOut.data(), nframes, ratio) < (uint32_t)nframes) {
+			s.numUnderruns++;
+			s.primed = false;
+		}
+	}
+
+	void AudioDriverNet::writePlayback(int nframes)
+	{
+		if (!m_playbackStream)
+			return;
+		float *slot = m_playbackStream->beginBlock(nframes);
+		if (!slot)
+			return;
+		uint32_t stride = m_playbackStream->getMaxBlockLength();
+		for (int c = 0; c < m_numChannelsPlayback; c++)
+			memcpy(slot + c * stride, m_playback[c].data(), nframes * sizeof(float));
+		m_playbackStream->endBlock(nframes);
+	}
+
+	void AudioDriverNet::process()
+	{
+		applyRtConfigInAudioThread();
+
+		m_captureClock.setNominalRate(m_sampleRate);
+		m_playbackClock.setNominalRate(m_sampleRate);
+
+		SourceStream &master = *m_sources[0];
+
+		while (m_running) {
+			// sleep until the master stream delivers, then take what the other sources have
+			bool arrived;
+			{
+				AUTIL_TRACE_SCOPE("net wait");
+				arrived = drain(master, MASTER_TIMEOUT_MS);
+			}
+			for (size_t i = 1; i < m_sources.size(); i++)
+				drain(*m_sources[i], 0);
+
+			if (!arrived) {
+				processActionQueueInAudioThread();
+				continue;
+			}
+
+			// one period per buffered block
+			while (m_running && master.fifo->available() >= (uint32_t)m_blockSize + INTERPOLATION_FRAMES) {
+				int nframes = m_blockSize;
+
+				beginPeriodInAudioThread(nframes);
+
+				processActionQueueInAudioThread();
+
+				readMaster(nframes);
+				for (size_t i = 1; i < m_sources.size(); i++)
+					readSlave(*m_sources[i], nframes);
+
+				if (m_paused)
+					continue;
+
+				processScheduledPeriodInAudioThread(nframes, [this](int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n) {
+					routePlanarInAudioThread(ib, signalBuffer, offset, n, m_capture, m_playback, m_silence.data(), m_discard.data());
+				});
+
+				writePlayback(nframes);
+
+				// the period ends when the master block was complete
+				int64_t t = DllClock::now();
+				m_captureClock.update(m_totalFramesProcessed + nframes, t);
+				m_playbackClock.update(m_totalFramesProcessed + nframes, t);
+
+				processSignalBufferObserverInAudioThread(nframes);
+			}
+		}
+	}
+}
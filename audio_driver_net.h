@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "audio_driver_base.h"
+#include "commit_queue.h"
+#include "resampler.h"
+#include "wire_format.h"
+
+namespace autil {
+	class UdpReceiver;
+	class DebugStream;
+
+	/*
+	 * Driver whose device is a set of UDP wire streams from remote autil nodes (UdpSocket::sendFrames(),
+	 * SignalBuffer::setDebugReceiver() with a wire format, or the playback of another AudioDriverNet).
+	 *
+	 * Capture: one UdpReceiver (jitter buffer, reordering, loss concealment) per source. Its thread cuts
+	 * the stream into CHUNK frames and hands them to the audio thread through a CommitQueue. sources[0]
+	 * is the clock master: the audio thread sleeps until its chunks arrive and runs a period whenever a
+	 * block is buffered. Every other source runs on its sender's clock and is resampled into the master
+	 * clock domain through a ResamplingFifo, as the slave devices of AudioDriverAlsaAggregate: the ratio
+	 * follows the DllClocks fed with the chunk arrival times, trimmed by the FIFO fill level.
+	 *
+	 * Playback: the playback channels are sent as one wire stream by a DebugStream sender thread.
+	 *
+	 * Capture channels are the sources' channels concatenated in order, buffer channel i maps to
+	 * capture channel i, as in the aggregate driver.
+	 */
+	class AudioDriverNet : public AudioDriverBase
+	{
+	public:
+		struct Source {
+			int port;
+			int numChannels;
+			std::string bindAddress;
+
+			Source(int port = 0, int numChannels = 2, const std::string &bindAddress = "0.0.0.0")
+				: port(port), numChannels(numChannels), bindAddress(bindAddress) {}
+		};
+
+		struct StreamProperties {
+			std::vector<Source> sources; // sources[0] clocks the periods
+
+			std::string playbackAddress; // empty: no playback stream
+			int playbackPort;
+			int numChannelsPlayback;
+			wire::PayloadType playbackFormat;
+
+			int sampleRate; // nominal rate of all streams
+			int blockSize;
+			int latency; // frames kept in the resampling FIFO of the other sources, 0: two blocks plus a chunk
+
+			RtConfig rt;
+
+			StreamProperties() {
+				playbackPort = 0;
+				numChannelsPlayback = 0;
+				playbackFormat = wire::PayloadType::Float32;
+				sampleRate = 48000;
+				blockSize = 256;
+				latency = 0;
+				rt.policy = -1;
+			}
+		};
+
+		AudioDriverNet(const std::string &name, const StreamProperties &props);
+		~AudioDriverNet();
+
+		void setBlockSize(int blockSize);
+
+		inline int getNumSources() const { return (int)m_sources.size(); }
+		// estimated rate of a source relative to the master, 1.0 until both clocks are locked
+		double getClockRatio(int source) const;
+		// frames buffered for a source in the audio thread (FIFO) and between the threads (queued chunks)
+		uint32_t getBufferedFrames(int source) const;
+		// periods a source could not fill (FIFO ran dry), chunks dropped because the audio thread fell behind
+		uint64_t getNumUnderruns(int source) const;
+		uint64_t getNumDroppedChunks(int source) const;
+		const UdpReceiver &getReceiver(int source) const;
+
+		void showSources();
+
+		static const int MAX_BLOCK_SIZE = 8192;
+		static const uint32_t CHUNK = 64; // frames per hand-over from a receiver thread
+		static const uint32_t QUEUE_CHUNKS = 256;
+
+	private:
+		struct SourceStream {
+			Source src;
+			int index; // 0 = master
+			int captureOffset; // first capture channel of this source
+
+			UdpReceiver *receiver;
+
+			// receiver thread: CHUNK frames collected for the queue
+			std::vector<float> chunk;
+			uint32_t chunkFill;
+			uint64_t chunkFrame;
+			CommitQueue *queue; // chunks, windowBegin: sender frame, windowEnd: arrival time (DllClock::now())
+
+			// audio thread
+			std::vector<float> slot;
+			std::vector<const float *> slotPtrs;
+			ResamplingFifo *fifo;
+			std::vector<float *> fifoOut; // planar pointers into the capture blocks
+			bool primed; // FIFO filled to its target since the last underrun
+
+			DllClock clock; // sender frames received -> arrival time
+			volatile uint64_t framesReceived, numUnderruns;
+
+			SourceStream() : index(0), captureOffset(0), receiver(nullptr), chunkFill(0), chunkFrame(0), queue(nullptr),
+				fifo(nullptr), primed(false), framesReceived(0), numUnderruns(0) {}
+		};
+
+		RttThread *m_audioThread;
+		std::vector<SourceStream *> m_sources;
+		int m_latency;
+
+		DebugStream *m_playbackStream;
+
+		std::vector<std::vector<float>> m_capture, m_playback;
+		std::vector<float> m_silence, m_discard;
+
+		void collect(SourceStream &s, const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames, uint64_t frame);
+		bool drain(SourceStream &s, int timeoutMs);
+		double clockRatio(const SourceStream &s) const;
+		void readMaster(int nframes);
+		void readSlave(SourceStream &s, int nframes);
+		void writePlayback(int nframes);
+
+		void fillTelemetryInAudioThread(TelemetryData &t);
+		void process();
+	};
+}
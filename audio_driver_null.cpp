@@ -0,0 +1,206 @@
+#include "audio_driver_null.h"
+
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "signal_buffer.h"
+#include "file_io.h"
+
+namespace autil {
+	AudioDriverNull::AudioDriverNull(const std::string &name, const StreamProperties &props)
+		: AudioDriverBase(name), m_tStarted(0)
+	{
+		if (props.blockSize <= 0 || props.blockSize > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("Invalid block size " + std::to_string(props.blockSize));
+
+		memset(m_bufferPortConnections, 0, sizeof(m_bufferPortConnections));
+
+		m_sampleRate = props.sampleRate;
+		m_blockSize = props.blockSize;
+		m_numChannelsCapture = props.numChannelsCapture;
+		m_numChannelsPlayback = props.numChannelsPlayback;
+		m_clock = props.clock;
+		m_freewheel = m_clock == Clock::FreeRunning;
+		m_captureSource = props.captureSource;
+		m_rtConfig = props.rt;
+		m_numPeriods = m_numLatePeriods = 0;
+		m_filePos = 0;
+
+		// allocate for the largest block, so setBlockSize() doesn't allocate in the audio thread
+		m_capture.assign(m_numChannelsCapture, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_playback.assign(m_numChannelsPlayback, std::vector<float>(MAX_BLOCK_SIZE, 0.0f));
+		m_silence.assign(MAX_BLOCK_SIZE, 0.0f);
+		m_discard.assign(MAX_BLOCK_SIZE, 0.0f);
+
+		if (m_captureSource == CaptureSource::Files) {
+			if ((int)props.captureFiles.size() != m_numChannelsCapture)
+				throw std::invalid_argument("Need one capture file per capture channel!");
+			m_files.resize(m_numChannelsCapture);
+			for (int c = 0; c < m_numChannelsCapture; c++) {
+				fileio::readWave(props.captureFiles[c], &m_files[c]);
+				if (m_files[c].empty())
+					throw std::runtime_error("Empty capture file " + props.captureFiles[c]);
+			}
+		}
+
+		m_running = true;
+
+		m_audioThread = new RttThread([this]() {
+			std::cout << "audioThread started!" << std::endl;
+			process();
+		}, true, "audio");
+	}
+
+	AudioDriverNull::~AudioDriverNull()
+	{
+		m_running = false;
+		delete m_audioThread;
+	}
+
+	void AudioDriverNull::setBlockSize(int blockSize)
+	{
+		if (blockSize <= 0 || blockSize > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("Invalid block size " + std::to_string(blockSize));
+
+		RttLocalLock ll(m_mtxActionQueue);
+		sync();
+		m_actionQueue.push([this, blockSize]() { m_blockSize = blockSize; });
+		commit();
+	}
+
+	double AudioDriverNull::getRealTimeFactor() const
+	{
+		int64_t t0 = m_tStarted.load(std::memory_order_acquire);
+		double wall = t0 ? (DllClock::now() - t0) * 1e-9 : 0.0;
+		if (wall <= 0.0)
+			return 0.0;
+		return ((double)m_totalFramesProcessed / m_sampleRate) / wall;
+	}
+
+	void AudioDriverNull::wakeupAudioThread()
+	{
+		m_evWakeup.Signal();
+	}
+
+	void AudioDriverNull::fillTelemetryInAudioThread(TelemetryData &t)
+	{
+		t.numXruns = m_numLatePeriods;
+	}
+
+	int AudioDriverNull::armTimer(int fd, int blockSize)
+	{
+		long long periodNs = 1000000000LL * blockSize / m_sampleRate;
+		struct itimerspec its;
+		its.it_interval.tv_sec = periodNs / 1000000000LL;
+		its.it_interval.tv_nsec = periodNs % 1000000000LL;
+		its.it_value = its.it_interval;
+		return timerfd_settime(fd, 0, &its, nullptr);
+	}
+
+	void AudioDriverNull::fillCapture(int nframes)
+	{
+		switch (m_captureSource) {
+		case CaptureSource::Silence:
+			break;
+
+		case CaptureSource::Loopback:
+			// one period of latency, extra capture channels stay silent
+			for (int c = 0; c < m_numChannelsCapture && c < m_numChannelsPlayback; c++)
+				memcpy(m_capture[c].data(), m_playback[c].data(), nframes * sizeof(float));
+			break;
+
+		case CaptureSource::Files:
+			for (int c = 0; c < m_numChannelsCapture; c++) {
+				const auto &file = m_files[c];
+				size_t pos = m_filePos % file.size();
+				for (int i = 0; i < nframes; i++) {
+					m_capture[c][i] = file[pos];
+					if (++pos == file.size())
+						pos = 0;
+				}
+			}
+			m_filePos += nframes;
+			break;
+		}
+	}
+
+	void AudioDriverNull::process()
+	{
+		applyRtConfigInAudioThread();
+
+		int timer = -1;
+		int timerBlockSize = 0;
+		if (m_clock == Clock::Paced) {
+			timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+			if (timer < 0) {
+				printf("timerfd_create failed: %s\n", strerror(errno));
+				m_running = false;
+				return;
+			}
+		}
+
+		m_tStarted.store(DllClock::now(), std::memory_order_release);
+		m_captureClock.setNominalRate(m_sampleRate);
+		m_playbackClock.setNominalRate(m_sampleRate);
+
+		while (m_running) {
+			int nframes = m_blockSize;
+
+			// paced: one period per timer expiration. Missed expirations are processed right away so the stream
+			// keeps the nominal rate, up to a second of them (a longer stall, e.g. a stopped process, is skipped)
+			uint64_t periods = 1;
+			if (timer >= 0) {
+				if (timerBlockSize != nframes) {
+					if (armTimer(timer, nframes) < 0) {
+						printf("timerfd_settime failed: %s\n", strerror(errno));
+						break;
+					}
+					timerBlockSize = nframes;
+				}
+
+				uint64_t expirations = 0;
+				if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;
+				if (expirations > 1)
+					m_numLatePeriods += expirations - 1;
+				periods = std::min<uint64_t>(expirations, m_sampleRate / nframes + 1);
+			}
+
+			for (uint64_t p = 0; p < periods && m_running; p++) {
+				beginPeriodInAudioThread(nframes);
+
+				processActionQueueInAudioThread();
+
+				if (m_paused) {
+					// no timer to pace the loop: sleep a period or until the next action is queued
+					if (timer < 0) {
+						m_evWakeup.Wait(std::max(1, nframes * 1000 / m_sampleRate));
+						m_evWakeup.Reset();
+					}
+					break;
+				}
+
+				fillCapture(nframes);
+
+				processScheduledPeriodInAudioThread(nframes, [this](int ib, SignalBuffer *signalBuffer, uint32_t offset, uint32_t n) {
+					routePlanarInAudioThread(ib, signalBuffer, offset, n, m_capture, m_playback, m_silence.data(), m_discard.data());
+				});
+
+				// a paced period ends at the timer expiration, the last one caught up at about now
+				if (timer >= 0 && p == periods - 1) {
+					int64_t t = DllClock::now();
+					m_captureClock.update(m_totalFramesProcessed + nframes, t);
+					m_playbackClock.update(m_totalFramesProcessed + nframes, t);
+				}
+
+				processSignalBufferObserverInAudioThread(nframes);
+				m_numPeriods++;
+			}
+		}
+
+		if (timer >= 0)
+			close(timer);
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "audio_driver_base.h"
+
+namespace autil {
+	/*
+	 * Hardware-free driver running the same callback path as the device drivers
+	 * (action queue, buffer routing, observer commits). For CI, benchmarks and load tests.
+	 * Buffer channel i is routed to device channel i, as in the ALSA driver.
+	 */
+	class AudioDriverNull : public AudioDriverBase
+	{
+	public:
+		enum class Clock : int {
+			Paced, // one period per period time (timerfd)
+			FreeRunning, // as fast as the CPU allows, observer commits block (isFreewheeling())
+		};
+
+		enum class CaptureSource : int {
+			Silence,
+			Loopback, // playback of the previous period
+			Files, // one wave file per capture channel, looped
+		};
+
+		struct StreamProperties {
+			int numChannelsCapture;
+			int numChannelsPlayback;
+			int sampleRate;
+			int blockSize;
+
+			Clock clock;
+			CaptureSource captureSource;
+			std::vector<std::string> captureFiles;
+
+			RtConfig rt;
+
+			StreamProperties() {
+				blockSize = 256;
+				numChannelsCapture = 2;
+				numChannelsPlayback = 2;
+				sampleRate = 48000;
+				clock = Clock::Paced;
+				captureSource = CaptureSource::Silence;
+				rt.policy = -1;
+			}
+		};
+
+		AudioDriverNull(const std::string &name, const StreamProperties &props);
+		~AudioDriverNull();
+
+		void setBlockSize(int blockSize);
+
+		// processed audio time / wall time since start, > 1 when free-running faster than real time
+		double getRealTimeFactor() const;
+		inline uint64_t getNumPeriods() const { return m_numPeriods; }
+		// paced mode: periods the timer fired before the previous one was processed (caught up right away)
+		inline uint64_t getNumLatePeriods() const { return m_numLatePeriods; }
+
+		static const int MAX_BLOCK_SIZE = 8192;
+
+	private:
+		RttThread *m_audioThread;
+
+		Clock m_clock;
+		CaptureSource m_captureSource;
+
+		std::vector<std::vector<float>> m_capture, m_playback;
+		std::vector<float> m_silence, m_discard;
+		std::vector<std::vector<float>> m_files;
+		size_t m_filePos;
+
+		std::atomic<int64_t> m_tStarted; // DllClock::now() when the audio thread started, 0 before
+		RttEvent m_evWakeup; // free-running and paused: new actions
+		volatile uint64_t m_numPeriods, m_numLatePeriods;
+
+		int armTimer(int fd, int blockSize);
+		void wakeupAudioThread();
+		void fillTelemetryInAudioThread(TelemetryData &t);
+		void fillCapture(int nframes);
+		void process();
+	};
+}
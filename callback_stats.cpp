@@ -0,0 +1,174 @@
+#include "callback_stats.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace autil {
+	static inline int log2floor(uint64_t v)
+	{
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanReverse64(&i, v);
+		return (int)i;
+#else
+		return 63 - __builtin_clzll(v);
+#endif
+	}
+
+	Histogram::Histogram()
+	{
+		reset();
+	}
+
+	int Histogram::bucketOf(uint64_t value)
+	{
+		if (value < SUB_BUCKETS)
+			return (int)value;
+		int e = log2floor(value);
+		int shift = e - SUB_BITS;
+		int sub = (int)((value >> shift) & (SUB_BUCKETS - 1));
+		return (shift + 1) * SUB_BUCKETS + sub;
+	}
+
+	uint64_t Histogram::bucketLow(int bucket)
+	{
+		if (bucket < SUB_BUCKETS)
+			return (uint64_t)bucket;
+		int shift = bucket / SUB_BUCKETS - 1;
+		return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+	}
+
+	uint64_t Histogram::bucketHigh(int bucket)
+	{
+		if (bucket < SUB_BUCKETS)
+			return (uint64_t)bucket;
+		int shift = bucket / SUB_BUCKETS - 1;
+		return bucketLow(bucket) + ((uint64_t)1 << shift) - 1;
+	}
+
+	void Histogram::record(uint64_t value)
+	{
+		add(m_counts[bucketOf(value)], 1);
+		add(m_sum, value);
+		if (value < m_min.load(std::memory_order_relaxed))
+			m_min.store(value, std::memory_order_relaxed);
+		if (value > m_max.load(std::memory_order_relaxed))
+			m_max.store(value, std::memory_order_relaxed);
+		// count last, a snapshot never sees more values than counted buckets
+		std::atomic_thread_fence(std::memory_order_release);
+		add(m_count, 1);
+	}
+
+	void Histogram::reset()
+	{
+		for (auto &c : m_counts)
+			c.store(0, std::memory_order_relaxed);
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_min.store(UINT64_MAX, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+
+	Histogram::Snapshot Histogram::snapshot() const
+	{
+		Snapshot s;
+		s.count = m_count.load(std::memory_order_acquire);
+		s.sum = m_sum.load(std::memory_order_relaxed);
+		s.min = m_min.load(std::memory_order_relaxed);
+		s.max = m_max.load(std::memory_order_relaxed);
+		if (s.count == 0)
+			s.min = 0;
+
+		s.counts.resize(NUM_BUCKETS);
+		for (int i = 0; i < NUM_BUCKETS; i++)
+			s.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+		return s;
+	}
+
+	uint64_t Histogram::Snapshot::percentile(double p) const
+	{
+		uint64_t total = 0;
+		for (auto c : counts)
+			total += c;
+		if (total == 0)
+			return 0;
+
+		uint64_t rank = (uint64_t)(p * total + 0.5);
+		if (rank < 1)
+			rank = 1;
+		uint64_t n = 0;
+		for (int i = 0; i < (int)counts.size(); i++) {
+			n += counts[i];
+			if (n >= rank)
+				return std::min(bucketHigh(i), max);
+		}
+		return max;
+	}
+
+	Histogram::Snapshot Histogram::Snapshot::since(const Snapshot &earlier) const
+	{
+		Snapshot d = *this;
+		d.count -= earlier.count;
+		d.sum -= earlier.sum;
+		for (size_t i = 0; i < d.counts.size() && i < earlier.counts.size(); i++)
+			d.counts[i] -= earlier.counts[i];
+		// min/max are not windowed, take them from the buckets
+		d.min = d.max = 0;
+		for (int i = 0; i < (int)d.counts.size(); i++) {
+			if (d.counts[i]) {
+				d.min = bucketLow(i);
+				break;
+			}
+		}
+		for (int i = (int)d.counts.size() - 1; i >= 0; i--) {
+			if (d.counts[i]) {
+				d.max = std::min(bucketHigh(i), max);
+				break;
+			}
+		}
+		return d;
+	}
+
+	const char *CallbackStats::stageName(int stage)
+	{
+		static const char *names[NUM_STAGES] = { "callback", "actions", "buffers", "processors", "observers" };
+		return (stage >= 0 && stage < NUM_STAGES) ? names[stage] : "?";
+	}
+
+	void CallbackStats::reset()
+	{
+		for (auto &h : stages)
+			h.reset();
+		wakeupJitter.reset();
+		load.reset();
+		for (auto &h : buffers)
+			h.reset();
+	}
+
+	static void showHistogram(const char *name, const Histogram::Snapshot &s, double scale, const char *unit)
+	{
+		if (s.count == 0 || s.max == 0)
+			return;
+		printf("%-12s n=%-8llu mean %8.1f%s  p50 %8.1f%s  p99 %8.1f%s  p99.9 %8.1f%s  max %8.1f%s\n", name,
+			(unsigned long long)s.count, s.mean() * scale, unit,
+			s.percentile(0.5) * scale, unit, s.percentile(0.99) * scale, unit,
+			s.percentile(0.999) * scale, unit, s.max * scale, unit);
+	}
+
+	void CallbackStats::show() const
+	{
+		for (int i = 0; i < NUM_STAGES; i++)
+			showHistogram(stageName(i), stages[i].snapshot(), 1e-3, "us");
+		showHistogram("jitter", wakeupJitter.snapshot(), 1e-3, "us");
+		showHistogram("load", load.snapshot(), 1e-2, "%");
+		for (int i = 0; i < MAX_BUFFERS; i++) {
+			std::string name = "buffer " + std::to_string(i);
+			showHistogram(name.c_str(), buffers[i].snapshot(), 1e-3, "us");
+		}
+	}
+}
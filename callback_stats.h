@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace autil {
+	/*
+	 * Fixed-memory log-linear histogram (HDR style, 16 sub-buckets per power of two, <= 6.25% error)
+	 * for non-negative integer values such as nanoseconds. Single writer (the audio thread) without
+	 * locks or read-modify-write; any thread may take a snapshot() at any time.
+	 */
+	class Histogram {
+	public:
+		static const int SUB_BITS = 4;
+		static const int SUB_BUCKETS = 1 << SUB_BITS;
+		static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+		struct Snapshot {
+			std::vector<uint64_t> counts;
+			uint64_t count, sum, min, max;
+
+			Snapshot() : count(0), sum(0), min(0), max(0) {}
+
+			inline double mean() const { return count ? (double)sum / count : 0.0; }
+			// value below which p (0..1) of the recorded values fall, bucket upper bound
+			uint64_t percentile(double p) const;
+			// values recorded since an earlier snapshot of the same histogram
+			Snapshot since(const Snapshot &earlier) const;
+		};
+
+		Histogram();
+
+		// writer
+		void record(uint64_t value);
+		void reset();
+
+		// any thread
+		Snapshot snapshot() const;
+
+		static int bucketOf(uint64_t value);
+		static uint64_t bucketLow(int bucket);
+		static uint64_t bucketHigh(int bucket);
+
+	private:
+		std::atomic<uint64_t> m_counts[NUM_BUCKETS];
+		std::atomic<uint64_t> m_count, m_sum, m_min, m_max;
+
+		inline void add(std::atomic<uint64_t> &a, uint64_t v) { a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed); }
+	};
+
+	/*
+	 * Per-callback timing of a driver: duration of each stage of the period, wakeup jitter against
+	 * the nominal period and DSP load. Recorded by AudioDriverBase in the audio thread.
+	 */
+	struct CallbackStats {
+		enum Stage : int {
+			Callback, // wakeup to end of period
+			ActionQueue,
+			Buffers, // all signal buffers (routing, conversion, pre-processors)
+			Processors,
+			Observers, // commits
+			NUM_STAGES
+		};
+
+		static const int MAX_BUFFERS = 16;
+
+		Histogram stages[NUM_STAGES]; // ns
+		Histogram wakeupJitter; // ns, |wakeup interval - period|
+		Histogram load; // 1/100 % of the period (10000 = the whole period)
+		Histogram buffers[MAX_BUFFERS]; // ns per period, by buffer slot
+
+		static const char *stageName(int stage);
+
+		void reset();
+		void show() const;
+	};
+}
@@ -0,0 +1,414 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "clock_sync.h"
+#include "dll_clock.h"
+#include "net.h"
+
+namespace autil {
+	const int ClockSync::WINDOW;
+
+	/*
+	 * packet (little endian, 40 bytes)
+	 *   0 u32 magic 'AUCS'   4 u8 version   5 u8 type (1 request, 2 reply)   6 u16 reserved
+	 *   8 u32 sequence      12 u32 timebase id of the server (reply)
+	 *  16 i64 t1 (client send)   24 i64 t2 (server receive)   32 i64 t3 (server send)
+	 */
+	static const uint32_t SYNC_MAGIC = 0x53435541; // "AUCS"
+	static const uint8_t SYNC_VERSION = 1;
+	static const uint8_t SYNC_REQUEST = 1, SYNC_REPLY = 2;
+	static const size_t SYNC_BYTES = 40;
+	static const int64_t STEP_NS = 1000000; // offset jumps beyond the round trip plus this are clock steps
+	static const int STEP_EXCHANGES = 3; // consecutive steps until the fit restarts
+
+	static void writePacket(uint8_t *p, uint8_t type, uint32_t sequence, uint32_t clock, int64_t t1, int64_t t2, int64_t t3)
+	{
+		wire::put32(p, SYNC_MAGIC);
+		p[4] = SYNC_VERSION;
+		p[5] = type;
+		p[6] = p[7] = 0;
+		wire::put32(p + 8, sequence);
+		wire::put32(p + 12, clock);
+		wire::put64(p + 16, (uint64_t)t1);
+		wire::put64(p + 24, (uint64_t)t2);
+		wire::put64(p + 32, (uint64_t)t3);
+	}
+
+	static bool isPacket(const uint8_t *p, ssize_t bytes, uint8_t type)
+	{
+		return bytes == (ssize_t)SYNC_BYTES && wire::get32(p) == SYNC_MAGIC && p[4] == SYNC_VERSION && p[5] == type;
+	}
+
+	// holds the packet for the impairment's delay, false if it is to be dropped
+	static bool impair(const NetImpairment &imp, std::minstd_rand &random)
+	{
+		if (!imp.active())
+			return true;
+		std::uniform_real_distribution<double> u(0.0, 1.0);
+		if (imp.loss > 0.0 && u(random) < imp.loss)
+			return false;
+		double ms = imp.delayMs + imp.jitterMs * u(random);
+		if (ms > 0.0)
+			std::this_thread::sleep_for(std::chrono::nanoseconds((int64_t)(ms * 1e6)));
+		return true;
+	}
+
+	ClockSyncServer::ClockSyncServer(int port, const std::string &bindAddress)
+		: m_skewOffset(0), m_skewPpm(0.0), m_random((uint32_t)DllClock::now()), m_numRequests(0), m_running(true)
+	{
+		m_soc = openUdpReceiveSocket(bindAddress, port);
+		std::cout << "Clock sync server on " << bindAddress << ":" << port << " (timebase " << std::hex
+			<< ClockSync::localClockId() << std::dec << ")" << std::endl;
+		m_thread = new RttThread([this]() { serve(); }, false, "clock sync");
+	}
+
+	ClockSyncServer::~ClockSyncServer()
+	{
+		m_running = false;
+		delete m_thread;
+		close(m_soc);
+	}
+
+	void ClockSyncServer::setClockSkew(int64_t offsetNs, double ppm)
+	{
+		m_skewOffset = offsetNs;
+		m_skewPpm = ppm;
+	}
+
+	void ClockSyncServer::setImpairment(const NetImpairment &impairment)
+	{
+		RttLocalLock ll(m_mtxImpairment);
+		m_impairment = impairment;
+	}
+
+	int64_t ClockSyncServer::now() const
+	{
+		int64_t t = DllClock::now();
+		double ppm = m_skewPpm;
+		return t + m_skewOffset + (ppm != 0.0 ? (int64_t)std::llround(ppm * 1e-6 * (double)t) : 0);
+	}
+
+	void ClockSyncServer::serve()
+	{
+		uint8_t packet[SYNC_BYTES + 1];
+		struct sockaddr_in from;
+
+		while (m_running) {
+			struct pollfd pfd;
+			pfd.fd = m_soc;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+
+			socklen_t fromLen = sizeof(from);
+			ssize_t r = recvfrom(m_soc, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromLen);
+			int64_t t2 = now();
+			if (!isPacket(packet, r, SYNC_REQUEST))
+				continue;
+			m_numRequests++;
+
+			NetImpairment imp;
+			{
+				RttLocalLock ll(m_mtxImpairment);
+				imp = m_impairment;
+			}
+			int64_t t1 = (int64_t)wire::get64(packet + 16);
+			writePacket(packet, SYNC_REPLY, wire::get32(packet + 8), ClockSync::localClockId(), t1, t2, 0);
+			// the impairment delays the packet after t3, as a slow return path would
+			int64_t t3 = now();
+			wire::put64(packet + 32, (uint64_t)t3);
+			if (!impair(imp, m_random))
+				continue;
+			sendto(m_soc, packet, SYNC_BYTES, 0, (struct sockaddr *)&from, fromLen);
+		}
+	}
+
+
+	uint32_t ClockSync::localClockId()
+	{
+		static const uint32_t id = []() {
+			std::random_device rd;
+			uint32_t v = rd() ^ (uint32_t)getpid() ^ (uint32_t)DllClock::now();
+			return v ? v : 1;
+		}();
+		return id;
+	}
+
+	ClockSync::ClockSync(const std::string &serverAddress, int port, int intervalMs)
+		: m_intervalMs(std::max(1, intervalMs)), m_random((uint32_t)DllClock::now()),
+		m_numWindow(0), m_next(0), m_clock(0), m_stepCount(0), m_seq(0),
+		m_numExchanges(0), m_numLost(0), m_numSteps(0), m_running(true)
+	{
+		memset(&m_state, 0, sizeof(m_state));
+
+		m_soc = openUdpReceiveSocket("0.0.0.0", 0);
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		if (inet_pton(AF_INET, serverAddress.c_str(), &sa.sin_addr) <= 0) {
+			close(m_soc);
+			throw std::invalid_argument("Invalid address " + serverAddress);
+		}
+		// replies from other addresses are filtered by the kernel
+		if (connect(m_soc, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			std::string err = strerror(errno);
+			close(m_soc);
+			throw std::runtime_error("Failed to connect UDP socket to " + serverAddress + ":" + std::to_string(port) + ": " + err);
+		}
+
+		std::cout << "Syncing clock to " << serverAddress << ":" << port << " every " << m_intervalMs << "ms" << std::endl;
+		m_thread = new RttThread([this]() { run(); }, false, "clock sync");
+	}
+
+	ClockSync::~ClockSync()
+	{
+		m_running = false;
+		delete m_thread;
+		close(m_soc);
+	}
+
+	void ClockSync::setImpairment(const NetImpairment &impairment)
+	{
+		RttLocalLock ll(m_mtxImpairment);
+		m_impairment = impairment;
+	}
+
+	void ClockSync::publish(const State &s)
+	{
+		uint32_t seq = m_seq.load(std::memory_order_relaxed);
+		m_seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_state = s;
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+
+	ClockSync::State ClockSync::read() const
+	{
+		State s;
+		uint32_t seq0, seq1;
+		do {
+			seq0 = m_seq.load(std::memory_order_acquire);
+			s = m_state;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			seq1 = m_seq.load(std::memory_order_relaxed);
+		} while (seq0 != seq1 || (seq0 & 1));
+		return s;
+	}
+
+	bool ClockSync::isLocked() const
+	{
+		return read().locked;
+	}
+
+	int64_t ClockSync::toReference(int64_t localNs) const
+	{
+		State s = read();
+		double d = (double)(localNs - s.local);
+		return localNs + (int64_t)std::llround(s.offset + s.rate * d);
+	}
+
+	int64_t ClockSync::toLocal(int64_t referenceNs) const
+	{
+		State s = read();
+		double d = (double)(referenceNs - s.local) - s.offset;
+		return s.local + (int64_t)std::llround(d / (1.0 + s.rate));
+	}
+
+	wire::Timestamp ClockSync::stamp(int64_t localNs) const
+	{
+		State s = read();
+		wire::Timestamp ts;
+		if (s.locked) {
+			ts.time = localNs + (int64_t)std::llround(s.offset + s.rate * (double)(localNs - s.local));
+			ts.clock = s.clock;
+			ts.error = s.error;
+		}
+		else {
+			ts.time = localNs;
+			ts.clock = localClockId();
+		}
+		return ts;
+	}
+
+	double ClockSync::getOffsetNs() const
+	{
+		State s = read();
+		return s.offset + s.rate * (double)(DllClock::now() - s.local);
+	}
+
+	double ClockSync::getRatePpm() const
+	{
+		return read().rate * 1e6;
+	}
+
+	int64_t ClockSync::getRoundTripNs() const
+	{
+		return read().roundTrip;
+	}
+
+	uint32_t ClockSync::getErrorNs() const
+	{
+		return read().error;
+	}
+
+	uint32_t ClockSync::getReferenceClock() const
+	{
+		return read().clock;
+	}
+
+	void ClockSync::add(int64_t t1, int64_t t2, int64_t t3, int64_t t4, uint32_t clock)
+	{
+		Exchange e;
+		e.local = t1 + (t4 - t1) / 2;
+		e.offset = ((t2 - t1) + (t3 - t4)) / 2;
+		e.roundTrip = std::max<int64_t>(0, (t4 - t1) - (t3 - t2));
+
+		if (clock != m_clock) {
+			// another server (or restarted): start over
+			m_clock = clock;
+			m_numWindow = 0;
+			m_stepCount = 0;
+		}
+		else if (m_numWindow > 0) {
+			// the offset of an exchange is off by at most half its round trip, more means the reference clock jumped
+			State s = m_state;
+			double predicted = s.offset + s.rate * (double)(e.local - s.local);
+			if (std::abs((double)e.offset - predicted) > (double)(e.roundTrip + STEP_NS)) {
+				if (++m_stepCount < STEP_EXCHANGES)
+					return;
+				m_numSteps++;
+				m_numWindow = 0;
+			}
+			m_stepCount = 0;
+		}
+
+		if (m_numWindow == 0)
+			m_next = 0;
+		m_window[m_next] = e;
+		m_next = (m_next + 1) % WINDOW;
+		m_numWindow = std::min(m_numWindow + 1, WINDOW);
+		m_numExchanges++;
+		fit();
+	}
+
+	void ClockSync::fit()
+	{
+		// exchanges with a round trip up to the lower quartile
+		int64_t roundTrips[WINDOW];
+		for (int i = 0; i < m_numWindow; i++)
+			roundTrips[i] = m_window[i].roundTrip;
+		std::sort(roundTrips, roundTrips + m_numWindow);
+		int64_t minRoundTrip = roundTrips[0], threshold = roundTrips[(m_numWindow - 1) / 4];
+
+		// least squares offset over time, relative to the newest exchange
+		const Exchange &ref = m_window[(m_next + WINDOW - 1) % WINDOW];
+		double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+		double xMin = 0.0, xMax = 0.0;
+		int n = 0;
+		for (int i = 0; i < m_numWindow; i++) {
+			const Exchange &e = m_window[i];
+			if (e.roundTrip > threshold)
+				continue;
+			double x = (double)(e.local - ref.local), y = (double)(e.offset - ref.offset);
+			sx += x; sy += y; sxx += x * x; sxy += x * y;
+			xMin = std::min(xMin, x);
+			xMax = std::max(xMax, x);
+			n++;
+		}
+
+		State s = m_state;
+		double a, b;
+		double det = n * sxx - sx * sx;
+		if (n >= 4 && xMax - xMin > 1e9 && det > 0.0) {
+			b = (n * sxy - sx * sy) / det;
+			a = (sy - b * sx) / n;
+		}
+		else {
+			// too short for a rate: keep the last one
+			b = m_numWindow > 1 ? s.rate : 0.0;
+			a = (sy - b * sx) / n;
+		}
+
+		double sr = 0.0;
+		for (int i = 0; i < m_numWindow; i++) {
+			const Exchange &e = m_window[i];
+			if (e.roundTrip > threshold)
+				continue;
+			double r = (double)(e.offset - ref.offset) - (a + b * (double)(e.local - ref.local));
+			sr += r * r;
+		}
+
+		s.local = ref.local;
+		s.offset = (double)ref.offset + a;
+		s.rate = b;
+		s.roundTrip = minRoundTrip;
+		s.error = (uint32_t)std::min<double>(0xffffffffu, minRoundTrip / 2 + std::sqrt(sr / n));
+		s.clock = m_clock;
+		s.locked = m_numWindow >= LOCK_EXCHANGES;
+		publish(s);
+	}
+
+	void ClockSync::run()
+	{
+		uint8_t packet[SYNC_BYTES + 1];
+		uint32_t sequence = 0;
+
+		while (m_running) {
+			NetImpairment imp;
+			{
+				RttLocalLock ll(m_mtxImpairment);
+				imp = m_impairment;
+			}
+
+			sequence++;
+			int64_t t1 = DllClock::now();
+			int64_t deadline = t1 + m_intervalMs * 1000000LL;
+			writePacket(packet, SYNC_REQUEST, sequence, 0, t1, 0, 0);
+			// the impairment delays the packet after t1, as a slow forward path would
+			if (impair(imp, m_random))
+				send(m_soc, packet, SYNC_BYTES, 0);
+
+			// the reply to this request, older ones are stale
+			bool replied = false;
+			for (;;) {
+				int64_t left = deadline - DllClock::now();
+				if (!m_running || left <= 0)
+					break;
+				struct pollfd pfd;
+				pfd.fd = m_soc;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				if (poll(&pfd, 1, (int)((left + 999999) / 1000000)) <= 0)
+					continue;
+				ssize_t r = recv(m_soc, packet, sizeof(packet), 0);
+				int64_t t4 = DllClock::now();
+				if (r < 0) {
+					// e.g. ECONNREFUSED while the server is down
+					std::this_thread::sleep_for(std::chrono::nanoseconds(left));
+					break;
+				}
+				if (!replied && isPacket(packet, r, SYNC_REPLY) && wire::get32(packet + 8) == sequence
+					&& (int64_t)wire::get64(packet + 16) == t1) {
+					add(t1, (int64_t)wire::get64(packet + 24), (int64_t)wire::get64(packet + 32), t4, wire::get32(packet + 12));
+					replied = true;
+				}
+			}
+			if (!replied && m_running)
+				m_numLost++;
+		}
+	}
+}
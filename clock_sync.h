@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <random>
+#include <string>
+
+#include <rtt/rtt.h>
+
+#include "wire_format.h"
+
+namespace autil {
+	// artificial network conditions for tests: every outgoing packet is held delay + [0, jitter) and dropped with probability loss
+	struct NetImpairment {
+		double delayMs, jitterMs, loss;
+
+		NetImpairment(double delayMs = 0.0, double jitterMs = 0.0, double loss = 0.0) : delayMs(delayMs), jitterMs(jitterMs), loss(loss) {}
+		inline bool active() const { return delayMs > 0.0 || jitterMs > 0.0 || loss > 0.0; }
+	};
+
+	/*
+	 * Reference clock of a set of nodes: answers the two-way timestamp requests of ClockSync clients with
+	 * its CLOCK_MONOTONIC, receive and send times taken as close to the socket calls as possible.
+	 */
+	class ClockSyncServer {
+	public:
+		ClockSyncServer(int port, const std::string &bindAddress = "0.0.0.0");
+		~ClockSyncServer();
+
+		// testing: serve t + offset + ppm * 1e-6 * t instead of CLOCK_MONOTONIC t, and delay the replies
+		void setClockSkew(int64_t offsetNs, double ppm);
+		void setImpairment(const NetImpairment &impairment);
+
+		// the reference time (skew included)
+		int64_t now() const;
+		inline uint64_t getNumRequests() const { return m_numRequests; }
+
+	private:
+		int m_soc;
+		std::atomic<int64_t> m_skewOffset;
+		std::atomic<double> m_skewPpm;
+		RttMutex m_mtxImpairment;
+		NetImpairment m_impairment;
+		std::minstd_rand m_random;
+		volatile uint64_t m_numRequests;
+
+		volatile bool m_running;
+		RttThread *m_thread;
+
+		void serve();
+	};
+
+	/*
+	 * Estimates the mapping of the local CLOCK_MONOTONIC to a ClockSyncServer's clock, NTP style: every
+	 * interval the thread sends a request stamped t1, the server stamps receive t2 and send t3, the reply
+	 * arrives at t4. Per exchange: offset ((t2 - t1) + (t3 - t4)) / 2, round trip (t4 - t1) - (t3 - t2).
+	 * Queueing only ever adds delay, so the offset is fitted (least squares, offset and rate) to the
+	 * quarter of the last WINDOW exchanges with the shortest round trips. The error bound is half the shortest round
+	 * trip (worst case path asymmetry) plus the fit residual.
+	 *
+	 * Combined with a stream's frame clock (DllClock: frame -> local time) blocks get timestamps that
+	 * compare across nodes (wire::Timestamp, DebugStream::setClockSync()). Readers are lock-free.
+	 */
+	class ClockSync {
+	public:
+		static const int WINDOW = 256; // exchanges in the fit
+		static const int LOCK_EXCHANGES = 8;
+
+		ClockSync(const std::string &serverAddress, int port, int intervalMs = 100);
+		~ClockSync();
+
+		// random id of this process's CLOCK_MONOTONIC timebase, the clock of unsynchronized timestamps
+		static uint32_t localClockId();
+
+		void setImpairment(const NetImpairment &impairment);
+
+		// any thread
+		bool isLocked() const;
+		int64_t toReference(int64_t localNs) const;
+		int64_t toLocal(int64_t referenceNs) const;
+		// a local CLOCK_MONOTONIC time on the reference timebase when locked, else on the local one
+		wire::Timestamp stamp(int64_t localNs) const;
+
+		double getOffsetNs() const; // reference - local, now
+		double getRatePpm() const; // reference clock rate against the local one
+		int64_t getRoundTripNs() const; // shortest in the window
+		uint32_t getErrorNs() const;
+		uint32_t getReferenceClock() const; // timebase id of the server, 0 before the first reply
+		inline uint64_t getNumExchanges() const { return m_numExchanges; }
+		inline uint64_t getNumLost() const { return m_numLost; }
+		inline uint64_t getNumSteps() const { return m_numSteps; } // reference clock jumps, the fit restarted
+
+	private:
+		struct Exchange {
+			int64_t local; // midpoint of t1 and t4
+			int64_t offset, roundTrip;
+		};
+
+		struct State {
+			int64_t local; // reference point of the fit
+			double offset; // ns at local
+			double rate; // offset change per local ns
+			int64_t roundTrip;
+			uint32_t error, clock;
+			bool locked;
+		};
+
+		int m_soc;
+		int m_intervalMs;
+		RttMutex m_mtxImpairment;
+		NetImpairment m_impairment;
+		std::minstd_rand m_random;
+
+		// sync thread
+		Exchange m_window[WINDOW];
+		int m_numWindow, m_next;
+		uint32_t m_clock;
+		int m_stepCount;
+
+		State m_state;
+		std::atomic<uint32_t> m_seq;
+		volatile uint64_t m_numExchanges, m_numLost, m_numSteps;
+
+		volatile bool m_running;
+		RttThread *m_thread;
+
+		State read() const;
+		void publish(const State &s);
+		void add(int64_t t1, int64_t t2, int64_t t3, int64_t t4, uint32_t clock);
+		void fit();
+		void run();
+	};
+}
@@ -0,0 +1,167 @@
+#include "commit_queue.h"
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace autil {
+	CommitQueue::CommitQueue(uint32_t slots, uint32_t slotSamples, Overflow overflow)
+		: m_slots(slots), m_slotSamples(slotSamples), m_overflow(overflow),
+		m_write(0), m_read(0), m_lost(0), m_cancelled(false), m_eventFd(-1)
+	{
+		if (slots == 0)
+			throw std::invalid_argument("CommitQueue needs at least one slot!");
+
+		m_data.assign((size_t)slots * slotSamples, 0.0f);
+		m_slotInfo = new Slot[slots];
+		for (uint32_t i = 0; i < slots; i++) {
+			m_slotInfo[i].seq.store(0, std::memory_order_relaxed);
+			m_slotInfo[i].windowBegin = m_slotInfo[i].windowEnd = 0;
+		}
+
+#ifdef __linux__
+		m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	}
+
+	CommitQueue::~CommitQueue()
+	{
+#ifdef __linux__
+		if (m_eventFd >= 0)
+			close(m_eventFd);
+#endif
+		delete[] m_slotInfo;
+	}
+
+	uint32_t CommitQueue::size() const
+	{
+		uint64_t w = m_write.load(std::memory_order_acquire);
+		uint64_t r = m_read.load(std::memory_order_acquire);
+		return (uint32_t)std::min<uint64_t>(w - r, m_slots);
+	}
+
+	bool CommitQueue::full() const
+	{
+		return m_write.load(std::memory_order_relaxed) - m_read.load(std::memory_order_acquire) >= m_slots;
+	}
+
+	float *CommitQueue::beginWrite()
+	{
+		uint64_t w = m_write.load(std::memory_order_relaxed);
+
+		if (m_overflow != Overflow::DropOldest && full()) {
+			m_lost.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		slot(w).seq.store(2 * w + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		return slotData(w);
+	}
+
+	void CommitQueue::endWrite(uint64_t windowBegin, uint64_t windowEnd)
+	{
+		uint64_t w = m_write.load(std::memory_order_relaxed);
+		Slot &s = slot(w);
+		s.windowBegin = windowBegin;
+		s.windowEnd = windowEnd;
+		s.seq.store(2 * w + 2, std::memory_order_release);
+		m_write.store(w + 1, std::memory_order_release);
+		notifyConsumer();
+	}
+
+	bool CommitQueue::waitForSpace(int timeoutMs)
+	{
+		// reset first, a slot freed after this signals again
+		m_evSpace.Reset();
+		if (!full())
+			return true;
+		m_evSpace.Wait(timeoutMs);
+		return !full();
+	}
+
+	void CommitQueue::notifyConsumer()
+	{
+#ifdef __linux__
+		if (m_eventFd >= 0) {
+			uint64_t one = 1;
+			if (::write(m_eventFd, &one, sizeof(one)) == sizeof(one))
+				return;
+		}
+#endif
+		m_evData.Signal();
+	}
+
+	bool CommitQueue::waitForData(int timeoutMs)
+	{
+#ifdef __linux__
+		if (m_eventFd >= 0) {
+			struct pollfd pfd = { m_eventFd, POLLIN, 0 };
+			if (poll(&pfd, 1, timeoutMs) <= 0)
+				return false;
+			uint64_t count;
+			if (::read(m_eventFd, &count, sizeof(count)) < 0) {}
+			return true;
+		}
+#endif
+		m_evData.Reset();
+		if (m_write.load(std::memory_order_acquire) != m_read.load(std::memory_order_relaxed))
+			return true;
+		return m_evData.Wait(timeoutMs);
+	}
+
+	void CommitQueue::cancel()
+	{
+		m_cancelled.store(true, std::memory_order_release);
+		notifyConsumer();
+	}
+
+	bool CommitQueue::read(float *dst, uint64_t *windowBegin, uint64_t *windowEnd, int timeoutMs)
+	{
+		for (;;) {
+			if (m_cancelled.exchange(false, std::memory_order_acq_rel))
+				return false;
+
+			uint64_t r = m_read.load(std::memory_order_relaxed);
+			uint64_t w = m_write.load(std::memory_order_acquire);
+
+			if (r == w) {
+				if (!waitForData(timeoutMs) && timeoutMs >= 0)
+					return false;
+				continue;
+			}
+
+			// DropOldest: the producer lapped us
+			if (w - r > m_slots) {
+				m_lost.fetch_add(w - r - m_slots, std::memory_order_relaxed);
+				r = w - m_slots;
+			}
+
+			Slot &s = slot(r);
+			uint64_t seq = s.seq.load(std::memory_order_acquire);
+			if (seq == 2 * r + 2) {
+				memcpy(dst, slotData(r), m_slotSamples * sizeof(float));
+				uint64_t begin = s.windowBegin, end = s.windowEnd;
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (s.seq.load(std::memory_order_relaxed) == seq) {
+					m_read.store(r + 1, std::memory_order_release);
+					m_evSpace.Signal();
+					*windowBegin = begin;
+					*windowEnd = end;
+					return true;
+				}
+			}
+
+			// overwritten before or while copying
+			m_lost.fetch_add(1, std::memory_order_relaxed);
+			m_read.store(r + 1, std::memory_order_release);
+		}
+	}
+}
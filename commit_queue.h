@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include <rtt/rtt.h>
+
+namespace autil {
+	/*
+	 * N-slot ring of committed observer windows between the audio thread (single producer) and one
+	 * consumer thread. Each slot is a seqlock: the producer never waits for the consumer unless
+	 * the overflow policy says so, the consumer detects slots overwritten while it was copying.
+	 * On Linux the consumer is woken through an eventfd (getEventFd() for select/poll loops).
+	 */
+	class CommitQueue {
+	public:
+		enum class Overflow : int {
+			DropOldest, // overwrite the oldest unread window
+			DropNewest, // discard the window being committed
+			Block, // the audio thread waits for the consumer (offline processing only)
+		};
+
+		CommitQueue(uint32_t slots, uint32_t slotSamples, Overflow overflow);
+		~CommitQueue();
+
+		inline uint32_t getSlots() const { return m_slots; }
+		inline uint32_t getSlotSamples() const { return m_slotSamples; }
+		inline Overflow getOverflow() const { return m_overflow; }
+
+		// windows committed and not yet read
+		uint32_t size() const;
+		bool full() const;
+		// windows dropped or overwritten before the consumer read them
+		inline uint64_t getNumLost() const { return m_lost.load(std::memory_order_relaxed); }
+
+		// producer: beginWrite() returns the slot to fill or nullptr if the window is dropped
+		float *beginWrite();
+		void endWrite(uint64_t windowBegin, uint64_t windowEnd);
+		// producer: wait until a slot is free, returns false on timeout
+		bool waitForSpace(int timeoutMs);
+
+		// consumer: copy the oldest window to dst (getSlotSamples() floats),
+		// returns false on timeout (timeoutMs >= 0) or cancel()
+		bool read(float *dst, uint64_t *windowBegin, uint64_t *windowEnd, int timeoutMs = -1);
+		// wake a consumer blocked in read()
+		void cancel();
+
+		inline int getEventFd() const { return m_eventFd; }
+
+	private:
+		struct Slot {
+			std::atomic<uint64_t> seq; // 2*n+1 while window n is written, 2*n+2 when complete
+			uint64_t windowBegin, windowEnd;
+		};
+
+		uint32_t m_slots, m_slotSamples;
+		Overflow m_overflow;
+
+		std::vector<float> m_data;
+		Slot *m_slotInfo;
+
+		std::atomic<uint64_t> m_write; // producer
+		std::atomic<uint64_t> m_read; // consumer
+		std::atomic<uint64_t> m_lost;
+		std::atomic<bool> m_cancelled;
+
+		int m_eventFd; // -1 where eventfd is not available
+		RttEvent m_evData, m_evSpace;
+
+		inline Slot &slot(uint64_t n) { return m_slotInfo[n % m_slots]; }
+		inline float *slotData(uint64_t n) { return &m_data[(n % m_slots) * m_slotSamples]; }
+
+		void notifyConsumer();
+		bool waitForData(int timeoutMs);
+	};
+}
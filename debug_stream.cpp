@@ -0,0 +1,127 @@
+#include <iostream>
+#include <stdexcept>
+
+#include "debug_stream.h"
+#include "clock_sync.h"
+#include "net.h"
+
+namespace autil {
+	DebugStream::DebugStream(const std::string &address, int port, uint32_t channels, uint32_t maxBlockLength, uint32_t slots,
+		wire::PayloadType format)
+		: m_channels(channels), m_maxBlockLength(maxBlockLength), m_format(format),
+		m_queue(slots, channels * maxBlockLength, CommitQueue::Overflow::DropNewest),
+		m_numTooLong(0), m_blockIndex(0), m_frame(0), m_sync(nullptr), m_latencyNs(0), m_running(true)
+	{
+		// wire formats are split into MTU sized packets, legacy blocks must fit one datagram
+		if (format == wire::PayloadType::Legacy && 4 + channels * (1 + (size_t)maxBlockLength) > UdpSocket::MAX_DATAGRAM)
+			throw std::invalid_argument("DebugStream: " + std::to_string(channels) + "ch of " + std::to_string(maxBlockLength)
+				+ " samples do not fit a legacy datagram, use a wire format");
+
+		// a batch of slots in flight
+		m_socket = new UdpSocket(address, port, 256 * 1024);
+		m_thread = new RttThread([this]() { send(); }, false, "debug net");
+	}
+
+	DebugStream::~DebugStream()
+	{
+		m_running = false;
+		m_queue.cancel();
+		delete m_thread;
+		delete m_socket;
+	}
+
+	bool DebugStream::addSubscriber(const std::string &address, int port)
+	{
+		return m_socket->addDestination(address, port);
+	}
+
+	bool DebugStream::removeSubscriber(const std::string &address, int port)
+	{
+		return m_socket->removeDestination(address, port);
+	}
+
+	size_t DebugStream::getNumSubscribers() const
+	{
+		return m_socket->getNumDestinations();
+	}
+
+	void DebugStream::setClockSync(const ClockSync *sync, double sampleRate, int64_t latencyNs)
+	{
+		m_clock.setNominalRate(sampleRate);
+		m_sync = sync;
+		m_latencyNs = latencyNs;
+	}
+
+	float *DebugStream::beginBlock(uint32_t length)
+	{
+		if (length > m_maxBlockLength) {
+			m_numTooLong++;
+			m_blockIndex++;
+			m_frame += length;
+			return nullptr;
+		}
+		float *slot = m_queue.beginWrite();
+		if (!slot) {
+			m_blockIndex++;
+			m_frame += length;
+		}
+		return slot;
+	}
+
+	void DebugStream::endBlock(uint32_t length)
+	{
+		// slot window: length and the (32 bit) block index packed into windowBegin, the frame in windowEnd
+		m_queue.endWrite(length | ((m_blockIndex++ & 0xffffffffull) << 32), m_frame);
+		m_frame += length;
+		m_clock.update(m_frame, DllClock::now());
+	}
+
+	void DebugStream::send()
+	{
+		std::vector<float> block(m_channels * m_maxBlockLength);
+		std::vector<const float *> samples(m_channels);
+		for (uint32_t c = 0; c < m_channels; c++)
+			samples[c] = &block[c * m_maxBlockLength];
+
+		uint64_t window, frame;
+		while (m_running) {
+			if (!m_queue.read(block.data(), &window, &frame, 100))
+				continue;
+
+			// nobody listening: skip the encoding
+			if (m_socket->getNumDestinations() == 0) {
+				while (m_running && m_queue.read(block.data(), &window, &frame, 0));
+				continue;
+			}
+
+			// everything queued meanwhile goes out with one sendmmsg()
+			m_socket->beginBatch();
+			do {
+				uint32_t length = (uint32_t)window;
+				if (m_format == wire::PayloadType::Legacy) {
+					// the index wraps around (8 bit on the wire), dropped blocks leave a gap
+					m_socket->sendBlock(samples, length, (int16_t)(window >> 32));
+				}
+				else {
+					// no timestamp until the frame clock settled, nor without ClockSync (POSIX only)
+					wire::Timestamp ts;
+#if !WIN32
+					if (m_clock.isLocked()) {
+						int64_t t = (int64_t)(m_clock.frameToTime((double)frame) * 1e9) - m_latencyNs;
+						const ClockSync *sync = m_sync;
+						if (sync) {
+							ts = sync->stamp(t);
+						}
+						else {
+							ts.time = t;
+							ts.clock = ClockSync::localClockId();
+						}
+					}
+#endif
+					m_socket->sendFrames(samples.data(), m_channels, length, frame, m_format, ts);
+				}
+			} while (m_running && m_queue.read(block.data(), &window, &frame, 0));
+			m_socket->endBatch();
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <rtt/rtt.h>
+
+#include "commit_queue.h"
+#include "dll_clock.h"
+#include "wire_format.h"
+
+namespace autil {
+	class UdpSocket;
+	class ClockSync;
+
+	/*
+	 * Debug UDP stream of a SignalBuffer (WITH_DEBUG_NET). The audio thread only copies each block
+	 * into a preallocated slot of a CommitQueue (dropped if the queue is full, never blocks);
+	 * a sender thread encodes the blocks and sends them: Legacy with UdpSocket::sendBlock() (8 bit,
+	 * wrapping block index), any other format as versioned packets with UdpSocket::sendFrames()
+	 * (sequence number and the frame of the first sample, so receivers can place blocks after drops).
+	 *
+	 * Blocks go to any number of subscribers (unicast or multicast groups, added and removed at runtime),
+	 * each block is encoded once for all of them. Without subscribers blocks are dropped unencoded.
+	 *
+	 * Versioned packets carry the time of their first frame: a DllClock follows the frames written per
+	 * CLOCK_MONOTONIC, shifted by the latency between capture and the buffer and mapped to the timebase
+	 * of a ClockSync if set, else stamped on the local timebase.
+	 */
+	class DebugStream {
+	public:
+		// address may be empty: no subscriber until addSubscriber()
+		DebugStream(const std::string &address, int port, uint32_t channels, uint32_t maxBlockLength = 2048, uint32_t slots = 64,
+			wire::PayloadType format = wire::PayloadType::Legacy);
+		~DebugStream();
+
+		inline uint32_t getMaxBlockLength() const { return m_maxBlockLength; }
+		inline wire::PayloadType getFormat() const { return m_format; }
+		// blocks dropped because the sender fell behind (or longer than getMaxBlockLength())
+		inline uint64_t getNumDropped() const { return m_queue.getNumLost() + m_numTooLong; }
+
+		// any thread, false if the subscriber is already (not) there
+		bool addSubscriber(const std::string &address, int port);
+		bool removeSubscriber(const std::string &address, int port);
+		size_t getNumSubscribers() const;
+
+		// timestamps on the sync's timebase (nullptr: local), sampleRate seeds the frame clock, latencyNs is
+		// the time from the capture of a frame until its block is written
+		void setClockSync(const ClockSync *sync, double sampleRate, int64_t latencyNs = 0);
+		inline const DllClock &getFrameClock() const { return m_clock; }
+
+		// audio thread: planar slot (channel c at c * getMaxBlockLength()) or nullptr if the block is dropped,
+		// fill length samples per channel then endBlock()
+		float *beginBlock(uint32_t length);
+		void endBlock(uint32_t length);
+
+	private:
+		uint32_t m_channels, m_maxBlockLength;
+		wire::PayloadType m_format;
+		CommitQueue m_queue;
+		UdpSocket *m_socket;
+		volatile uint64_t m_numTooLong;
+		uint64_t m_blockIndex; // audio thread, counts dropped blocks too
+		uint64_t m_frame; // audio thread, frame of the next block (dropped blocks included)
+		DllClock m_clock; // frames written -> CLOCK_MONOTONIC
+		std::atomic<const ClockSync *> m_sync;
+		std::atomic<int64_t> m_latencyNs;
+
+		volatile bool m_running;
+		RttThread *m_thread;
+
+		void send();
+	};
+}
@@ -0,0 +1,121 @@
+#include "dll_clock.h"
+
+#include <cmath>
+#include <chrono>
+#include <time.h>
+
+namespace autil {
+
+	static const uint32_t LOCK_UPDATES = 16; // updates until the loop has settled
+	DllClock::DllClock(double bandwidthHz) : m_seq(0), m_nominalRate(48000.0), m_bandwidth(bandwidthHz), m_maxError(0.01)
+	{
+		m_state.frame = 0.0;
+		m_state.time = 0.0;
+		m_state.period = 1.0 / m_nominalRate;
+		m_state.numUpdates = 0;
+	}
+
+	int64_t DllClock::now()
+	{
+#ifdef __unix__
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void DllClock::publish(const State &s)
+	{
+		uint32_t seq = m_seq.load(std::memory_order_relaxed);
+		m_seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_state = s;
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+
+	DllClock::State DllClock::read() const
+	{
+		State s;
+		uint32_t seq0, seq1;
+		do {
+			seq0 = m_seq.load(std::memory_order_acquire);
+			s = m_state;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			seq1 = m_seq.load(std::memory_order_relaxed);
+		} while (seq0 != seq1 || (seq0 & 1));
+		return s;
+	}
+
+	void DllClock::reset()
+	{
+		State s = m_state;
+		s.numUpdates = 0;
+		publish(s);
+	}
+
+	void DllClock::update(uint64_t frame, int64_t timeNs)
+	{
+		State s = m_state;
+		double t = timeNs * 1e-9;
+		double df = (double)frame - s.frame;
+
+		if (s.numUpdates == 0 || df <= 0.0) {
+			s.frame = (double)frame;
+			s.time = t;
+			s.period = 1.0 / m_nominalRate;
+			s.numUpdates = 1;
+			publish(s);
+			return;
+		}
+
+		double predicted = s.time + df * s.period;
+		double e = t - predicted;
+
+		if (std::abs(e) > m_maxError) {
+			s.numUpdates = 0;
+			publish(s);
+			update(frame, timeNs);
+			return;
+		}
+
+		// 2nd order loop, critically damped; coefficients follow the actual update interval
+		double omega = 2.0 * M_PI * m_bandwidth * df * s.period;
+		double b = std::sqrt(2.0) * omega;
+		double c = omega * omega;
+
+		s.time = predicted + b * e;
+		s.frame = (double)frame;
+		s.period += c * e / df;
+		s.numUpdates++;
+		publish(s);
+	}
+
+	bool DllClock::isLocked() const
+	{
+		return read().numUpdates >= LOCK_UPDATES;
+	}
+
+	double DllClock::frameToTime(double frame) const
+	{
+		State s = read();
+		return s.time + (frame - s.frame) * s.period;
+	}
+
+	double DllClock::timeToFrame(double time) const
+	{
+		State s = read();
+		return s.frame + (time - s.time) / s.period;
+	}
+
+	double DllClock::getRate() const
+	{
+		return 1.0 / read().period;
+	}
+
+	double DllClock::getDriftPpm() const
+	{
+		return (getRate() / m_nominalRate - 1.0) * 1e6;
+	}
+}
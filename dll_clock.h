@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+namespace autil {
+	/*
+	 * Delay-locked loop (F. Adriaensen, "Using a DLL to filter time") mapping a stream's frame
+	 * position to CLOCK_MONOTONIC. The audio thread feeds (frame, timestamp) pairs, e.g. from
+	 * snd_pcm_status; consumer threads read the smoothed mapping lock-free (seqlock).
+	 */
+	class DllClock {
+	public:
+		DllClock(double bandwidthHz = 0.1);
+
+		inline void setNominalRate(double sampleRate) { m_nominalRate = sampleRate; }
+		inline void setBandwidth(double hz) { m_bandwidth = hz; }
+		// timing errors above this (seconds) re-initialize the loop (xrun, restart), default 10 ms.
+		// Packet arrival times need more.
+		inline void setMaxError(double seconds) { m_maxError = seconds; }
+
+		// audio thread
+		void reset();
+		void update(uint64_t frame, int64_t timeNs);
+
+		// any thread, times are CLOCK_MONOTONIC seconds
+		bool isLocked() const;
+		double frameToTime(double frame) const;
+		double timeToFrame(double time) const;
+		double getRate() const; // frames per second
+		double getDriftPpm() const; // against the nominal rate
+
+		// CLOCK_MONOTONIC ns, std::chrono::steady_clock on systems without it
+		static int64_t now();
+
+	private:
+		struct State {
+			double frame; // reference frame
+			double time; // filtered time of the reference frame
+			double period; // seconds per frame
+			uint32_t numUpdates;
+		};
+
+		State m_state;
+		std::atomic<uint32_t> m_seq;
+
+		double m_nominalRate, m_bandwidth, m_maxError;
+
+		State read() const;
+		void publish(const State &s);
+	};
+}
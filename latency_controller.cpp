@@ -0,0 +1,125 @@
+#include "latency_controller.h"
+
+#include <algorithm>
+
+namespace autil {
+
+	LatencyController::LatencyController(const Policy &policy) : m_policy(policy)
+	{
+		m_sampleRate = 48000;
+		m_period = m_target = clamp(m_policy.minPeriod);
+		m_time = 0.0;
+		m_backoff = 1.0;
+		m_steppedDown = false;
+		m_deferred = false;
+		m_numXruns = m_xrunHead = 0;
+		reset(m_period, m_sampleRate);
+	}
+
+	void LatencyController::setPolicy(const Policy &policy)
+	{
+		m_policy = policy;
+		m_target = clamp(m_target);
+		m_backoff = 1.0;
+	}
+
+	void LatencyController::reset(int period, int sampleRate)
+	{
+		// xruns at the old period say nothing about the new one
+		if (period != m_period)
+			m_numXruns = m_xrunHead = 0;
+		// the device rounded the period: that is the target now, else update() would ask for a restart right away
+		if (period != m_target) {
+			// it did not take a step down, wait longer before the next attempt
+			if (m_steppedDown && period >= m_period) {
+				m_backoff *= 2.0;
+				m_steppedDown = false;
+			}
+			m_target = period;
+		}
+		m_period = period;
+		m_sampleRate = sampleRate;
+		m_stableSince = m_time;
+		m_load = 0.0;
+		m_minDelay = period;
+		m_deferred = false;
+	}
+
+	int LatencyController::clamp(int period) const
+	{
+		return (std::max)(m_policy.minPeriod, (std::min)(m_policy.maxPeriod, period));
+	}
+
+	int LatencyController::xrunsInLastMinute() const
+	{
+		int n = 0;
+		for (int i = 0; i < m_numXruns; i++) {
+			if (m_time - m_xrunTimes[i] < 60.0)
+				n++;
+		}
+		return n;
+	}
+
+	void LatencyController::grow()
+	{
+		m_target = clamp(m_period + m_policy.step);
+		m_stableSince = m_time;
+		m_deferred = false;
+	}
+
+	void LatencyController::xrun(bool recovered)
+	{
+		if (m_time < m_policy.warmupSeconds)
+			return;
+
+		m_xrunTimes[m_xrunHead] = m_time;
+		m_xrunHead = (m_xrunHead + 1) % XRUN_HISTORY;
+		if (m_numXruns < XRUN_HISTORY)
+			m_numXruns++;
+
+		m_stableSince = m_time;
+
+		// the last step down was too optimistic: wait longer before trying again
+		if (m_steppedDown) {
+			m_backoff *= 2.0;
+			m_steppedDown = false;
+		}
+
+		int xruns = xrunsInLastMinute();
+		if (xruns > m_policy.maxXrunsPerMinute) {
+			grow();
+			m_deferred = recovered && xruns <= 2.0 * m_policy.maxXrunsPerMinute + 1.0;
+		}
+	}
+
+	bool LatencyController::update(uint32_t nframes, double callbackSeconds, long playbackDelay)
+	{
+		const double periodSeconds = (double)m_period / m_sampleRate;
+		m_time += (double)nframes / m_sampleRate;
+
+		// exponential average over ~32 periods
+		m_load += (callbackSeconds / periodSeconds - m_load) * (1.0 / 32.0);
+		if (playbackDelay < m_minDelay)
+			m_minDelay = playbackDelay;
+
+		bool lowHeadroom = m_load > m_policy.maxLoad || m_minDelay < (long)(m_policy.minDelayMargin * m_period);
+
+		if ((m_target == m_period || m_deferred) && m_time >= m_policy.warmupSeconds) {
+			if (lowHeadroom) {
+				grow();
+			}
+			else if (m_target == m_period && m_time - m_stableSince > m_policy.stableSeconds * m_backoff) {
+				// the previous step down held up
+				if (m_steppedDown)
+					m_backoff = (std::max)(1.0, m_backoff / 2.0);
+
+				m_target = clamp(m_period - m_policy.step);
+				m_steppedDown = (m_target != m_period);
+				m_stableSince = m_time;
+				m_minDelay = m_period;
+			}
+		}
+
+		return m_target != m_period && !m_deferred;
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace autil {
+	/*
+	 * Closed-loop period size controller.
+	 * Grows the period when xruns exceed the configured rate or the headroom (callback load,
+	 * playback delay margin) runs low, and shrinks it again after a stable interval. If a step
+	 * down causes xruns, the next attempt waits exponentially longer.
+	 * A larger period after xruns that were recovered in place waits for the next restart of the
+	 * device, unless they keep piling up (more than twice the tolerated rate).
+	 * Time is derived from processed frames, so the controller is deterministic and RT-safe.
+	 */
+	class LatencyController {
+	public:
+		struct Policy {
+			int minPeriod; // frames
+			int maxPeriod; // frames, upper bound for the latency
+			int step; // frames per adjustment
+
+			double maxXrunsPerMinute; // tolerated xrun rate before growing the period
+			double maxLoad; // callback time / period time above which headroom is considered low
+			double minDelayMargin; // minimum playback delay in periods before headroom is considered low
+			double stableSeconds; // xrun-free time with enough headroom before trying a smaller period
+			double warmupSeconds; // xruns are ignored while the CPU leaves power saving states
+
+			Policy() {
+				minPeriod = 32;
+				maxPeriod = 2048;
+				step = 16;
+				maxXrunsPerMinute = 2.0;
+				maxLoad = 0.7;
+				minDelayMargin = 0.25;
+				stableSeconds = 30.0;
+				warmupSeconds = 6.0;
+			}
+		};
+
+		LatencyController(const Policy &policy = Policy());
+
+		void setPolicy(const Policy &policy);
+		inline const Policy &getPolicy() const { return m_policy; }
+
+		// called after (re-)configuration with the period the device actually accepted, which becomes the target
+		void reset(int period, int sampleRate);
+
+		// recovered: the driver recovered in place and keeps running with the current period
+		void xrun(bool recovered);
+
+		// feed one period; returns true if the target period changed and the device should be reconfigured
+		bool update(uint32_t nframes, double callbackSeconds, long playbackDelay);
+
+		inline int getTarget() const { return m_target; }
+		inline int getPeriod() const { return m_period; }
+
+	private:
+		static const int XRUN_HISTORY = 16;
+
+		Policy m_policy;
+
+		int m_period, m_target, m_sampleRate;
+		double m_time; // seconds since start, in frames
+		double m_stableSince;
+		double m_load; // smoothed callback load
+		long m_minDelay;
+
+		double m_backoff; // multiplier on stableSeconds, doubled whenever a step down fails
+		bool m_steppedDown;
+		bool m_deferred; // the target grew after recovered xruns, applied with the next restart
+
+		double m_xrunTimes[XRUN_HISTORY];
+		int m_xrunHead, m_numXruns;
+
+		int xrunsInLastMinute() const;
+		void grow();
+		int clamp(int period) const;
+	};
+}
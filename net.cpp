@@ -6,19 +6,41 @@
 #pragma comment( lib, "Ws2_32.lib" )
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>	
+#include <unistd.h>
+#include <errno.h>
 #define SOCKET int
 #endif
 
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
 #include "net.h"
 #include "../pclog/pclog.h"
 #include "signal_buffer.h"
 
 namespace autil {
+	const uint32_t UdpSocket::MIN_SLICE_FRAMES;
+
+	static void closeSocket(SOCKET s) {
+#if WIN32
+		closesocket(s);
+#else
+		close(s);
+#endif
+	}
 
-	UdpSocket::UdpSocket(std::string receiverAddress, int port) : receiverAddress(receiverAddress), port(port) {
+	UdpSocket::UdpSocket(std::string receiverAddress, int port, int sendBufferBytes) : receiverAddress(receiverAddress), port(port),
+		m_poolUsed(0), m_batchDepth(0), m_numFailed(0), m_numBytes(0), m_sequence(0), m_maxPacketBytes(DEFAULT_MAX_PACKET) {
 		blockIndex_ = 0;
+		m_pool.resize(POOL_BYTES);
+		m_messages.reserve(MAX_BATCH);
+#if !defined(__linux__)
+		m_scratch.resize(MAX_DATAGRAM);
+#endif
 #if WIN32
 		static bool needWSInit = true;
 
@@ -29,8 +51,6 @@ namespace autil {
 		}
 #endif
 
-		int r;
-
 		SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 		if (s == -1) {
 			throw "Failed to create UDP socket!";
@@ -38,68 +58,237 @@ namespace autil {
 
 
 
-		int send_buffer = 16 * 1024;
-		int send_buffer_sizeof = sizeof(send_buffer);
-		r = setsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&send_buffer, send_buffer_sizeof);
-		if (r < 0) {
+        soc = s;
+
+		if (setSendBufferSize(sendBufferBytes) < 0) {
+			closeSocket(s);
 			throw ("Could not set send buffer size!");
 		}
 
-        soc = s;
-
 
-		sa = new struct sockaddr_in();
-		memset(sa, 0, sizeof(struct sockaddr_in));
-		sa->sin_family = AF_INET;
-		r = inet_pton(AF_INET, receiverAddress.c_str(), &(sa->sin_addr));
-		if (r <= 0) {
-			throw ("Invalid address " + receiverAddress);
+		if (!receiverAddress.empty()) {
+			Destination d;
+			if (!destination(receiverAddress, port, d)) {
+				closeSocket(s);
+				throw ("Invalid address " + receiverAddress);
+			}
+			m_destinations.push_back(d);
 		}
-		sa->sin_port = htons(port);
 
 
 		LOG(logDEBUG) << "Created UDP port to " << receiverAddress << ":" << port;
 	}
 
 	UdpSocket::~UdpSocket() {
-		delete sa;
+		closeSocket(soc);
 	}
 
-	bool UdpSocket::Send(const char *data, int length) {
-		int r = sendto((SOCKET)soc, data, length, 0, (struct sockaddr*)sa, sizeof(struct sockaddr_in));
-		return (r == length);
+	bool UdpSocket::destination(const std::string &address, int port, Destination &d) {
+		struct in_addr a;
+		if (inet_pton(AF_INET, address.c_str(), &a) <= 0 || port <= 0 || port > 0xffff)
+			return false;
+		d.address = a.s_addr;
+		d.port = htons((uint16_t)port);
+		return true;
 	}
 
+	static void toSockaddr(uint32_t address, uint16_t port, struct sockaddr_in &sa) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = address;
+		sa.sin_port = port;
+	}
 
-	bool UdpSocket::Send(const SignalBufferObserver& observer) {
-		auto floatData = observer.getTimeStageAll();
-		uint32_t len = 64; // observer.getLength();
-		int headerLen = (1 + 1 + 1 + 1) * sizeof(uint32_t) / sizeof(int16_t);
+	std::string UdpSocket::describeDestinations() {
+		size_t n = getNumDestinations();
+		if (!receiverAddress.empty() && n == 1)
+			return receiverAddress + ":" + std::to_string(port);
+		return std::to_string(n) + " destinations";
+	}
+
+	bool UdpSocket::addDestination(const std::string &address, int port) {
+		Destination d;
+		if (!destination(address, port, d))
+			throw std::invalid_argument("Invalid address " + address + ":" + std::to_string(port));
+		std::lock_guard<std::mutex> lock(m_mtxDestinations);
+		if (std::find(m_destinations.begin(), m_destinations.end(), d) != m_destinations.end())
+			return false;
+		m_destinations.push_back(d);
+		LOG(logINFO) << "Added UDP destination " << address << ":" << port << " (" << m_destinations.size() << ")";
+		return true;
+	}
+
+	bool UdpSocket::removeDestination(const std::string &address, int port) {
+		Destination d;
+		if (!destination(address, port, d))
+			throw std::invalid_argument("Invalid address " + address + ":" + std::to_string(port));
+		std::lock_guard<std::mutex> lock(m_mtxDestinations);
+		auto it = std::find(m_destinations.begin(), m_destinations.end(), d);
+		if (it == m_destinations.end())
+			return false;
+		m_destinations.erase(it);
+		LOG(logINFO) << "Removed UDP destination " << address << ":" << port << " (" << m_destinations.size() << ")";
+		return true;
+	}
+
+	size_t UdpSocket::getNumDestinations() {
+		std::lock_guard<std::mutex> lock(m_mtxDestinations);
+		return m_destinations.size();
+	}
 
-		int16_t *data = new int16_t[floatData.size() * len + headerLen];
+	void UdpSocket::setMulticastTtl(int ttl) {
+		if (setsockopt((SOCKET)soc, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&ttl, sizeof(ttl)) < 0)
+			throw std::runtime_error("Failed to set multicast TTL " + std::to_string(ttl));
+	}
 
+	void UdpSocket::setMulticastInterface(const std::string &address) {
+		struct in_addr a;
+		if (inet_pton(AF_INET, address.c_str(), &a) <= 0)
+			throw std::invalid_argument("Invalid address " + address);
+		if (setsockopt((SOCKET)soc, IPPROTO_IP, IP_MULTICAST_IF, (char*)&a, sizeof(a)) < 0)
+			throw std::runtime_error("Failed to set multicast interface " + address);
+	}
 
+	int UdpSocket::setSendBufferSize(int bytes) {
+		if (setsockopt((SOCKET)soc, SOL_SOCKET, SO_SNDBUF, (char*)&bytes, sizeof(bytes)) < 0)
+			return -1;
+		int granted = 0;
+		socklen_t len = sizeof(granted);
+		if (getsockopt((SOCKET)soc, SOL_SOCKET, SO_SNDBUF, (char*)&granted, &len) < 0)
+			return -1;
+		return granted;
+	}
 
-		*((uint32_t*)(data)+0) = floatData.size(); // num channels
-		*((uint32_t*)(data)+1) = len; // length
-		*((uint32_t*)(data)+2) = observer.lastUpdate; // length
-		*((uint32_t*)(data)+3) = 0; // not in use
+	void UdpSocket::beginBatch() {
+		m_batchDepth++;
+	}
 
-		int ci = 0;
-		for (auto cd : floatData) {
-			for (uint32_t i = 0; i < len; i++) {
-				float f = floatData[ci][i];
-				if (f > 1.0) f = 1.0;
-				if (f < -1.0) f = -1.0;
-				data[headerLen + ci * len + i] = (int16_t)(f * 0x7fff);
+	bool UdpSocket::endBatch() {
+		if (m_batchDepth > 0 && --m_batchDepth > 0)
+			return true;
+		return flush();
+	}
+
+	// packet memory from the pool, valid until the batch is sent
+	uint8_t *UdpSocket::allocPacket(size_t bytes) {
+		if (bytes > MAX_DATAGRAM)
+			throw std::invalid_argument("UDP datagram too large (" + std::to_string(bytes) + " bytes)");
+		if (m_poolUsed + bytes > m_pool.size() || m_messages.size() == (size_t)MAX_BATCH)
+			flush();
+		uint8_t *p = &m_pool[m_poolUsed];
+		m_poolUsed += bytes;
+		return p;
+	}
+
+	bool UdpSocket::queueMessage(const void *header, size_t headerBytes, const void *payload, size_t payloadBytes) {
+		if (m_messages.size() == (size_t)MAX_BATCH && !flush())
+			m_messages.clear();
+		m_messages.push_back(Message{ { header, payload }, { headerBytes, payloadBytes } });
+		return m_batchDepth > 0 || flush();
+	}
+
+	bool UdpSocket::flush() {
+		size_t n = m_messages.size();
+		uint64_t failed = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mtxDestinations);
+			m_sendTo.assign(m_destinations.begin(), m_destinations.end());
+		}
+		// destination major: each destination gets the datagrams in order
+		size_t total = n * m_sendTo.size();
+		for (size_t i = 0; i < n; i++)
+			m_numBytes += (m_messages[i].bytes[0] + m_messages[i].bytes[1]) * m_sendTo.size();
+
+#if defined(__linux__)
+		struct mmsghdr msgs[MAX_BATCH];
+		struct sockaddr_in names[MAX_BATCH];
+		struct iovec iov[MAX_BATCH * 2];
+		int numParts[MAX_BATCH];
+		for (size_t i = 0; i < n; i++) {
+			auto &m = m_messages[i];
+			int parts = 0;
+			for (int k = 0; k < 2; k++) {
+				if (m.bytes[k]) {
+					iov[2 * i + parts].iov_base = (void *)m.part[k];
+					iov[2 * i + parts].iov_len = m.bytes[k];
+					parts++;
+				}
 			}
-			ci++;
+			numParts[i] = parts;
 		}
-		auto res = Send((const char *)data, (floatData.size() * len + headerLen) * sizeof(*data));
 
-		delete[] data;
+		for (size_t first = 0; first < total; first += MAX_BATCH) {
+			size_t count = std::min<size_t>(MAX_BATCH, total - first);
+			memset(msgs, 0, sizeof(struct mmsghdr) * count);
+			for (size_t k = 0; k < count; k++) {
+				size_t i = (first + k) % n;
+				const Destination &d = m_sendTo[(first + k) / n];
+				toSockaddr(d.address, d.port, names[k]);
+				msgs[k].msg_hdr.msg_name = &names[k];
+				msgs[k].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				msgs[k].msg_hdr.msg_iov = &iov[2 * i];
+				msgs[k].msg_hdr.msg_iovlen = numParts[i];
+			}
 
-		return res;
+			// sendmmsg() stops at the first datagram that fails, skip that one and continue
+			size_t sent = 0;
+			while (sent < count) {
+				int r = sendmmsg((SOCKET)soc, &msgs[sent], (unsigned int)(count - sent), 0);
+				if (r < 0 && errno == EINTR)
+					continue;
+				sent += (r > 0) ? r : 0;
+				if (sent < count) {
+					failed++;
+					sent++;
+				}
+			}
+		}
+#else
+		// no scatter-gather: two-part datagrams are joined in the scratch packet
+		struct sockaddr_in name;
+		for (size_t j = 0; j < total; j++) {
+			auto &m = m_messages[j % n];
+			const Destination &d = m_sendTo[j / n];
+			toSockaddr(d.address, d.port, name);
+			const char *data = (const char *)m.part[0];
+			size_t bytes = m.bytes[0] + m.bytes[1];
+			if (m.bytes[1]) {
+				memcpy(m_scratch.data(), m.part[0], m.bytes[0]);
+				memcpy(m_scratch.data() + m.bytes[0], m.part[1], m.bytes[1]);
+				data = (const char *)m_scratch.data();
+			}
+			int r = sendto((SOCKET)soc, data, (int)bytes, 0, (struct sockaddr*)&name, sizeof(struct sockaddr_in));
+			if (r != (int)bytes)
+				failed++;
+		}
+#endif
+
+		m_numFailed += failed;
+		m_messages.clear();
+		m_poolUsed = 0;
+		return failed == 0;
+	}
+
+	bool UdpSocket::Send(const char *data, int length) {
+		uint64_t failed = m_numFailed;
+		uint8_t *p = allocPacket(length);
+		memcpy(p, data, length);
+		return queueMessage(p, length, nullptr, 0) && m_numFailed == failed;
+	}
+
+	bool UdpSocket::Send(const void *header, size_t headerBytes, const void *payload, size_t payloadBytes) {
+		if (headerBytes + payloadBytes > MAX_DATAGRAM)
+			throw std::invalid_argument("UDP datagram too large (" + std::to_string(headerBytes + payloadBytes) + " bytes)");
+		return queueMessage(header, headerBytes, payload, payloadBytes);
+	}
+
+
+	bool UdpSocket::Send(const SignalBufferObserver& observer) {
+		auto floatData = observer.getTimeStageAll();
+		if (floatData.empty())
+			return true;
+		return sendFrames(floatData.data(), (uint32_t)floatData.size(), observer.getLength(), observer.windowBegin, wire::PayloadType::Int16);
 	}
 
 	/*
@@ -125,13 +314,13 @@ namespace autil {
 	{
 		if (blockIndex == 0) {
 			
-			LOG(logINFO) << "Sending " << samples.size() << "ch of " << blockSize << " samples " << receiverAddress << ":" << port;
+			LOG(logINFO) << "Sending " << samples.size() << "ch of " << blockSize << " samples to " << describeDestinations();
 		}
 		// header: [index|#channels|blockLength|1|ch0_norm|ch1_norm...|chN_norm]
 		int headerLen = 4 * sizeof(int8_t) + sizeof(int8_t)*samples.size();
 
 		uint32_t dataBytes = headerLen + (blockSize * samples.size() * sizeof(int8_t));
-		int8_t *data = new int8_t[dataBytes / sizeof(int8_t)];
+		int8_t *data = (int8_t *)allocPacket(dataBytes);
 
 		int bl = blockSize, logBl = 0;
 		while (bl >>= 1) { ++logBl; }
@@ -145,7 +334,7 @@ namespace autil {
 			float cmax = absmax(samples[ci], blockSize);
 			if (cmax > 1.0f || cmax < -1.0f) {
 				LOG(logERROR) << "failed to send debug data: sample value out of [-1,1]";
-				delete[] data;
+				m_poolUsed -= dataBytes; // the last allocation
 				return false;
 			}
 			data[4 + ci] = (int8_t)(cmax * 0xff);
@@ -157,15 +346,138 @@ namespace autil {
 			}
 		}
 
-		bool res = Send((const char *)data, dataBytes);
+		bool res = queueMessage(data, dataBytes, nullptr, 0);
 
 		if (!res) {
 			LOG(logERROR) << "failed to send debug data!";
 		}
 
-		delete[] data;
+		return res;
+	}
+
+	void UdpSocket::setMaxPacketBytes(size_t bytes) {
+		if (bytes <= wire::HEADER_BYTES + 16 || bytes > MAX_DATAGRAM)
+			throw std::invalid_argument("invalid max UDP packet size " + std::to_string(bytes));
+		m_maxPacketBytes = bytes;
+	}
+
+	bool UdpSocket::sendFrames(const float *const *channels, uint32_t numChannels, uint32_t frames, uint64_t frame, wire::PayloadType type,
+		const wire::Timestamp &timestamp, uint32_t decimation)
+	{
+		if (type == wire::PayloadType::Legacy)
+			throw std::invalid_argument("legacy blocks have no wire header, use sendBlock()");
+		if (numChannels == 0 || numChannels > 0xffff)
+			throw std::invalid_argument("invalid channel count " + std::to_string(numChannels));
+
+		if (m_sequence == 0) {
+			LOG(logINFO) << "Sending " << numChannels << "ch " << wire::payloadName(type) << " packets to " << describeDestinations();
+		}
+
+		// fragment size from the fixed-size bound (RiceDelta falls back to Float32 at worst)
+		size_t budget = m_maxPacketBytes - wire::HEADER_BYTES;
+		size_t perChannel = wire::maxPayloadBytes(type, 1, 0);
+		size_t perFrame = wire::maxPayloadBytes(type, 1, 1) - perChannel;
+		uint32_t groupChannels = numChannels, sliceFrames = frames;
+		if (wire::maxPayloadBytes(type, numChannels, frames) > budget) {
+			// all channels in each fragment as long as slices stay long enough, then fewer channels
+			for (;;) {
+				size_t perGroupChannel = budget / groupChannels;
+				sliceFrames = perGroupChannel > perChannel ? (uint32_t)((perGroupChannel - perChannel) / perFrame) : 0;
+				if (sliceFrames >= std::min(frames, MIN_SLICE_FRAMES) || groupChannels == 1)
+					break;
+				groupChannels = (groupChannels + 1) / 2;
+			}
+			sliceFrames = std::min(frames, sliceFrames);
+			if (sliceFrames == 0)
+				throw std::invalid_argument("UDP packet size " + std::to_string(m_maxPacketBytes) + " too small for a " + wire::payloadName(type) + " sample");
+		}
 
+		uint32_t numGroups = (numChannels + groupChannels - 1) / groupChannels;
+		uint32_t numSlices = std::max<uint32_t>(1, (frames + sliceFrames - 1) / std::max<uint32_t>(1, sliceFrames));
+		if ((uint64_t)numGroups * numSlices > 0xffff)
+			throw std::invalid_argument("block of " + std::to_string(numChannels) + "ch x " + std::to_string(frames) + " needs too many packets");
+
+		wire::Header h;
+		h.sequence = m_sequence++;
+		h.frame = frame;
+		h.timestamp = timestamp;
+		h.decimation = decimation > 0 ? decimation : 1;
+		h.blockFrames = frames;
+		h.totalChannels = (uint16_t)numChannels;
+		h.numFragments = (uint16_t)(numGroups * numSlices);
+		h.fragment = 0;
+		m_fragment.resize(groupChannels);
+
+		bool res = true;
+		for (uint32_t g = 0; g < numGroups; g++) {
+			uint32_t c0 = g * groupChannels, nc = std::min(groupChannels, numChannels - c0);
+			for (uint32_t s = 0; s < numSlices; s++) {
+				uint32_t offset = s * sliceFrames, nf = std::min(sliceFrames, frames - offset);
+				for (uint32_t c = 0; c < nc; c++)
+					m_fragment[c] = channels[c0 + c] + offset;
+
+				size_t maxBytes = wire::HEADER_BYTES + wire::maxPayloadBytes(type, nc, nf);
+				uint8_t *data = allocPacket(maxBytes);
+
+				h.payload = type;
+				h.payloadBytes = (uint32_t)wire::encode(h.payload, m_fragment.data(), nc, nf, data + wire::HEADER_BYTES);
+				h.channels = (uint16_t)nc;
+				h.frames = nf;
+				h.offset = offset;
+				h.firstChannel = (uint16_t)c0;
+				wire::writeHeader(h, data);
+				h.fragment++;
+
+				// give back what the encoder did not use (the last allocation)
+				size_t bytes = wire::HEADER_BYTES + h.payloadBytes;
+				m_poolUsed -= maxBytes - bytes;
+				res = queueMessage(data, bytes, nullptr, 0) && res;
+			}
+		}
 		return res;
 	}
 
+#if !WIN32
+	int openUdpReceiveSocket(const std::string &bindAddress, int port, int receiveBufferBytes)
+	{
+		int soc = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (soc < 0)
+			throw std::runtime_error("Failed to create UDP socket: " + std::string(strerror(errno)));
+
+		// the kernel keeps the bursts the receiver thread has not read yet
+		if (receiveBufferBytes > 0)
+			setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &receiveBufferBytes, sizeof(receiveBufferBytes));
+
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		if (inet_pton(AF_INET, bindAddress.c_str(), &sa.sin_addr) <= 0) {
+			close(soc);
+			throw std::invalid_argument("Invalid address " + bindAddress);
+		}
+		// a multicast group: bound to the group (only its packets), other receivers on this host may bind it too
+		bool multicast = IN_MULTICAST(ntohl(sa.sin_addr.s_addr));
+		if (multicast) {
+			int on = 1;
+			setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		}
+		if (bind(soc, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			std::string err = strerror(errno);
+			close(soc);
+			throw std::runtime_error("Failed to bind UDP port " + bindAddress + ":" + std::to_string(port) + ": " + err);
+		}
+		if (multicast) {
+			struct ip_mreq mreq;
+			mreq.imr_multiaddr = sa.sin_addr;
+			mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+			if (setsockopt(soc, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+				std::string err = strerror(errno);
+				close(soc);
+				throw std::runtime_error("Failed to join multicast group " + bindAddress + ": " + err);
+			}
+		}
+		return soc;
+	}
+#endif
 }
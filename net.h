@@ -1,33 +1,126 @@
 #pragma once
 
+#include <stdint.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "wire_format.h"
+
 class SignalBufferObserver;
 class SignalBuffer;
 
 namespace autil {
-	
+
 //struct sockaddr_in;
 
 
 
+/*
+ * Datagrams are built in a preallocated packet pool (no allocation per packet) and can be
+ * batched: between beginBatch() and endBatch() they are queued and sent with one sendmmsg()
+ * (Linux, one sendto() per datagram elsewhere), the batch is flushed early when the pool is full.
+ *
+ * Every datagram goes to all destinations (unicast subscribers or multicast groups), which can be
+ * added and removed from any thread while sending. Packets are built once, the copies are only
+ * extra entries of the sendmmsg() batch pointing to the same pool memory.
+ */
 class UdpSocket {
 private:
     int soc;
-	struct sockaddr_in *sa;
 	short blockIndex_;
 
+	// IPv4 address and port, network byte order
+	struct Destination {
+		uint32_t address;
+		uint16_t port;
+		inline bool operator==(const Destination &o) const { return address == o.address && port == o.port; }
+	};
+
+	std::mutex m_mtxDestinations;
+	std::vector<Destination> m_destinations;
+	std::vector<Destination> m_sendTo; // flush(): snapshot of m_destinations
+
 	std::string receiverAddress;
 	int port;
+
+	// queued datagram: up to two parts (header, payload), sent as an iovec without copying
+	struct Message {
+		const void *part[2];
+		size_t bytes[2];
+	};
+
+	std::vector<uint8_t> m_pool;
+	size_t m_poolUsed;
+	std::vector<Message> m_messages;
+	std::vector<uint8_t> m_scratch; // joined datagram where sendmmsg() is not available
+	int m_batchDepth;
+	uint64_t m_numFailed;
+	uint64_t m_numBytes;
+	uint64_t m_sequence; // wire format blocks sent
+	size_t m_maxPacketBytes;
+	std::vector<const float *> m_fragment; // channel pointers of the fragment being encoded
+
+	uint8_t *allocPacket(size_t bytes);
+	bool queueMessage(const void *header, size_t headerBytes, const void *payload, size_t payloadBytes);
+	bool flush();
+	static bool destination(const std::string &address, int port, Destination &d);
+	std::string describeDestinations();
 public:
-	UdpSocket(std::string receiverAddress, int port);
+	static const int MAX_BATCH = 64; // datagrams per sendmmsg()
+	static const size_t POOL_BYTES = 256 * 1024;
+	static const size_t MAX_DATAGRAM = 65507;
+	static const size_t DEFAULT_MAX_PACKET = 1472; // 1500 byte Ethernet MTU - IPv4 - UDP headers
+	static const uint32_t MIN_SLICE_FRAMES = 64; // fragments split channels before frames get shorter
+
+	// receiverAddress may be empty: no destination until addDestination()
+	UdpSocket(std::string receiverAddress, int port, int sendBufferBytes = 16 * 1024);
 	~UdpSocket();
+
+	// false if the destination is already (not) there
+	bool addDestination(const std::string &address, int port);
+	bool removeDestination(const std::string &address, int port);
+	size_t getNumDestinations();
+	// outgoing multicast: hop limit (kernel default 1: the local network) and interface address
+	void setMulticastTtl(int ttl);
+	void setMulticastInterface(const std::string &address);
+
+	// kernel send buffer (SO_SNDBUF), returns the size granted by the kernel
+	int setSendBufferSize(int bytes);
+
+	// queue datagrams until the outermost endBatch(), which sends them and returns false if any failed
+	void beginBatch();
+	bool endBatch();
+
+	// datagram copies not sent (socket errors, partial sends)
+	inline uint64_t getNumFailed() const { return m_numFailed; }
+	// datagram bytes sent, every destination's copy counted
+	inline uint64_t getNumBytes() const { return m_numBytes; }
+
+	// datagram size sendFrames() splits blocks to, set to path MTU - IP/UDP headers to avoid IP fragmentation
+	void setMaxPacketBytes(size_t bytes);
+	inline size_t getMaxPacketBytes() const { return m_maxPacketBytes; }
+
 	bool Send(const char *data, int length);
+	// header and payload are sent as one datagram without copying, both must stay valid until sent (endBatch())
+	bool Send(const void *header, size_t headerBytes, const void *payload, size_t payloadBytes);
+	// the observer's staged window (after waitForCommit()), all channels and frames as Int16 wire packets
+	// split into fragments, frame: the window begin. Streaming every window: ObserverPublisher
 	bool Send(const SignalBufferObserver& observer);
 	//bool Send(const std::vector<float>& samples);
 	bool Send(const std::vector<const std::vector<float>*> &samples);
 
 	bool sendBlock(const std::vector<const float*> &samples, size_t blockSize, int16_t blockIndex);
+	// a block of planar channels starting at frame as versioned packets (see wire_format.h), encoded into the
+	// pool and split into fragments of at most getMaxPacketBytes(), timestamp: time of the first frame (ClockSync),
+	// decimation: source frames per frame of a reduced rate block
+	bool sendFrames(const float *const *channels, uint32_t numChannels, uint32_t frames, uint64_t frame, wire::PayloadType type,
+		const wire::Timestamp &timestamp = wire::Timestamp(), uint32_t decimation = 1);
 };
+
+#if !WIN32
+// receiving UDP socket bound to bindAddress:port (port 0: any), a multicast bindAddress joins the group and
+// may be bound by other receivers on the host too. receiveBufferBytes 0: kernel default (SO_RCVBUF)
+int openUdpReceiveSocket(const std::string &bindAddress, int port, int receiveBufferBytes = 0);
+#endif
 }
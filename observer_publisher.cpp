@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "observer_publisher.h"
+#include "clock_sync.h"
+#include "dll_clock.h"
+#include "net.h"
+#include "signal_buffer.h"
+
+namespace autil {
+	static uint32_t channelsOf(const SignalBufferObserver &observer)
+	{
+		uint32_t channels = 0;
+		for (auto h : observer.m_hists)
+			channels += h->channels;
+		return channels;
+	}
+
+	ObserverPublisher::ObserverPublisher(SignalBufferObserver &observer, const std::string &address, int port,
+		wire::PayloadType format, uint32_t slots)
+		: m_observer(observer), m_channels(channelsOf(observer)), m_frames(observer.getLength()), m_format(format),
+		m_queue(slots, m_channels * m_frames, CommitQueue::Overflow::DropNewest),
+		m_rate(0.0), m_burst(0.0), m_degrade((int)Degrade::Decimate), m_maxDecimation(1),
+		m_sync(nullptr), m_latencyNs(0), m_tokens(0.0), m_tRefill(0), m_riceRatio(1.0), m_lastDecimation(1),
+		m_numWindows(0), m_numDegraded(0), m_numSkipped(0), m_bytesSent(0), m_running(true)
+	{
+		if (m_channels == 0 || m_frames == 0)
+			throw std::invalid_argument("ObserverPublisher: observer has no buffers");
+		if (format == wire::PayloadType::Legacy)
+			throw std::invalid_argument("ObserverPublisher: windows are sent as wire packets, not legacy blocks");
+
+		m_window.resize((size_t)m_channels * m_frames);
+		m_decimated.resize((size_t)m_channels * m_frames);
+		m_ptrs.resize(m_channels);
+		setDegrade(Degrade::Decimate);
+
+		// a window is a burst of packets
+		m_socket = new UdpSocket(address, port, 256 * 1024);
+		m_observer.setTap(&m_queue);
+		m_thread = new RttThread([this]() { run(); }, false, "observer net");
+	}
+
+	ObserverPublisher::~ObserverPublisher()
+	{
+		m_observer.setTap(nullptr);
+		m_running = false;
+		m_queue.cancel();
+		delete m_thread;
+		delete m_socket;
+	}
+
+	bool ObserverPublisher::addSubscriber(const std::string &address, int port)
+	{
+		return m_socket->addDestination(address, port);
+	}
+
+	bool ObserverPublisher::removeSubscriber(const std::string &address, int port)
+	{
+		return m_socket->removeDestination(address, port);
+	}
+
+	size_t ObserverPublisher::getNumSubscribers() const
+	{
+		return m_socket->getNumDestinations();
+	}
+
+	void ObserverPublisher::setMaxPacketBytes(size_t bytes)
+	{
+		m_socket->setMaxPacketBytes(bytes);
+	}
+
+	void ObserverPublisher::setRateLimit(double bytesPerSecond, double burstBytes)
+	{
+		if (bytesPerSecond < 0.0 || burstBytes < 0.0)
+			throw std::invalid_argument("ObserverPublisher: negative rate limit");
+		m_burst = burstBytes;
+		m_rate = bytesPerSecond;
+	}
+
+	void ObserverPublisher::setDegrade(Degrade policy, uint32_t maxDecimation)
+	{
+		uint32_t d = 1;
+		while (d * 2 <= maxDecimation && d * 2 <= m_frames)
+			d *= 2;
+		m_maxDecimation = d;
+		m_degrade = (int)policy;
+	}
+
+	void ObserverPublisher::setClockSync(const ClockSync *sync, double sampleRate, int64_t latencyNs)
+	{
+		m_clock.setNominalRate(sampleRate);
+		m_sync = sync;
+		m_latencyNs = latencyNs;
+	}
+
+	size_t ObserverPublisher::estimateBytes(wire::PayloadType type, uint32_t frames, double riceRatio) const
+	{
+		// the Float32 bound for RiceDelta, scaled by the compression of the last window
+		size_t payload = wire::maxPayloadBytes(type, m_channels, frames);
+		if (type == wire::PayloadType::RiceDelta)
+			payload = (size_t)(payload * riceRatio);
+		size_t budget = m_socket->getMaxPacketBytes() - wire::HEADER_BYTES;
+		size_t packets = std::max<size_t>(1, (payload + budget - 1) / budget);
+		return (payload + packets * wire::HEADER_BYTES) * m_socket->getNumDestinations();
+	}
+
+	void ObserverPublisher::refill(double rate, double burst)
+	{
+		if (burst <= 0.0)
+			burst = 2.0 * estimateBytes(m_format, m_frames, m_riceRatio);
+
+		int64_t t = DllClock::now();
+		if (m_tRefill == 0)
+			m_tokens = burst;
+		else
+			m_tokens = std::min(burst, m_tokens + rate * (t - m_tRefill) * 1e-9);
+		m_tRefill = t;
+	}
+
+	wire::Timestamp ObserverPublisher::stamp(uint64_t frame) const
+	{
+		// no timestamp until the frame clock settled, nor without ClockSync (POSIX only)
+		wire::Timestamp ts;
+#if !WIN32
+		if (m_clock.isLocked()) {
+			int64_t t = (int64_t)(m_clock.frameToTime((double)frame) * 1e9) - m_latencyNs;
+			const ClockSync *sync = m_sync;
+			if (sync) {
+				ts = sync->stamp(t);
+			}
+			else {
+				ts.time = t;
+				ts.clock = ClockSync::localClockId();
+			}
+		}
+#endif
+		return ts;
+	}
+
+	void ObserverPublisher::publish(uint64_t windowBegin)
+	{
+		wire::PayloadType type = m_format;
+		uint32_t decimation = 1;
+
+		double rate = m_rate;
+		if (rate > 0.0) {
+			refill(rate, m_burst);
+
+			// cheapest degradation that fits the tokens
+			Degrade policy = (Degrade)m_degrade.load();
+			uint32_t maxDecimation = policy == Degrade::Drop ? 1 : m_maxDecimation.load();
+			while ((double)estimateBytes(type, (m_frames + decimation - 1) / decimation, m_riceRatio) > m_tokens) {
+				if (decimation < maxDecimation) {
+					decimation *= 2;
+				}
+				else if (policy == Degrade::Preview && type != wire::PayloadType::Int8) {
+					type = wire::PayloadType::Int8;
+				}
+				else {
+					m_numSkipped++;
+					return;
+				}
+			}
+		}
+		else {
+			m_tRefill = 0;
+		}
+
+		uint32_t frames = m_frames;
+		if (decimation > 1) {
+			// mean of each group of decimation frames, the last group may be shorter
+			frames = (m_frames + decimation - 1) / decimation;
+			for (uint32_t c = 0; c < m_channels; c++) {
+				const float *src = &m_window[(size_t)c * m_frames];
+				float *dst = &m_decimated[(size_t)c * frames];
+				for (uint32_t i = 0; i < frames; i++) {
+					uint32_t first = i * decimation, last = std::min(m_frames, first + decimation);
+					float sum = 0.0f;
+					for (uint32_t k = first; k < last; k++)
+						sum += src[k];
+					dst[i] = sum / (float)(last - first);
+				}
+				m_ptrs[c] = dst;
+			}
+		}
+		else {
+			for (uint32_t c = 0; c < m_channels; c++)
+				m_ptrs[c] = &m_window[(size_t)c * m_frames];
+		}
+
+		uint64_t bytes = m_socket->getNumBytes();
+		m_socket->beginBatch();
+		m_socket->sendFrames(m_ptrs.data(), m_channels, frames, windowBegin, type, stamp(windowBegin), decimation);
+		m_socket->endBatch();
+		bytes = m_socket->getNumBytes() - bytes;
+
+		if (type == wire::PayloadType::RiceDelta) {
+			size_t bound = estimateBytes(type, frames, 1.0);
+			if (bound > 0)
+				m_riceRatio = std::max(0.05, std::min(1.0, (double)bytes / bound));
+		}
+		if (rate > 0.0)
+			m_tokens -= (double)bytes;
+
+		m_bytesSent += bytes;
+		m_lastDecimation = decimation;
+		if (decimation > 1 || type != m_format)
+			m_numDegraded++;
+		m_numWindows++;
+	}
+
+	void ObserverPublisher::run()
+	{
+		uint64_t windowBegin, windowEnd;
+		while (m_running) {
+			if (!m_queue.read(m_window.data(), &windowBegin, &windowEnd, 100))
+				continue;
+			m_clock.update(windowEnd, DllClock::now());
+
+			// nobody listening: skip the encoding
+			if (m_socket->getNumDestinations() == 0)
+				continue;
+
+			publish(windowBegin);
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <rtt/rtt.h>
+
+#include "commit_queue.h"
+#include "dll_clock.h"
+#include "wire_format.h"
+
+class SignalBufferObserver;
+
+namespace autil {
+	class UdpSocket;
+	class ClockSync;
+
+	/*
+	 * Streams every committed window of a SignalBufferObserver in full (all channels, all frames) as
+	 * versioned packets (wire_format.h, split into MTU sized fragments, frame: the window begin) to any
+	 * number of subscribers. On commit the observer copies the window into a slot of a tap queue
+	 * (SignalBufferObserver::setTap(), the window is dropped if the publisher fell behind), the publisher
+	 * thread encodes and sends it from there: neither the next commit nor the observer's consumer wait
+	 * for the network.
+	 *
+	 * A token bucket limits the bandwidth (bytes of all datagram copies, tokens accrue at the rate up to
+	 * the burst). A window whose estimated size exceeds the tokens is degraded by the policy: Drop skips
+	 * it, Decimate sends it at 1/2, 1/4, .. of the rate (mean of each group of frames, up to
+	 * getMaxDecimation(), wire::Header::decimation), Preview then also falls back to Int8 samples. Windows
+	 * that do not fit even so are skipped until the bucket refilled.
+	 *
+	 * Windows carry the time of their first frame like DebugStream blocks: a DllClock follows the window
+	 * ends per CLOCK_MONOTONIC as the publisher thread picks them up, mapped to the timebase of a
+	 * ClockSync if set, else stamped on the local timebase.
+	 */
+	class ObserverPublisher {
+	public:
+		enum class Degrade : int {
+			Drop, // skip windows that exceed the tokens
+			Decimate, // reduce the rate until the window fits
+			Preview, // reduce the rate, then the resolution (Int8)
+		};
+
+		// attaches to the observer (setTap()): create and destroy while it is not added to a running driver.
+		// address may be empty: no subscriber until addSubscriber()
+		ObserverPublisher(SignalBufferObserver &observer, const std::string &address, int port,
+			wire::PayloadType format = wire::PayloadType::Int16, uint32_t slots = 4);
+		~ObserverPublisher();
+
+		// any thread, false if the subscriber is already (not) there
+		bool addSubscriber(const std::string &address, int port);
+		bool removeSubscriber(const std::string &address, int port);
+		size_t getNumSubscribers() const;
+
+		// before the first window, see UdpSocket::setMaxPacketBytes()
+		void setMaxPacketBytes(size_t bytes);
+
+		// bytesPerSecond 0: unlimited. burstBytes 0: two full windows
+		void setRateLimit(double bytesPerSecond, double burstBytes = 0.0);
+		// maxDecimation is rounded down to a power of two
+		void setDegrade(Degrade policy, uint32_t maxDecimation = 16);
+
+		// timestamps on the sync's timebase (nullptr: local), see DebugStream::setClockSync()
+		void setClockSync(const ClockSync *sync, double sampleRate, int64_t latencyNs = 0);
+		inline const DllClock &getFrameClock() const { return m_clock; }
+
+		inline wire::PayloadType getFormat() const { return m_format; }
+		inline uint32_t getWindowFrames() const { return m_frames; }
+		inline uint32_t getMaxDecimation() const { return m_maxDecimation; }
+		// decimation of the last window sent, 1: full rate
+		inline uint32_t getDecimation() const { return m_lastDecimation; }
+
+		inline uint64_t getNumWindows() const { return m_numWindows; } // sent, degraded ones included
+		inline uint64_t getNumDegraded() const { return m_numDegraded; }
+		inline uint64_t getNumSkipped() const { return m_numSkipped; } // over the rate limit
+		inline uint64_t getNumOverruns() const { return m_queue.getNumLost(); } // publisher behind the commits
+		inline uint64_t getBytesSent() const { return m_bytesSent; }
+
+	private:
+		SignalBufferObserver &m_observer;
+		uint32_t m_channels, m_frames;
+		wire::PayloadType m_format;
+		CommitQueue m_queue;
+		UdpSocket *m_socket;
+
+		std::atomic<double> m_rate, m_burst;
+		std::atomic<int> m_degrade;
+		std::atomic<uint32_t> m_maxDecimation;
+		std::atomic<const ClockSync *> m_sync;
+		std::atomic<int64_t> m_latencyNs;
+
+		// publisher thread
+		double m_tokens;
+		int64_t m_tRefill; // CLOCK_MONOTONIC ns, 0: bucket not started
+		double m_riceRatio; // RiceDelta bytes of the last window per Float32 bound
+		DllClock m_clock; // window ends -> CLOCK_MONOTONIC
+		std::vector<float> m_window, m_decimated;
+		std::vector<const float *> m_ptrs;
+
+		volatile uint32_t m_lastDecimation;
+		volatile uint64_t m_numWindows, m_numDegraded, m_numSkipped, m_bytesSent;
+
+		volatile bool m_running;
+		RttThread *m_thread;
+
+		size_t estimateBytes(wire::PayloadType type, uint32_t frames, double riceRatio) const;
+		void refill(double rate, double burst);
+		wire::Timestamp stamp(uint64_t frame) const;
+		void publish(uint64_t windowBegin);
+		void run();
+	};
+}
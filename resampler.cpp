@@ -0,0 +1,122 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+namespace autil {
+
+	ResamplingFifo::ResamplingFifo(uint32_t channels, uint32_t capacity)
+		: m_channels(channels), m_capacity(capacity)
+	{
+		m_ring.assign(channels, std::vector<float>(capacity, 0.0f));
+		clear();
+	}
+
+	void ResamplingFifo::clear()
+	{
+		m_writeIndex = m_readIndex = m_fill = 0;
+		m_frac = 0.0;
+		m_integral = 0.0;
+		resetControl();
+	}
+
+	void ResamplingFifo::resetControl()
+	{
+		m_controlStarted = false;
+		m_fillAverage = 0.0;
+	}
+
+	uint32_t ResamplingFifo::write(const float * const *in, uint32_t n)
+	{
+		n = (std::min)(n, m_capacity - m_fill);
+		uint32_t untilEnd = m_capacity - m_writeIndex;
+		uint32_t n1 = (std::min)(n, untilEnd);
+
+		for (uint32_t c = 0; c < m_channels; c++) {
+			memcpy(&m_ring[c][m_writeIndex], in[c], n1 * sizeof(float));
+			memcpy(&m_ring[c][0], in[c] + n1, (n - n1) * sizeof(float));
+		}
+
+		m_writeIndex = (m_writeIndex + n) % m_capacity;
+		m_fill += n;
+		return n;
+	}
+
+	uint32_t ResamplingFifo::write(const uint8_t *in, uint32_t frameBytes, uint32_t sampleBytes, uint32_t n,
+		void(*converter)(float *out, const uint8_t *in, size_t inStride, size_t n))
+	{
+		n = (std::min)(n, m_capacity - m_fill);
+		uint32_t untilEnd = m_capacity - m_writeIndex;
+		uint32_t n1 = (std::min)(n, untilEnd);
+
+		for (uint32_t c = 0; c < m_channels; c++) {
+			converter(&m_ring[c][m_writeIndex], in + c * sampleBytes, frameBytes, n1);
+			if (n > n1)
+				converter(&m_ring[c][0], in + n1 * frameBytes + c * sampleBytes, frameBytes, n - n1);
+		}
+
+		m_writeIndex = (m_writeIndex + n) % m_capacity;
+		m_fill += n;
+		return n;
+	}
+
+	uint32_t ResamplingFifo::read(float * const *out, uint32_t n, double ratio)
+	{
+		uint32_t i;
+		for (i = 0; i < n; i++) {
+			// x[-1] .. x[2] around the read position
+			if (m_fill < 4)
+				break;
+
+			float t = (float)m_frac;
+			for (uint32_t c = 0; c < m_channels; c++) {
+				float xm1 = at(c, 0), x0 = at(c, 1), x1 = at(c, 2), x2 = at(c, 3);
+				float a = (3.0f * (x0 - x1) - xm1 + x2) * 0.5f;
+				float b = 2.0f * x1 + xm1 - (5.0f * x0 + x2) * 0.5f;
+				float cc = (x1 - xm1) * 0.5f;
+				out[c][i] = ((a * t + b) * t + cc) * t + x0;
+			}
+
+			m_frac += ratio;
+			uint32_t advance = (uint32_t)m_frac;
+			m_frac -= advance;
+			advance = (std::min)(advance, m_fill);
+			m_readIndex = (m_readIndex + advance) % m_capacity;
+			m_fill -= advance;
+		}
+
+		for (uint32_t c = 0; c < m_channels; c++)
+			memset(out[c] + i, 0, (n - i) * sizeof(float));
+
+		return i;
+	}
+
+	double ResamplingFifo::controlRatio(double clockRatio, uint32_t target, uint32_t n)
+	{
+		double t = (double)(std::max)(target, 1u);
+		if (!m_controlStarted) {
+			m_controlStarted = true;
+			m_fillAverage = (double)m_fill;
+		}
+		m_fillAverage += ((double)m_fill - m_fillAverage) * (std::min)(1.0, (double)n / (SMOOTH_TARGETS * t));
+
+		// fill error e (frames) changes by -correction per output frame: proportional e / Tp, integral of e / Ti^2,
+		// Ti = 2 Tp for critical damping
+		const double tp = (double)CONTROL_FRAMES, ti = 2.0 * tp;
+		const double maxCorrection = MAX_CORRECTION_PPM * 1e-6;
+		// sampled at the reads the fill beats by up to the shorter of the write and read blocks, a slow wander that no
+		// smoothing removes: no correction within the shorter of a read and a quarter of the target
+		double deadband = (std::min)((double)n, t / 4.0);
+		double error = m_fillAverage - t;
+		error = error > deadband ? error - deadband : (error < -deadband ? error + deadband : 0.0);
+
+		// integrate only while the correction is not at its bound (anti-windup)
+		double correction = error / tp + (m_integral + error * (double)n) / (ti * ti);
+		if (std::fabs(correction) < maxCorrection)
+			m_integral += error * (double)n;
+		else
+			correction = correction > 0.0 ? maxCorrection : -maxCorrection;
+		return clockRatio * (1.0 + correction);
+	}
+}
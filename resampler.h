@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace autil {
+	/*
+	 * Planar FIFO with an adaptive-ratio resampling read side, used to move audio between
+	 * clock domains (aggregate devices, network streams). 4-point cubic Hermite interpolation,
+	 * the ratio (input frames consumed per output frame) may change on every read.
+	 * Single-threaded: write and read from the same (audio) thread.
+	 */
+	class ResamplingFifo {
+	public:
+		ResamplingFifo(uint32_t channels, uint32_t capacity);
+
+		inline uint32_t getChannels() const { return m_channels; }
+		inline uint32_t getCapacity() const { return m_capacity; }
+		// frames buffered and not yet consumed
+		inline uint32_t available() const { return m_fill; }
+
+		// returns the number of frames written, less than n if the FIFO is full
+		uint32_t write(const float * const *in, uint32_t n);
+		// same, from interleaved or otherwise strided data through a sample converter
+		uint32_t write(const uint8_t *in, uint32_t frameBytes, uint32_t sampleBytes, uint32_t n,
+			void(*converter)(float *out, const uint8_t *in, size_t inStride, size_t n));
+
+		// produce n frames, returns how many were produced before running dry (rest is zero-filled)
+		uint32_t read(float * const *out, uint32_t n, double ratio);
+
+		// ratio for read() of n frames that keeps the fill level at target, given the estimated clock ratio.
+		// The fill is low-passed over SMOOTH_TARGETS * target frames (it swings by a writer period between
+		// reads), a critically damped PI loop removes the error over about CONTROL_FRAMES of output (the clock
+		// ratio already tracks the drift, the loop only corrects the estimate's error), the correction stays
+		// within MAX_CORRECTION_PPM of the clock ratio
+		double controlRatio(double clockRatio, uint32_t target, uint32_t n);
+		// restart the fill average from the current fill (after priming), the integral keeps the learned correction
+		void resetControl();
+
+		void clear();
+
+		static const int SMOOTH_TARGETS = 32;
+		static const uint32_t CONTROL_FRAMES = 1 << 20; // ~22 s at 48 kHz
+		static const int MAX_CORRECTION_PPM = 300;
+
+	private:
+		uint32_t m_channels, m_capacity;
+		std::vector<std::vector<float>> m_ring;
+		uint32_t m_writeIndex, m_readIndex, m_fill;
+		double m_frac;
+
+		// controlRatio()
+		bool m_controlStarted;
+		double m_fillAverage, m_integral;
+
+		inline float at(uint32_t c, uint32_t k) const { return m_ring[c][(m_readIndex + k) % m_capacity]; }
+	};
+}
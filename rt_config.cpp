@@ -0,0 +1,239 @@
+#include "rt_config.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef __unix__
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <alloca.h>
+#include <malloc.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+namespace autil {
+
+	static std::string errorString(int err) {
+		return std::string(strerror(err));
+	}
+
+	static void unsupported(const char *name, RtReport &report)
+	{
+		report.items.push_back({ name, false, "not supported on this system" });
+	}
+
+	static size_t pageSize()
+	{
+#ifdef __unix__
+		return (size_t)sysconf(_SC_PAGESIZE);
+#else
+		return 4096;
+#endif
+	}
+
+#ifdef __unix__
+	static void applyScheduler(const RtConfig &config, RtReport &report)
+	{
+		struct sched_param param;
+		int prio = config.priority < 0 ? sched_get_priority_max(config.policy) : config.priority;
+		param.sched_priority = prio;
+
+		int err = pthread_setschedparam(pthread_self(), config.policy, &param);
+		if (err) {
+			report.items.push_back({ "scheduler", false, "pthread_setschedparam failed: " + errorString(err) });
+			return;
+		}
+
+		int policy;
+		if ((err = pthread_getschedparam(pthread_self(), &policy, &param))) {
+			report.items.push_back({ "scheduler", false, "pthread_getschedparam failed: " + errorString(err) });
+			return;
+		}
+
+		bool ok = (policy == config.policy && param.sched_priority == prio);
+		report.items.push_back({ "scheduler", ok, "policy " + std::to_string(policy) + " priority " + std::to_string(param.sched_priority) });
+	}
+
+	static void applyMemoryLock(RtReport &report)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+			report.items.push_back({ "mlockall", false, errorString(errno) });
+			return;
+		}
+		report.items.push_back({ "mlockall", true, "current and future pages locked" });
+	}
+#else
+	static void applyScheduler(const RtConfig &, RtReport &report)
+	{
+		unsupported("scheduler", report);
+	}
+
+	static void applyMemoryLock(RtReport &report)
+	{
+		unsupported("mlockall", report);
+	}
+#endif
+
+#ifdef __linux__
+	static void applyAffinity(const RtConfig &config, RtReport &report)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : config.cpus)
+			CPU_SET(cpu, &set);
+
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			report.items.push_back({ "affinity", false, "pthread_setaffinity_np failed: " + errorString(err) });
+			return;
+		}
+
+		cpu_set_t actual;
+		CPU_ZERO(&actual);
+		if ((err = pthread_getaffinity_np(pthread_self(), sizeof(actual), &actual))) {
+			report.items.push_back({ "affinity", false, "pthread_getaffinity_np failed: " + errorString(err) });
+			return;
+		}
+
+		std::string cpus;
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &actual))
+				cpus += (cpus.empty() ? "" : ",") + std::to_string(i);
+		}
+		report.items.push_back({ "affinity", CPU_EQUAL(&set, &actual) != 0, "cpus " + cpus });
+	}
+
+	static void prefaultStack(size_t bytes, RtReport &report)
+	{
+		// never beyond the thread's stack: keep a margin below the current frame for the calls that follow
+		static const size_t MARGIN = 64 * 1024;
+		size_t requested = bytes;
+		pthread_attr_t attr;
+		void *base;
+		size_t size;
+		if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+			if (pthread_attr_getstack(&attr, &base, &size) == 0) {
+				size_t left = (size_t)((char *)&attr - (char *)base);
+				bytes = std::min(bytes, left > MARGIN ? left - MARGIN : 0);
+			}
+			pthread_attr_destroy(&attr);
+		}
+
+		volatile char *stack = (volatile char *)alloca(bytes);
+		size_t page = pageSize();
+		for (size_t i = 0; i < bytes; i += page)
+			stack[i] = 0;
+		if (bytes < requested)
+			report.items.push_back({ "prefaultStack", false, std::to_string(bytes) + " of " + std::to_string(requested) + " bytes, stack too small" });
+		else
+			report.items.push_back({ "prefaultStack", true, std::to_string(bytes) + " bytes" });
+	}
+
+	static void prefaultHeap(size_t bytes, RtReport &report)
+	{
+		// keep freed memory in the arena instead of returning it to the OS, and serve
+		// large allocations from the arena too, so touched pages stay resident
+		bool ok = mallopt(M_TRIM_THRESHOLD, -1) && mallopt(M_MMAP_MAX, 0);
+
+		void *p = malloc(bytes);
+		if (!p) {
+			report.items.push_back({ "prefaultHeap", false, "malloc failed" });
+			return;
+		}
+		prefault(p, bytes);
+		free(p);
+
+		report.items.push_back({ "prefaultHeap", ok, std::to_string(bytes) + " bytes" + (ok ? "" : ", mallopt failed") });
+	}
+#else
+	static void applyAffinity(const RtConfig &, RtReport &report)
+	{
+		unsupported("affinity", report);
+	}
+
+	static void prefaultStack(size_t, RtReport &report)
+	{
+		// without the stack bounds alloca() could run past the end of the stack
+		unsupported("prefaultStack", report);
+	}
+
+	static void prefaultHeap(size_t, RtReport &report)
+	{
+		// the pages would go back to the system on free(), there is no mallopt() to keep them
+		unsupported("prefaultHeap", report);
+	}
+#endif
+
+	static void applyFlushDenormals(RtReport &report)
+	{
+#if defined(__SSE__) || defined(_M_X64)
+		const unsigned int ftzDaz = 0x8040; // FTZ (bit 15) | DAZ (bit 6)
+		_mm_setcsr(_mm_getcsr() | ftzDaz);
+		bool ok = (_mm_getcsr() & ftzDaz) == ftzDaz;
+		report.items.push_back({ "flushDenormals", ok, "MXCSR FTZ|DAZ" });
+#elif defined(__aarch64__)
+		uint64_t fpcr;
+		__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+		fpcr |= (1 << 24); // FZ
+		__asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+		__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+		report.items.push_back({ "flushDenormals", (fpcr & (1 << 24)) != 0, "FPCR FZ" });
+#else
+		report.items.push_back({ "flushDenormals", false, "not supported on this architecture" });
+#endif
+	}
+
+	RtReport applyRtConfig(const RtConfig &config)
+	{
+		RtReport report;
+
+		if (config.policy >= 0)
+			applyScheduler(config, report);
+		if (!config.cpus.empty())
+			applyAffinity(config, report);
+		if (config.lockMemory)
+			applyMemoryLock(report);
+		if (config.prefaultStack)
+			prefaultStack(config.prefaultStack, report);
+		if (config.prefaultHeap)
+			prefaultHeap(config.prefaultHeap, report);
+		if (config.flushDenormals)
+			applyFlushDenormals(report);
+
+		return report;
+	}
+
+	void prefault(void *ptr, size_t bytes)
+	{
+		volatile char *p = (volatile char *)ptr;
+		size_t page = pageSize();
+		for (size_t i = 0; i < bytes; i += page)
+			p[i] = p[i];
+		if (bytes)
+			p[bytes - 1] = p[bytes - 1];
+	}
+
+	bool RtReport::ok() const
+	{
+		for (auto &item : items) {
+			if (!item.ok)
+				return false;
+		}
+		return true;
+	}
+
+	void RtReport::show() const
+	{
+		for (auto &item : items)
+			std::cout << (item.ok ? "[ok]     " : "[FAILED] ") << item.name << ": " << item.detail << std::endl;
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <sched.h>
+#endif
+
+namespace autil {
+	/*
+	 * Real-time setup of an audio thread. Applied from within the thread itself (see
+	 * AudioDriverBase::setRtConfig). Every setting is read back after applying it.
+	 * Scheduler, memory lock and stack need a POSIX system, affinity and the malloc arena Linux:
+	 * elsewhere they are reported as not supported.
+	 */
+	struct RtConfig {
+		int policy; // SCHED_FIFO, SCHED_RR, SCHED_OTHER; < 0 leaves the scheduler untouched
+		int priority; // < 0 = maximum of the policy
+		std::vector<int> cpus; // affinity, empty = don't change
+		bool lockMemory; // mlockall(MCL_CURRENT | MCL_FUTURE)
+		size_t prefaultStack; // bytes of stack to touch
+		size_t prefaultHeap; // bytes of heap to touch and keep in the malloc arena
+		bool flushDenormals; // FTZ/DAZ
+
+		RtConfig() {
+#ifdef __unix__
+			policy = SCHED_RR;
+#else
+			policy = -1;
+#endif
+			priority = -1;
+			lockMemory = false;
+			prefaultStack = 0;
+			prefaultHeap = 0;
+			flushDenormals = false;
+		}
+	};
+
+	struct RtReport {
+		struct Item {
+			std::string name;
+			bool ok;
+			std::string detail;
+		};
+
+		std::vector<Item> items;
+
+		// true if every requested setting was verified
+		bool ok() const;
+		void show() const;
+	};
+
+	RtReport applyRtConfig(const RtConfig &config);
+
+	// touch every page of a buffer so the first access in the audio callback doesn't fault
+	void prefault(void *ptr, size_t bytes);
+}
@@ -0,0 +1,291 @@
+#include "shm_ring.h"
+#include "dll_clock.h"
+#include "shm_segment.h"
+
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __unix__
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+namespace autil {
+	static const char *RING_PREFIX = "autil-ring-";
+	static const int POLL_MS = 1; // wait() slices when the reader cannot register for wake-ups
+	static const int SNAPSHOT_TRIES = 100; // read() gives up if the writer stalls inside a commit
+
+	static_assert(sizeof(ShmRing::Header) <= ShmRing::HEADER_BYTES, "ring header must fit its page");
+
+	std::string ShmRing::path(const std::string &name)
+	{
+		return ShmSegment::path(RING_PREFIX, name);
+	}
+
+	std::vector<std::string> ShmRingReader::list()
+	{
+		return ShmSegment::list(RING_PREFIX);
+	}
+
+#if defined(__linux__)
+	static void futexWake(std::atomic<uint32_t> *word)
+	{
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+	static void futexWait(const std::atomic<uint32_t> *word, uint32_t expected, int timeoutMs)
+	{
+		struct timespec ts;
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+	}
+#else
+	static void futexWake(std::atomic<uint32_t> *) {}
+
+	static void futexWait(const std::atomic<uint32_t> *, uint32_t, int timeoutMs)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+	}
+#endif
+
+	void ShmRing::commit(uint64_t frame, uint32_t position)
+	{
+		uint32_t seq = m_header->seq.load(std::memory_order_relaxed);
+		m_header->seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_header->position.store(position, std::memory_order_relaxed);
+		m_header->frame.store(frame, std::memory_order_relaxed);
+		m_header->tCommit.store(DllClock::now(), std::memory_order_relaxed);
+		// pairs with the waiter registration in ShmRingReader::wait(): either we see it or it sees the new count
+		m_header->count.fetch_add(1, std::memory_order_seq_cst);
+		m_header->seq.store(seq + 2, std::memory_order_release);
+		if (m_header->waiters.load(std::memory_order_seq_cst) > 0)
+			futexWake(&m_header->count);
+	}
+
+#ifdef __unix__
+	ShmRing::ShmRing(const std::string &name, const std::string &source, uint32_t channels, uint32_t capacity, uint32_t sampleRate,
+		Mode mode, uint32_t windowFrames)
+		: m_name(name), m_segment(nullptr), m_header(nullptr), m_samples(nullptr)
+	{
+		static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ring header needs lock-free 64-bit atomics");
+
+		uint32_t slots = 0;
+		if (mode == Mode::Windows) {
+			slots = windowFrames ? capacity / windowFrames : 0;
+			if (slots < 2)
+				throw std::invalid_argument("Shared memory ring needs at least two window slots");
+			capacity = slots * windowFrames;
+		}
+		if (channels == 0 || capacity == 0)
+			throw std::invalid_argument("Invalid shared memory ring size");
+
+		size_t bytes = HEADER_BYTES + (size_t)channels * capacity * sizeof(float);
+		m_segment = new ShmSegment(path(name), bytes, "shared memory ring");
+
+		void *mem = m_segment->getData();
+		m_header = (Header *)mem;
+		m_samples = (float *)((uint8_t *)mem + HEADER_BYTES);
+		m_header->version = VERSION;
+		m_header->headerBytes = HEADER_BYTES;
+		m_header->pid = (int32_t)getpid();
+		strncpy(m_header->name, source.c_str(), MAX_NAME - 1);
+		m_header->name[MAX_NAME - 1] = 0;
+		m_header->mode = mode;
+		m_header->format = Format::Float32Planar;
+		m_header->channels = channels;
+		m_header->capacity = capacity;
+		m_header->windowFrames = windowFrames;
+		m_header->slots = slots;
+		m_header->sampleRate = sampleRate;
+		m_header->frame.store(0, std::memory_order_relaxed);
+		m_header->pending.store(0, std::memory_order_relaxed);
+		m_header->position.store(0, std::memory_order_relaxed);
+		m_header->count.store(0, std::memory_order_relaxed);
+		m_header->seq.store(0, std::memory_order_relaxed);
+		m_header->waiters.store(0, std::memory_order_relaxed);
+		m_header->tCommit.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_header->magic = MAGIC;
+	}
+
+	ShmRing::~ShmRing()
+	{
+		delete m_segment;
+	}
+
+	ShmRingReader::ShmRingReader(const std::string &name)
+		: m_header(nullptr), m_samples(nullptr), m_bytes(0), m_canRegister(true)
+	{
+		std::string p = ShmRing::path(name);
+		// the header read-write to register as a waiter, a segment of another user read-only
+		int fd = shm_open(p.c_str(), O_RDWR, 0);
+		if (fd < 0 && errno == EACCES) {
+			m_canRegister = false;
+			fd = shm_open(p.c_str(), O_RDONLY, 0);
+		}
+		if (fd < 0)
+			throw std::runtime_error("No shared memory ring " + p);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)ShmRing::HEADER_BYTES) {
+			close(fd);
+			throw std::runtime_error("Shared memory ring " + p + " has an unknown layout");
+		}
+
+		void *header = mmap(nullptr, ShmRing::HEADER_BYTES, m_canRegister ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (header == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Cannot map shared memory ring " + p);
+		}
+		m_header = (ShmRing::Header *)header;
+
+		uint32_t version = m_header->version;
+		size_t bytes = m_header->headerBytes + (size_t)m_header->channels * m_header->capacity * sizeof(float);
+		if (m_header->magic != ShmRing::MAGIC || version != ShmRing::VERSION || m_header->headerBytes != ShmRing::HEADER_BYTES
+			|| (off_t)bytes > st.st_size) {
+			close(fd);
+			munmap(header, ShmRing::HEADER_BYTES);
+			throw std::runtime_error("Shared memory ring " + p + " has version " + std::to_string(version)
+				+ ", expected " + std::to_string(ShmRing::VERSION));
+		}
+
+		// the samples read-only, no copy
+		void *mem = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			munmap(header, ShmRing::HEADER_BYTES);
+			throw std::runtime_error("Cannot map shared memory ring " + p);
+		}
+		m_bytes = bytes;
+		m_samples = (const float *)((const uint8_t *)mem + ShmRing::HEADER_BYTES);
+		m_source = std::string(m_header->name, strnlen(m_header->name, ShmRing::MAX_NAME));
+	}
+
+	ShmRingReader::~ShmRingReader()
+	{
+		munmap((void *)((const uint8_t *)m_samples - ShmRing::HEADER_BYTES), m_bytes);
+		munmap(m_header, ShmRing::HEADER_BYTES);
+	}
+
+	bool ShmRingReader::isWriterAlive() const
+	{
+		return kill(m_header->pid, 0) == 0 || errno == EPERM;
+	}
+#else
+	ShmRing::ShmRing(const std::string &name, const std::string &source, uint32_t channels, uint32_t capacity, uint32_t sampleRate,
+		Mode mode, uint32_t windowFrames)
+		: m_name(name), m_segment(nullptr), m_header(nullptr), m_samples(nullptr)
+	{
+		throw std::runtime_error("Shared memory rings are only available on POSIX systems");
+	}
+
+	ShmRing::~ShmRing() {}
+
+	ShmRingReader::ShmRingReader(const std::string &name)
+		: m_header(nullptr), m_samples(nullptr), m_bytes(0), m_canRegister(false)
+	{
+		throw std::runtime_error("Shared memory rings are only available on POSIX systems");
+	}
+
+	ShmRingReader::~ShmRingReader() {}
+
+	bool ShmRingReader::isWriterAlive() const
+	{
+		return false;
+	}
+#endif
+
+	bool ShmRingReader::wait(uint32_t count, int timeoutMs)
+	{
+		int64_t deadline = DllClock::now() + (int64_t)timeoutMs * 1000000;
+		if (m_canRegister)
+			m_header->waiters.fetch_add(1, std::memory_order_seq_cst);
+
+		bool changed;
+		for (;;) {
+			changed = m_header->count.load(std::memory_order_seq_cst) != count;
+			int64_t left = deadline - DllClock::now();
+			if (changed || left <= 0)
+				break;
+			int ms = (int)((left + 999999) / 1000000);
+			futexWait(&m_header->count, count, m_canRegister ? ms : std::min(ms, POLL_MS));
+		}
+
+		if (m_canRegister)
+			m_header->waiters.fetch_sub(1, std::memory_order_seq_cst);
+		return changed;
+	}
+
+	bool ShmRingReader::snapshot(uint64_t &frame, uint32_t &position, uint32_t &count) const
+	{
+		for (int i = 0; i < SNAPSHOT_TRIES; i++) {
+			uint32_t seq = m_header->seq.load(std::memory_order_acquire);
+			if (seq & 1) {
+				std::this_thread::yield();
+				continue;
+			}
+			frame = m_header->frame.load(std::memory_order_relaxed);
+			position = m_header->position.load(std::memory_order_relaxed);
+			count = m_header->count.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_header->seq.load(std::memory_order_relaxed) == seq)
+				return true;
+		}
+		return false;
+	}
+
+	bool ShmRingReader::read(float *dst, uint32_t frames, uint64_t *end)
+	{
+		const uint32_t capacity = m_header->capacity, channels = m_header->channels;
+		bool windows = m_header->mode == ShmRing::Mode::Windows;
+		if (windows ? frames != m_header->windowFrames : frames > capacity)
+			throw std::invalid_argument("Invalid read of " + std::to_string(frames) + " frames from ring [" + m_source + "]");
+
+		for (int attempt = 0; attempt < 3; attempt++) {
+			uint64_t frame;
+			uint32_t position, c0;
+			if (!snapshot(frame, position, c0))
+				return false;
+			if (c0 == 0 || frame < frames)
+				return false;
+
+			if (windows) {
+				for (uint32_t c = 0; c < channels; c++)
+					memcpy(dst + (size_t)c * frames, channel(c) + position, frames * sizeof(float));
+				// the slot is rewritten by the commit slots after this one
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (m_header->pending.load(std::memory_order_relaxed) >= (uint64_t)c0 + m_header->slots)
+					continue;
+			}
+			else {
+				uint32_t from = (position + capacity - frames) % capacity;
+				uint32_t untilEnd = std::min(frames, capacity - from);
+				for (uint32_t c = 0; c < channels; c++) {
+					memcpy(dst + (size_t)c * frames, channel(c) + from, untilEnd * sizeof(float));
+					memcpy(dst + (size_t)c * frames + untilEnd, channel(c), (frames - untilEnd) * sizeof(float));
+				}
+				if (!intact(frame - frames))
+					continue;
+			}
+			if (end)
+				*end = frame;
+			return true;
+		}
+		return false;
+	}
+}
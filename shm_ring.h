@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace autil {
+	class ShmSegment;
+
+	/*
+	 * Named POSIX shared-memory segment /dev/shm/autil-ring-<name> exposing float32 samples to other
+	 * processes on the host (visualisers, MATLAB, Python) without copies or a network stack. One page
+	 * of header, then the planar samples: channel c at c * capacity frames.
+	 *
+	 * Stream mode: a ring of capacity frames. The writer announces a block (pending), stores it, then
+	 * publishes the new write position and the 64-bit frame clock (frames written). Frames
+	 * [frame - n, frame) sit before position, readers check afterwards that pending did not advance past
+	 * frame - n + capacity (seqlock style, the data is never locked).
+	 * Windows mode: slots windows of windowFrames each, the last commit at position, frame = its end,
+	 * pending counts the commits started.
+	 * Each commit stores position, frame and count inside a seqlock (seq odd while they change), so
+	 * readers take all three from the same commit.
+	 *
+	 * Readers map the samples read-only and sleep on a futex in the header (count, incremented per
+	 * commit). The writer only stores to the mapping and wakes with one syscall if a reader waits.
+	 * Bump VERSION on any layout change of Header.
+	 */
+	class ShmRing {
+	public:
+		static const uint32_t MAGIC = 0x47525541; // "AURG"
+		static const uint32_t VERSION = 2;
+		static const size_t HEADER_BYTES = 4096;
+		static const int MAX_NAME = 48;
+
+		enum class Mode : uint32_t { Stream = 0, Windows = 1 };
+		enum class Format : uint32_t { Float32Planar = 0 };
+
+		struct Header {
+			uint32_t magic, version;
+			uint32_t headerBytes; // samples start here
+			int32_t pid; // writer
+			char name[MAX_NAME]; // of the SignalBuffer or observer
+			Mode mode;
+			Format format;
+			uint32_t channels, capacity; // frames per channel
+			uint32_t windowFrames, slots; // Windows mode
+			uint32_t sampleRate; // 0: unknown
+
+			// writer state, own cache line
+			alignas(64) std::atomic<uint64_t> frame; // frame clock: end of the samples published
+			std::atomic<uint64_t> pending; // Stream: frame clock including the block being written, Windows: commits started
+			std::atomic<uint32_t> position; // Stream: next write index, Windows: first frame of the last window
+			std::atomic<uint32_t> count; // commits, the futex word
+			std::atomic<uint32_t> seq; // odd while a commit stores position, frame and count
+			std::atomic<uint32_t> waiters; // readers sleeping on count
+			std::atomic<int64_t> tCommit; // CLOCK_MONOTONIC ns of the last commit
+		};
+
+		// writer: creates (replaces) the segment, unlinked again on destruction
+		ShmRing(const std::string &name, const std::string &source, uint32_t channels, uint32_t capacity, uint32_t sampleRate = 0,
+			Mode mode = Mode::Stream, uint32_t windowFrames = 0);
+		~ShmRing();
+
+		inline const std::string &getName() const { return m_name; }
+		inline uint32_t getChannels() const { return m_header->channels; }
+		inline uint32_t getCapacity() const { return m_header->capacity; }
+		inline float *channel(uint32_t c) { return m_samples + (size_t)c * m_header->capacity; }
+		inline float *samples() { return m_samples; }
+		inline void setSampleRate(uint32_t rate) { m_header->sampleRate = rate; }
+
+		// writer (audio thread), Stream mode: announce frames before storing them at the write position,
+		// publish once stored, position: the write index after them
+		inline void beginWrite(uint32_t frames) {
+			m_header->pending.store(m_header->frame.load(std::memory_order_relaxed) + frames, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		inline void publish(uint32_t frames, uint32_t position) {
+			uint64_t frame = m_header->frame.load(std::memory_order_relaxed) + frames;
+			m_header->pending.store(frame, std::memory_order_relaxed);
+			commit(frame, position);
+		}
+
+		// Windows mode: beginWindow() returns the slot for the window (channel c at slot + c * capacity),
+		// publishWindow() with the frame clock at the end of the window
+		inline float *beginWindow() {
+			uint32_t n = m_header->count.load(std::memory_order_relaxed);
+			m_header->pending.store(n + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			return m_samples + (size_t)(n % m_header->slots) * m_header->windowFrames;
+		}
+		inline void publishWindow(uint64_t frame) {
+			uint32_t n = m_header->count.load(std::memory_order_relaxed);
+			commit(frame, (n % m_header->slots) * m_header->windowFrames);
+		}
+
+		// segment path for a name ("/autil-ring-<name>")
+		static std::string path(const std::string &name);
+
+	private:
+		std::string m_name;
+		ShmSegment *m_segment;
+		Header *m_header;
+		float *m_samples;
+
+		void commit(uint64_t frame, uint32_t position);
+	};
+
+	/*
+	 * Read side, attaches to a ring of this or another process. The samples are mapped read-only, the
+	 * header read-write when permitted (to register for wake-ups, else wait() polls).
+	 */
+	class ShmRingReader {
+	public:
+		// throws if the segment does not exist or has another layout version
+		ShmRingReader(const std::string &name);
+		~ShmRingReader();
+
+		inline const std::string &getSource() const { return m_source; }
+		inline int getPid() const { return m_header->pid; }
+		inline ShmRing::Mode getMode() const { return m_header->mode; }
+		inline uint32_t getChannels() const { return m_header->channels; }
+		inline uint32_t getCapacity() const { return m_header->capacity; }
+		inline uint32_t getWindowFrames() const { return m_header->windowFrames; }
+		inline uint32_t getSampleRate() const { return m_header->sampleRate; }
+
+		// zero copy: the ring of channel c. Stream mode: frames from first on are intact while intact(first)
+		// holds after reading them
+		inline const float *channel(uint32_t c) const { return m_samples + (size_t)c * m_header->capacity; }
+		inline bool intact(uint64_t first) const {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return m_header->pending.load(std::memory_order_relaxed) <= first + m_header->capacity;
+		}
+		// single fields, read() takes them from one commit
+		inline uint64_t getFrame() const { return m_header->frame.load(std::memory_order_acquire); }
+		inline uint32_t getPosition() const { return m_header->position.load(std::memory_order_acquire); }
+		inline uint32_t getCount() const { return m_header->count.load(std::memory_order_acquire); }
+		inline int64_t getCommitTime() const { return m_header->tCommit.load(std::memory_order_relaxed); }
+
+		// sleep until a commit after count (getCount()), false on timeout
+		bool wait(uint32_t count, int timeoutMs);
+
+		// copy of the newest frames (Stream) or the last window (Windows, frames = window), channel c at
+		// dst + c * frames. false if the writer overwrote them meanwhile. end: frame clock after the last frame
+		bool read(float *dst, uint32_t frames, uint64_t *end);
+
+		// writer process still running
+		bool isWriterAlive() const;
+
+		// names of all published rings
+		static std::vector<std::string> list();
+
+	private:
+		std::string m_source;
+		ShmRing::Header *m_header;
+		const float *m_samples;
+		size_t m_bytes;
+		bool m_canRegister;
+
+		// frame, position and count of one commit, false if the writer does not finish a commit
+		bool snapshot(uint64_t &frame, uint32_t &position, uint32_t &count) const;
+	};
+}
@@ -0,0 +1,99 @@
+#include "shm_segment.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+
+#ifdef __unix__
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace autil {
+	std::string ShmSegment::path(const char *prefix, const std::string &name)
+	{
+		std::string p = std::string("/") + prefix + name;
+		for (size_t i = 1; i < p.size(); i++) {
+			if (p[i] == '/')
+				p[i] = '_';
+		}
+		return p;
+	}
+
+#ifdef __unix__
+	ShmSegment::ShmSegment(const std::string &path, size_t bytes, const std::string &what)
+		: m_path(path), m_data(nullptr), m_bytes(bytes), m_inode(0)
+	{
+		const char *p = path.c_str();
+		shm_unlink(p);
+		int fd = shm_open(p, O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Cannot create " + what + " " + path + ": " + strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) == 0)
+			m_inode = st.st_ino;
+
+		if (ftruncate(fd, bytes) != 0) {
+			close(fd);
+			shm_unlink(p);
+			throw std::runtime_error("Cannot size " + what + " " + path);
+		}
+
+		void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			shm_unlink(p);
+			throw std::runtime_error("Cannot map " + what + " " + path);
+		}
+		mlock(mem, bytes);
+		m_data = mem;
+	}
+
+	ShmSegment::~ShmSegment()
+	{
+		munmap(m_data, m_bytes);
+
+		int fd = shm_open(m_path.c_str(), O_RDONLY, 0);
+		if (fd >= 0) {
+			struct stat st;
+			bool ours = fstat(fd, &st) == 0 && (uint64_t)st.st_ino == m_inode;
+			close(fd);
+			if (ours)
+				shm_unlink(m_path.c_str());
+		}
+	}
+
+	std::vector<std::string> ShmSegment::list(const char *prefix)
+	{
+		std::vector<std::string> names;
+		DIR *dir = opendir("/dev/shm");
+		if (!dir)
+			return names;
+
+		size_t prefixLen = strlen(prefix);
+		while (struct dirent *e = readdir(dir)) {
+			if (strncmp(e->d_name, prefix, prefixLen) == 0)
+				names.push_back(e->d_name + prefixLen);
+		}
+		closedir(dir);
+		return names;
+	}
+#else
+	ShmSegment::ShmSegment(const std::string &path, size_t bytes, const std::string &what)
+		: m_path(path), m_data(nullptr), m_bytes(bytes), m_inode(0)
+	{
+		throw std::runtime_error("Shared memory is only available on POSIX systems");
+	}
+
+	ShmSegment::~ShmSegment() {}
+
+	std::vector<std::string> ShmSegment::list(const char *prefix)
+	{
+		return std::vector<std::string>();
+	}
+#endif
+}
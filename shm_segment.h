@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace autil {
+	/*
+	 * Writer side of a POSIX shared-memory segment /dev/shm/<prefix><name>, the common part of
+	 * TelemetrySegment and ShmRing. Creation replaces a stale segment of the same name, the mapping is
+	 * read-write and locked so the audio thread never faults on it. The pages start zeroed: the owner
+	 * fills its header and stores its magic last (after a release fence), so readers never see a
+	 * half-initialised header. On destruction the segment is unlinked, unless another writer replaced it.
+	 */
+	class ShmSegment {
+	public:
+		// creates (replaces) the segment, what names it in error messages
+		ShmSegment(const std::string &path, size_t bytes, const std::string &what);
+		~ShmSegment();
+
+		inline void *getData() const { return m_data; }
+		inline size_t getBytes() const { return m_bytes; }
+
+		// "/<prefix><name>", '/' in the name replaced
+		static std::string path(const char *prefix, const std::string &name);
+		// names (without the prefix) of the segments starting with prefix
+		static std::vector<std::string> list(const char *prefix);
+
+	private:
+		std::string m_path;
+		void *m_data;
+		size_t m_bytes;
+		uint64_t m_inode; // unlink only our own segment, not one that replaced it
+	};
+}
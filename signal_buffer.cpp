@@ -3,73 +3,83 @@
 #include "signal_buffer.h"
 
 #ifdef WITH_DEBUG_NET
-#include "net.h"
+#include "debug_stream.h"
 #endif
 
 
 
-#ifdef WITH_DEBUG_NET
-	void SignalBuffer::setDebugReceiver(std::string address, int port) {
+	void SignalBuffer::setSharedMemory(const std::string &ringName, uint32_t sampleRate) {
+		uint32_t ringSize = size + delay;
+		autil::ShmRing *ring = new autil::ShmRing(ringName, name, channels, ringSize, sampleRate);
+
+		// same layout as the time queue (channel c at c * (size + delay)), the samples so far move along
+		memcpy(ring->samples(), m_timeQueue, (size_t)channels * ringSize * sizeof(float));
+		if (shmRing)
+			delete shmRing;
+		else
+			delete[] m_timeQueue;
+		m_timeQueue = ring->samples();
+		shmRing = ring;
 
-		std::cout << "Added debug UDP stream from SignalBuffer [" << name << "] to " << address << ":" << port << "!" << std::endl;
-		debugSocket = new autil::UdpSocket(address, port);
-		debugBlockIndex = 0;
+		std::cout << "SignalBuffer [" << name << "] shared in memory as " << autil::ShmRing::path(ringName) << std::endl;
 	}
-#endif
 
 #ifdef WITH_DEBUG_NET
+	void SignalBuffer::setDebugReceiver(std::string address, int port, autil::wire::PayloadType format) {
+		// published once: the audio thread may be inside sendDebugBlock() any time after
+		autil::DebugStream *stream = new autil::DebugStream(address, port, channels, std::min<uint32_t>(size, 4096), 64, format);
+		autil::DebugStream *none = nullptr;
+		if (!debugStream.compare_exchange_strong(none, stream, std::memory_order_acq_rel)) {
+			delete stream;
+			throw std::logic_error("SignalBuffer [" + name + "] already has a debug stream, use addDebugSubscriber()");
+		}
 
-#if 1
-
-	void SignalBuffer::sendDebugBlock(uint32_t blockIndex, uint32_t blockLength) {
-		std::vector<const float *> samples;
-		for (size_t ci = 0; ci < channels; ci++) {
-			samples.push_back(getPtrTQ(ci, blockIndex));
-		}		
-		debugSocket->sendBlock(samples, blockLength, debugBlockIndex);		
-		debugBlockIndex++; // this will wrap arround, -127->128
+		std::cout << "Added debug UDP stream from SignalBuffer [" << name << "] to " << address << ":" << port
+			<< " (" << autil::wire::payloadName(format) << ")!" << std::endl;
 	}
 
-#else
-
-	void SignalBuffer::sendDebugBlock(uint32_t blockIndex, uint32_t blockLength) {
-		// header: [index|#channels|blockLength|1|ch0_norm|ch1_norm...|chN_norm]
-		int headerLen = 4 * sizeof(int16_t) + sizeof(int16_t)*channels;
-
-		uint32_t dataBytes = headerLen + (blockLength * channels * sizeof(int16_t));
-		int16_t *data = new int16_t[dataBytes / sizeof(int16_t)];
+	void SignalBuffer::addDebugSubscriber(std::string address, int port, autil::wire::PayloadType format) {
+		autil::DebugStream *stream = debugStream.load(std::memory_order_acquire);
+		if (!stream) {
+			setDebugReceiver(address, port, format);
+			return;
+		}
+		if (stream->addSubscriber(address, port))
+			std::cout << "Added debug UDP subscriber " << address << ":" << port << " to SignalBuffer [" << name << "] ("
+				<< stream->getNumSubscribers() << " subscribers)" << std::endl;
+	}
 
-		data[0] = (int16_t)debugBlockIndex;
-		data[1] = (int16_t)channels;
-		data[2] = (int16_t)blockLength;
-		data[3] = (int16_t)1;
+	bool SignalBuffer::removeDebugSubscriber(std::string address, int port) {
+		autil::DebugStream *stream = debugStream.load(std::memory_order_acquire);
+		if (!stream || !stream->removeSubscriber(address, port))
+			return false;
+		std::cout << "Removed debug UDP subscriber " << address << ":" << port << " from SignalBuffer [" << name << "] ("
+			<< stream->getNumSubscribers() << " subscribers)" << std::endl;
+		return true;
+	}
 
+	void SignalBuffer::setDebugClockSync(const autil::ClockSync *sync, double sampleRate, int64_t latencyNs) {
+		autil::DebugStream *stream = debugStream.load(std::memory_order_acquire);
+		if (!stream)
+			throw std::logic_error("SignalBuffer [" + name + "] has no debug stream");
+		stream->setClockSync(sync, sampleRate, latencyNs);
+	}
 
+	void SignalBuffer::sendDebugBlock(uint32_t blockIndex, uint32_t blockLength) {
+		autil::DebugStream *stream = debugStream.load(std::memory_order_acquire);
+		float *slot = stream->beginBlock(blockLength);
+		if (!slot)
+			return;
 
-		for (int ci = 0; ci < channels; ci++) {
-			float cmax = absmax(getPtrTQ(ci, blockIndex), blockLength);
-			if (cmax > 1.0f || cmax < -1.0f) {
-				delete[] data;
-				return;
-			}
-			data[4 + ci] = (int16_t)(cmax * 0x7fff);
-			for (uint32_t i = 0; i < blockLength; i++) {
-				float f = (cmax == 0.0f) ? 0.0f : (getPtrTQ(ci, blockIndex)[i] / cmax);
-				if (f > 1.0f) f = 1.0f;
-				if (f < -1.0f) f = -1.0f;
-				data[headerLen / sizeof(int16_t) + ci * blockLength + i] = (int16_t)(f * 0x7fff);
-			}
+		// the block may wrap around the end of the time queue
+		uint32_t untilEnd = std::min(blockLength, size + delay - blockIndex);
+		uint32_t stride = stream->getMaxBlockLength();
+		for (uint32_t ci = 0; ci < channels; ci++) {
+			memcpy(slot + ci * stride, getPtrTQ(ci, blockIndex), untilEnd * sizeof(float));
+			memcpy(slot + ci * stride + untilEnd, getPtrTQ(ci), (blockLength - untilEnd) * sizeof(float));
 		}
-
-		if (!debugSocket->Send((const char *)data, dataBytes))
-			printf("failed to send debug data!\n");
-		delete[] data;
-
-		// this will wrap arround, 32,767->-32,678
-		debugBlockIndex++;
+		stream->endBlock(blockLength);
 	}
-
-#endif
 #endif
 
 
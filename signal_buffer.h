@@ -4,15 +4,21 @@
 #include <algorithm>
 #include <cmath>
 #include <stdexcept>
+#include <atomic>
 
 #include<rtt/rtt.h>
 
 #include "signal_processor.h"
+#include "commit_queue.h"
+#include "tracer.h"
+#include "wire_format.h"
+#include "shm_ring.h"
 
 #define WITH_DEBUG_NET 1
 
 namespace autil {
-	class UdpSocket;
+	class DebugStream;
+	class ClockSync;
 }
 
 void normalize(float *vector, int len);
@@ -47,21 +53,22 @@ public:
 
 	//ITAFFT *m_fft;
 
-	autil::UdpSocket *debugSocket;
+	std::atomic<autil::DebugStream *> debugStream; // set once (setDebugReceiver()), read by the audio thread
+	autil::ShmRing *shmRing; // the time queue lives in shared memory (setSharedMemory())
 
 
 	std::vector<SignalProcessor*> m_preProcessors;
 	
 
 	inline float * getPtrTQ(uint32_t c) {
-		return &m_timeQueue[(size + 0)*c];
+		return &m_timeQueue[(size + delay)*c];
 	}
 
 	inline float * getPtrTQ(uint32_t c, uint32_t offset) {
 		if (offset < 0) {
 			offset += size;
 		}
-		return &m_timeQueue[(size + 0)*c]+ offset;
+		return &m_timeQueue[(size + delay)*c]+ offset;
 	}
 
 	inline float * getPtrTS(uint32_t c) {
@@ -74,7 +81,8 @@ public:
 	}
 
 	void init() {
-		debugSocket = 0;
+		debugStream.store(nullptr);
+		shmRing = 0;
 		m_timeQueuePointer = 0;
 		//m_fft = 0;
 	}
@@ -92,7 +100,7 @@ public:
 		memset(m_freq, 0, nChannels*(size + 1) * 2 * sizeof(float));
 	}
 
-	SignalBuffer(float *samples, int len) : size(len), channels(1)
+	SignalBuffer(float *samples, int len) : size(len), channels(1), delay(0)
 	{
 		init();
 
@@ -101,7 +109,7 @@ public:
 		memcpy(m_timeQueue, samples, len*sizeof(float));
 	}
 
-	SignalBuffer(std::vector<float *> samples, int len) : size(len), channels(samples.size())
+	SignalBuffer(std::vector<float *> samples, int len) : size(len), channels(samples.size()), delay(0)
 	{
 		init();
 
@@ -126,6 +134,9 @@ public:
 		if (length > size || length == 0)
 			throw std::out_of_range("Invalid block size!");
 
+		if (channel == 0 && shmRing)
+			shmRing->beginWrite(length);
+
 		uint32_t untilEnd = size + delay - m_timeQueuePointer;
 		bool breakBlock = (length > untilEnd);
 
@@ -134,19 +145,17 @@ public:
 			memcpy(&getPtrTQ(channel)[m_timeQueuePointer], block, untilEnd * sizeof(float));
 			memcpy(&getPtrTQ(channel)[0], block + untilEnd, (length - untilEnd) * sizeof(float));
 			if (!m_preProcessors.empty()) {
-				throw "Unsupported setup: stream preprocess can only be used with signal buffers having a multiple block size length!";
+				AUTIL_TRACE_SCOPE("preprocessor", channel);
+				m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), untilEnd);
+				m_preProcessors[channel]->Process(getPtrTQ(channel), length - untilEnd);
 			}
 
 		}
 		else {
 			memcpy(&getPtrTQ(channel)[m_timeQueuePointer], block, length * sizeof(float));
 			if (!m_preProcessors.empty()) {
-				uint32_t prev = (m_timeQueuePointer + (size - length)) % size;
-				if ((size - prev) < length)
-					throw "Unsupported setup: stream preprocess can only be used with signal buffers having a multiple block size length!";
-				else
-					m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), length);
-				//m_streamPreprocessor->Process(getPtrTQ(channel, prev), getPtrTQ(channel, m_timeQueuePointer), , length);
+				AUTIL_TRACE_SCOPE("preprocessor", channel);
+				m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), length);
 			}
 
 		}
@@ -155,13 +164,15 @@ public:
 		// inc pointer with last channel
 		if (channel == channels - 1) {
 #ifdef WITH_DEBUG_NET
-			if (debugSocket && !breakBlock) {
+			if (debugStream.load(std::memory_order_acquire))
 				sendDebugBlock(m_timeQueuePointer, length);
-			}
 #endif
 
 			m_timeQueuePointer += length;
 			m_timeQueuePointer = m_timeQueuePointer % (size + delay);
+
+			if (shmRing)
+				shmRing->publish(length, m_timeQueuePointer);
 		}
 	}
 
@@ -173,6 +184,9 @@ public:
 		if (length > size || length == 0)
 			throw std::out_of_range("Invalid block size!");
 
+		if (channel == 0 && shmRing)
+			shmRing->beginWrite(length);
+
 		uint32_t untilEnd = size + delay - m_timeQueuePointer;
 		bool breakBlock = (length > untilEnd);
 
@@ -181,19 +195,17 @@ public:
 			converter(&getPtrTQ(channel)[m_timeQueuePointer], srcBlock, srcStride, untilEnd );
 			converter(&getPtrTQ(channel)[0], srcBlock + untilEnd, srcStride, (length - untilEnd));
 			if (!m_preProcessors.empty()) {
-				throw "Unsupported setup: stream preprocess can only be used with signal buffers having a multiple block size length!";
+				AUTIL_TRACE_SCOPE("preprocessor", channel);
+				m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), untilEnd);
+				m_preProcessors[channel]->Process(getPtrTQ(channel), length - untilEnd);
 			}
 
 		}
 		else {
 			converter(&getPtrTQ(channel)[m_timeQueuePointer], srcBlock, srcStride, length);
 			if (!m_preProcessors.empty()) {
-				uint32_t prev = (m_timeQueuePointer + (size - length)) % size;
-				if ((size - prev) < length)
-					throw "Unsupported setup: stream preprocess can only be used with signal buffers having a multiple block size length!";
-				else
-					m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), length);
-				//m_streamPreprocessor->Process(getPtrTQ(channel, prev), getPtrTQ(channel, m_timeQueuePointer), , length);
+				AUTIL_TRACE_SCOPE("preprocessor", channel);
+				m_preProcessors[channel]->Process(getPtrTQ(channel, m_timeQueuePointer), length);
 			}
 
 		}
@@ -202,13 +214,15 @@ public:
 		// inc pointer with last channel
 		if (channel == channels - 1) {
 #ifdef WITH_DEBUG_NET
-			if (debugSocket && !breakBlock) {
+			if (debugStream.load(std::memory_order_acquire))
 				sendDebugBlock(m_timeQueuePointer, length);
-			}
 #endif
 
 			m_timeQueuePointer += length;
 			m_timeQueuePointer = m_timeQueuePointer % (size + delay);
+
+			if (shmRing)
+				shmRing->publish(length, m_timeQueuePointer);
 		}
 	}
 
@@ -263,21 +277,56 @@ public:
 	}
 
 
+	// advance the iterator by length frames without data, e.g. to bridge an xrun gap.
+	// clear=true (capture) fills the skipped frames with silence
+	void skip(uint32_t length, bool clear) {
+		uint32_t ringSize = clear ? (size + delay) : size;
+
+		if (clear && shmRing)
+			shmRing->beginWrite(length);
+
+		if (clear) {
+			uint32_t n = (std::min)(length, ringSize);
+			uint32_t from = (uint32_t)((m_timeQueuePointer + (uint64_t)length - n) % ringSize);
+			uint32_t untilEnd = ringSize - from;
+			for (uint32_t c = 0; c < channels; c++) {
+				if (n > untilEnd) {
+					memset(&getPtrTQ(c)[from], 0, untilEnd * sizeof(float));
+					memset(&getPtrTQ(c)[0], 0, (n - untilEnd) * sizeof(float));
+				}
+				else {
+					memset(&getPtrTQ(c)[from], 0, n * sizeof(float));
+				}
+			}
+		}
+
+		m_timeQueuePointer = (uint32_t)((m_timeQueuePointer + (uint64_t)length) % ringSize);
+
+		if (clear && shmRing)
+			shmRing->publish(length, m_timeQueuePointer);
+	}
+
 	void stage() {
 		if (!m_timeStage)
 			return;
 
+		stage(m_timeStage, size + 1);
+	}
+
+	// the last size frames before the iterator, oldest first, channel c at dst + c*channelStride
+	void stage(float *dst, uint32_t channelStride) {
+		uint32_t ringSize = size + delay;
+		uint32_t readFrom = (m_timeQueuePointer + ringSize - size) % ringSize;
+		uint32_t untilEnd = ringSize - readFrom;
+
 		for (uint32_t c = 0; c < channels; c++)
 		{
-			uint32_t readFrom = (size + m_timeQueuePointer) % (size + delay);
-			uint32_t readEnd = (readFrom + size) % (size + delay);
-
-			if (readEnd >= readFrom) {
-				memcpy(getPtrTS(c), &getPtrTQ(c)[readFrom], size * sizeof(float));
+			float *out = dst + c * channelStride;
+			if (untilEnd >= size) {
+				memcpy(out, &getPtrTQ(c)[readFrom], size * sizeof(float));
 			} else {
-				uint32_t untilEnd = size + delay - readFrom;
-				memcpy(getPtrTS(c), &getPtrTQ(c)[readFrom], untilEnd*sizeof(float));
-				memcpy(getPtrTS(c) + untilEnd, getPtrTQ(c), readEnd*sizeof(float));
+				memcpy(out, &getPtrTQ(c)[readFrom], untilEnd*sizeof(float));
+				memcpy(out + untilEnd, getPtrTQ(c), (size - untilEnd)*sizeof(float));
 			}
 		}
 	}
@@ -362,9 +411,23 @@ public:
 		}
 	}
 
-	int16_t debugBlockIndex;
+	// move the time queue into the shared-memory ring /dev/shm/autil-ring-<name> (ShmRing, Stream mode): local
+	// processes map it read-only and follow the write position and frame clock, no copies. Capture buffers
+	// (addBlock()), call before the stream starts
+	void setSharedMemory(const std::string &ringName, uint32_t sampleRate = 0);
+
 #ifdef WITH_DEBUG_NET
-	void setDebugReceiver(std::string address, int port);
+	// stream every block written to this buffer to a UDP receiver, sent from a separate thread
+	// in the given wire format (see wire_format.h, Legacy: 8 bit blocks without a versioned header).
+	// Once per buffer (the audio thread may be using the stream), more receivers with addDebugSubscriber()
+	void setDebugReceiver(std::string address, int port, autil::wire::PayloadType format = autil::wire::PayloadType::Legacy);
+	// more receivers of the debug stream (unicast or a multicast group), added and removed at runtime, the blocks are
+	// encoded once for all of them. Without a debug stream one is started in the given format
+	void addDebugSubscriber(std::string address, int port, autil::wire::PayloadType format = autil::wire::PayloadType::Legacy);
+	bool removeDebugSubscriber(std::string address, int port);
+	// timestamp the versioned debug packets on a ClockSync timebase (after setDebugReceiver()), see DebugStream::setClockSync()
+	void setDebugClockSync(const autil::ClockSync *sync, double sampleRate, int64_t latencyNs = 0);
+	// audio thread: queue the block at blockIndex (wraps around the ring) for the sender thread
 	void sendDebugBlock(uint32_t blockIndex, uint32_t blockLength);
 #endif
 };
@@ -372,33 +435,46 @@ public:
 class SignalBufferObserver {
 public:
 	RttEvent m_evCommit;
+	RttEvent m_evReleased; // reset() or cancel() by the consumer
 	std::vector<SignalBuffer*> m_hists;
 
-	uint32_t updateInterval;
-	uint32_t lastUpdate;
+	uint32_t updateInterval; // hop size in frames, the window is the buffer size
+	uint64_t lastUpdate; // frame of the last commit point
+
+	// frame range [windowBegin, windowEnd) of the staged data, stamped on commit
+	uint64_t windowBegin, windowEnd;
+
+	volatile bool commiting; // single slot: staged and not yet reset(). queued: the consumer holds a window
 
-	volatile bool commiting;
+	// optional N-slot queue (setQueue()), otherwise commits stage directly into the buffers
+	autil::CommitQueue *m_queue;
+	std::vector<float> m_queueRead;
+	// optional shared-memory ring of the committed windows (setSharedMemory())
+	autil::ShmRing *m_shmRing;
+	// optional copy of every committed window for a publisher thread (setTap(), not owned)
+	autil::CommitQueue *m_tap;
+	uint64_t numLost; // single slot: commits dropped while the consumer was busy
 
 
-	SignalBufferObserver(SignalBuffer *buf = NULL) :commiting(false), updateInterval(-1), lastUpdate(-1) {
+	SignalBufferObserver(SignalBuffer *buf = NULL) : updateInterval(-1), lastUpdate(-1), windowBegin(0), windowEnd(0), commiting(false), m_queue(nullptr), m_shmRing(nullptr), m_tap(nullptr), numLost(0) {
 		if (buf) {
 			m_hists.push_back(buf);
 			updateInterval = buf->size;
 		}
 	}
 
-	SignalBufferObserver(const std::vector<SignalBuffer *> &buffers) :commiting(false), updateInterval(-1), lastUpdate(-1) {
+	SignalBufferObserver(const std::vector<SignalBuffer *> &buffers) : updateInterval(-1), lastUpdate(-1), windowBegin(0), windowEnd(0), commiting(false), m_queue(nullptr), m_shmRing(nullptr), m_tap(nullptr), numLost(0) {
 		add(buffers);
 	}
 
 
 
-	SignalBufferObserver(SignalBuffer &buf) :commiting(false), updateInterval(-1), lastUpdate(-1) {
+	SignalBufferObserver(SignalBuffer &buf) : updateInterval(-1), lastUpdate(-1), windowBegin(0), windowEnd(0), commiting(false), m_queue(nullptr), m_shmRing(nullptr), m_tap(nullptr), numLost(0) {
 		m_hists.push_back(&buf);
 		updateInterval = buf.size;
 	}
 
-	SignalBufferObserver(SignalBuffer &buf, SignalBuffer &buf2) :commiting(false), updateInterval(-1), lastUpdate(-1) {
+	SignalBufferObserver(SignalBuffer &buf, SignalBuffer &buf2) : updateInterval(-1), lastUpdate(-1), windowBegin(0), windowEnd(0), commiting(false), m_queue(nullptr), m_shmRing(nullptr), m_tap(nullptr), numLost(0) {
 		if (buf.size != buf2.size)
 			throw "Cannot observer signals of different sizes!";
 
@@ -409,8 +485,55 @@ public:
 	
 	~SignalBufferObserver() {
 		//m_evCommit.Signal();
+		delete m_queue;
+		delete m_shmRing;
 	}
 
+	// keep up to slots committed windows for the consumer. Call after adding all buffers, before adding the observer to a driver.
+	void setQueue(uint32_t slots, autil::CommitQueue::Overflow overflow = autil::CommitQueue::Overflow::DropOldest) {
+		uint32_t samples = 0;
+		for (auto h : m_hists)
+			samples += h->channels * h->size;
+
+		delete m_queue;
+		m_queue = new autil::CommitQueue(slots, samples, overflow);
+		m_queueRead.assign(samples, 0.0f);
+	}
+
+	// also publish every committed window to /dev/shm/autil-ring-<name> (ShmRing, Windows mode, the newest
+	// slots windows, channels of all buffers in order), independent of the consumer. Call after adding all buffers
+	void setSharedMemory(const std::string &ringName, uint32_t slots = 4, uint32_t sampleRate = 0) {
+		if (m_hists.empty())
+			throw std::invalid_argument("Observer has no buffers to share!");
+		uint32_t numChannels = 0;
+		for (auto h : m_hists)
+			numChannels += h->channels;
+		uint32_t window = m_hists[0]->size;
+
+		delete m_shmRing;
+		m_shmRing = nullptr;
+		m_shmRing = new autil::ShmRing(ringName, m_hists[0]->name, numChannels, slots * window, sampleRate,
+			autil::ShmRing::Mode::Windows, window);
+	}
+
+	// also copy every committed window into a slot of tap (channels of all buffers in order, getLength() frames each),
+	// independent of the consumer: the window is dropped if the tap is full. nullptr detaches, set while not
+	// added to a running driver (ObserverPublisher)
+	void setTap(autil::CommitQueue *tap) {
+		uint32_t samples = 0;
+		for (auto h : m_hists)
+			samples += h->channels * h->size;
+		if (tap && tap->getSlotSamples() < samples)
+			throw std::invalid_argument("Tap slots too small for the observed buffers!");
+		m_tap = tap;
+	}
+
+	inline uint64_t getNumLostWindows() const { return m_queue ? m_queue->getNumLost() : numLost; }
+
+	// producer side: a commit now would not drop a window
+	inline bool canCommit() const { return m_queue ? !m_queue->full() : !commiting; }
+	inline bool blocksWhenFull() const { return m_queue && m_queue->getOverflow() == autil::CommitQueue::Overflow::Block; }
+
 	void add(const std::vector<SignalBuffer *> &buffers) {
 		if (buffers.size() == 0)
 			throw std::invalid_argument("Cannot observe an empty vector of SignalBuffers!");
@@ -418,22 +541,76 @@ public:
 		if(updateInterval == -1)
 			updateInterval = buffers[0]->size;
 
+		uint32_t windowSize = m_hists.empty() ? buffers[0]->size : m_hists[0]->size;
 		for (auto b : buffers) {
-			if (b->size != updateInterval)
+			if (b->size != windowSize)
 				throw std::invalid_argument("Cannot observe signals of different sizes!");
 			m_hists.push_back(b);
 		}
 	}
 
+	// commit every hop frames (default: the window size, no overlap). Set before adding the observer to a driver.
+	void setHopSize(uint32_t hop) {
+		if (hop == 0)
+			throw std::invalid_argument("Invalid hop size!");
+		updateInterval = hop;
+	}
+
 	void addHist(SignalBuffer* h) {
 		m_hists.push_back(h);
 	}
 
-	bool commit() {
-		if (commiting)
+	// first frame of the window ending at frame, 0 while fewer frames than the window have passed
+	inline uint64_t beginOf(uint64_t frame) const {
+		uint64_t size = m_hists.empty() ? 0 : m_hists[0]->size;
+		return frame > size ? frame - size : 0;
+	}
+
+	// frame: end of the window, the driver commits when the buffers were just advanced to this frame
+	bool commit(uint64_t frame) {
+		if (m_shmRing) {
+			uint32_t stride = m_shmRing->getCapacity();
+			float *dst = m_shmRing->beginWindow();
+			for (auto h : m_hists) {
+				h->stage(dst, stride);
+				dst += (size_t)h->channels * stride;
+			}
+			m_shmRing->publishWindow(frame);
+		}
+
+		if (m_tap) {
+			float *dst = m_tap->beginWrite();
+			if (dst) {
+				for (auto h : m_hists) {
+					h->stage(dst, h->size);
+					dst += h->channels * h->size;
+				}
+				m_tap->endWrite(beginOf(frame), frame);
+			}
+		}
+
+		if (m_queue) {
+			float *dst = m_queue->beginWrite();
+			if (!dst)
+				return false;
+			for (auto h : m_hists) {
+				h->stage(dst, h->size);
+				dst += h->channels * h->size;
+			}
+			m_queue->endWrite(beginOf(frame), frame);
+			return true;
+		}
+
+		if (commiting) {
+			numLost++;
 			return false;
+		}
 
 		commiting = true;
+		m_evReleased.Reset();
+
+		windowEnd = frame;
+		windowBegin = beginOf(frame);
 
 		for (auto h : m_hists) {
 			h->stage();
@@ -443,6 +620,18 @@ public:
 		return true;
 	}
 
+	// producer side backpressure: wait until the consumer is done with the last commit
+	bool waitForRelease(int timeoutMs) {
+		if (m_queue)
+			return m_queue->waitForSpace(timeoutMs);
+
+		while (commiting) {
+			if (!m_evReleased.Wait(timeoutMs))
+				return !commiting;
+		}
+		return true;
+	}
+
 	void reset() {
 		if (!commiting)
 			throw "Called commited() but not commiting!";
@@ -455,6 +644,7 @@ public:
 		//}
 
 		commiting = false;
+		m_evReleased.Signal();
 	}
 
 	void resetBuffers() {
@@ -465,12 +655,31 @@ public:
 	
 	void cancel() {
 		commiting = false;
+		if (m_queue)
+			m_queue->cancel();
 		m_evCommit.Signal();
+		m_evReleased.Signal();
 	}
 
 	bool waitForCommit() {
 		if (updateInterval == -1)
 			throw "Waiting for a signal with undefined interval!";
+
+		if (m_queue) {
+			// oldest queued window into the buffers' stage, the slot is free again right away
+			if (!m_queue->read(m_queueRead.data(), &windowBegin, &windowEnd))
+				return false;
+			const float *src = m_queueRead.data();
+			for (auto h : m_hists) {
+				for (uint32_t c = 0; c < h->channels; c++) {
+					memcpy(h->getPtrTS(c), src, h->size * sizeof(float));
+					src += h->size;
+				}
+			}
+			commiting = true;
+			return true;
+		}
+
 		return m_evCommit.Wait() && commiting;
 	}
 
@@ -498,7 +707,7 @@ public:
 	}
 
 	uint32_t getLength() const {
-		uint32_t minSize;
+		uint32_t minSize = m_hists.empty() ? 0 : m_hists[0]->size;
 		std::for_each(m_hists.begin(), m_hists.end(), [&minSize](SignalBuffer *sb) { if (sb->size < minSize) minSize = sb->size; });
 		return minSize;
 	}
@@ -4,7 +4,7 @@
 
 SignalProcessor::SignalProcessor(const ProcessFunction &process) : process(process)
 {
-	memset(prevBlock, 0, sizeof(prevBlock));
+	memset(history, 0, sizeof(history));
 }
 
 
@@ -16,15 +16,18 @@ SignalProcessor::~SignalProcessor()
 
 void SignalProcessor::Process(float *block, uint32_t blockSize)
 {
-	if (blockSize > MaxBlockSize)
-		throw "Block size too big!";
+	while (blockSize > MaxBlockSize) {
+		Process(block, MaxBlockSize);
+		block += MaxBlockSize;
+		blockSize -= MaxBlockSize;
+	}
 
-	// concat prev block with current
+	// concat the preceding input with the current block
 	float cur2Blocks[MaxBlockSize*2];
-	memcpy(cur2Blocks, prevBlock, blockSize*sizeof(float));
+	memcpy(cur2Blocks, history + MaxBlockSize - blockSize, blockSize*sizeof(float));
 	memcpy(cur2Blocks+ blockSize, block, blockSize*sizeof(float));
-	memcpy(prevBlock, block, blockSize*sizeof(float));
+	memmove(history, history + blockSize, (MaxBlockSize - blockSize)*sizeof(float));
+	memcpy(history + MaxBlockSize - blockSize, block, blockSize*sizeof(float));
 
 	process(cur2Blocks, cur2Blocks + blockSize, block, blockSize);
-
 }
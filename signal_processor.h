@@ -12,11 +12,13 @@ public:
 	SignalProcessor(const ProcessFunction &process);
 	virtual ~SignalProcessor();
 
+	// any block size: blockInPrev are the blockSize input samples right before the block, so a block may be split
+	// (scheduled actions, observer hops, ring wrap-around), longer blocks are processed in MaxBlockSize pieces
 	void Process(float *block, uint32_t blockSize);
 
 private:
 	ProcessFunction process;
-	float prevBlock[MaxBlockSize];
+	float history[MaxBlockSize]; // the last MaxBlockSize input samples, oldest first
 };
 
 
@@ -0,0 +1,131 @@
+#include "telemetry.h"
+#include "shm_segment.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+
+#ifdef __unix__
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace autil {
+	static const char *SEGMENT_PREFIX = "autil-";
+
+	static void copyName(char *dst, const std::string &src)
+	{
+		strncpy(dst, src.c_str(), TelemetryData::MAX_NAME - 1);
+		dst[TelemetryData::MAX_NAME - 1] = 0;
+	}
+
+	std::string TelemetrySegment::path(const std::string &name)
+	{
+		return ShmSegment::path(SEGMENT_PREFIX, name);
+	}
+
+	std::vector<std::string> TelemetryReader::list()
+	{
+		// "autil-ring-*" are sample rings (ShmRing)
+		std::vector<std::string> names;
+		for (auto &name : ShmSegment::list(SEGMENT_PREFIX)) {
+			if (name.compare(0, 5, "ring-") != 0)
+				names.push_back(name);
+		}
+		return names;
+	}
+
+#ifdef __unix__
+	TelemetrySegment::TelemetrySegment(const std::string &name, const std::string &driver)
+		: m_name(name), m_segment(nullptr), m_layout(nullptr)
+	{
+		static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "telemetry seqlock needs lock-free 64-bit atomics");
+
+		m_segment = new ShmSegment(path(name), sizeof(Layout), "telemetry segment");
+
+		void *mem = m_segment->getData();
+		m_layout = (Layout *)mem;
+		m_layout->version = VERSION;
+		m_layout->size = sizeof(Layout);
+		m_layout->pid = (int32_t)getpid();
+		copyName(m_layout->driver, driver);
+		m_layout->seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_layout->magic = MAGIC;
+	}
+
+	TelemetrySegment::~TelemetrySegment()
+	{
+		delete m_segment;
+	}
+
+	TelemetryReader::TelemetryReader(const std::string &name)
+		: m_pid(0), m_layout(nullptr)
+	{
+		std::string p = TelemetrySegment::path(name);
+		int fd = shm_open(p.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+			throw std::runtime_error("No telemetry segment " + p);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TelemetrySegment::Layout)) {
+			close(fd);
+			throw std::runtime_error("Telemetry segment " + p + " has an unknown layout");
+		}
+
+		void *mem = mmap(nullptr, sizeof(TelemetrySegment::Layout), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("Cannot map telemetry segment " + p);
+
+		m_layout = (const TelemetrySegment::Layout *)mem;
+		uint32_t version = m_layout->version;
+		if (m_layout->magic != TelemetrySegment::MAGIC || version != TelemetrySegment::VERSION
+			|| m_layout->size != sizeof(TelemetrySegment::Layout)) {
+			munmap(mem, sizeof(TelemetrySegment::Layout));
+			throw std::runtime_error("Telemetry segment " + p + " has version " + std::to_string(version)
+				+ ", expected " + std::to_string(TelemetrySegment::VERSION));
+		}
+
+		m_driver = std::string(m_layout->driver, strnlen(m_layout->driver, TelemetryData::MAX_NAME));
+		m_pid = m_layout->pid;
+	}
+
+	TelemetryReader::~TelemetryReader()
+	{
+		munmap((void *)m_layout, sizeof(TelemetrySegment::Layout));
+	}
+#else
+	TelemetrySegment::TelemetrySegment(const std::string &name, const std::string &driver)
+		: m_name(name), m_segment(nullptr), m_layout(nullptr)
+	{
+		throw std::runtime_error("Telemetry is only available on POSIX systems");
+	}
+
+	TelemetrySegment::~TelemetrySegment() {}
+
+	TelemetryReader::TelemetryReader(const std::string &name)
+		: m_pid(0), m_layout(nullptr)
+	{
+		throw std::runtime_error("Telemetry is only available on POSIX systems");
+	}
+
+	TelemetryReader::~TelemetryReader() {}
+#endif
+
+	bool TelemetryReader::read(TelemetryData &data, int maxRetries) const
+	{
+		for (int i = 0; i < maxRetries; i++) {
+			uint64_t s0 = m_layout->seq.load(std::memory_order_acquire);
+			if (s0 & 1)
+				continue;
+			memcpy(&data, (const void *)&m_layout->data, sizeof(TelemetryData));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_layout->seq.load(std::memory_order_relaxed) == s0)
+				return true;
+		}
+		return false;
+	}
+}
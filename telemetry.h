@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "callback_stats.h"
+
+namespace autil {
+	class ShmSegment;
+
+	/*
+	 * Driver state as published in shared memory. Plain data, filled by the audio thread once per
+	 * period. Counters are cumulative since the driver started, monitors compute rates and means
+	 * from the difference of two reads (e.g. stage sum / numPeriods).
+	 */
+	struct TelemetryData {
+		static const int MAX_NAME = 48;
+		static const int MAX_ENTRIES = 16;
+
+		// stream
+		int32_t sampleRate, blockSize;
+		int32_t period; // frames of the last period
+		int32_t numChannelsCapture, numChannelsPlayback;
+		uint32_t running, paused, freewheel;
+		uint64_t frame; // AudioDriverBase::getFrame()
+		uint64_t numPeriods;
+		int64_t tUpdate; // CLOCK_MONOTONIC ns of the last update
+
+		// errors, driver specific where noted
+		uint64_t numXruns; // device over- and underruns (Null driver: late timer periods)
+		uint64_t numRecoveries; // ALSA: xrun recoveries and reconfigurations
+		uint64_t framesLost;
+		int32_t maxDelayCapture, maxDelayPlayback; // ALSA: frames
+		uint64_t numLateActions;
+		uint64_t numActionOverflows; // scheduled actions run right away, the queue was full
+		uint64_t numCommitFailures; // observer windows dropped, all observers
+
+		// timing (CallbackStats stages), ns
+		struct Stage {
+			uint64_t last, max, sum;
+		} stages[CallbackStats::NUM_STAGES];
+		uint64_t jitterLast, jitterMax, jitterSum;
+		uint32_t load, loadMax; // 1/100 % of the period
+
+		// registry, indexed by driver slot, empty name = free slot
+		uint32_t numBuffers, numObservers;
+		struct Buffer {
+			char name[MAX_NAME];
+			uint32_t channels, size;
+			uint32_t isOutput;
+			uint64_t nsSum; // time spent routing this slot, all periods
+		} buffers[MAX_ENTRIES];
+		struct Observer {
+			uint32_t used;
+			uint32_t numBuffers;
+			uint32_t hopSize;
+			uint64_t windowEnd; // last committed window
+			uint64_t numLost;
+		} observers[MAX_ENTRIES];
+	};
+
+	/*
+	 * POSIX shared-memory segment /dev/shm/autil-<name> holding a TelemetryData behind a seqlock.
+	 * The writer (the audio thread) only stores to the mapping, no syscalls after construction;
+	 * readers copy the data and retry while the sequence is odd or changed.
+	 * Bump VERSION on any layout change of TelemetryData.
+	 */
+	class TelemetrySegment {
+	public:
+		static const uint32_t MAGIC = 0x4d4c5441; // "ATLM"
+		static const uint32_t VERSION = 2;
+
+		struct Layout {
+			uint32_t magic, version;
+			uint32_t size; // sizeof(Layout)
+			int32_t pid;
+			char driver[TelemetryData::MAX_NAME];
+			std::atomic<uint64_t> seq; // odd while written
+			TelemetryData data;
+		};
+
+		// writer: creates (replaces) the segment, unlinked again on destruction
+		TelemetrySegment(const std::string &name, const std::string &driver);
+		~TelemetrySegment();
+
+		inline const std::string &getName() const { return m_name; }
+
+		// writer, audio thread
+		inline TelemetryData &beginWrite() {
+			uint64_t s = m_layout->seq.load(std::memory_order_relaxed);
+			m_layout->seq.store(s + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			return m_layout->data;
+		}
+		inline void endWrite() {
+			uint64_t s = m_layout->seq.load(std::memory_order_relaxed);
+			m_layout->seq.store(s + 1, std::memory_order_release);
+		}
+
+		// segment path for a driver name ("/autil-<name>")
+		static std::string path(const std::string &name);
+
+	private:
+		std::string m_name;
+		ShmSegment *m_segment;
+		Layout *m_layout;
+	};
+
+	/*
+	 * Read side, attaches to the segment of a running driver (in this or another process).
+	 */
+	class TelemetryReader {
+	public:
+		// throws if the segment does not exist or has another layout version
+		TelemetryReader(const std::string &name);
+		~TelemetryReader();
+
+		inline const std::string &getDriver() const { return m_driver; }
+		inline int getPid() const { return m_pid; }
+
+		// consistent copy of the current data, false if the writer kept the segment busy
+		bool read(TelemetryData &data, int maxRetries = 1000) const;
+
+		// names of all published segments
+		static std::vector<std::string> list();
+
+	private:
+		std::string m_driver;
+		int m_pid;
+		const TelemetrySegment::Layout *m_layout;
+	};
+}
@@ -0,0 +1,166 @@
+/*
+ * autil-clocksync: run a ClockSyncServer or a ClockSync client under artificial network conditions
+ *
+ *   autil-clocksync server [options]           serve the reference clock
+ *   autil-clocksync client <host> [options]    sync to a server, print offset, error bound and rate every second
+ *   autil-clocksync [options]                  both on this host: forks a server (default skew 2.5 s, +80 ppm)
+ *                                              and syncs to it, also printing the actual error against the skew
+ *
+ *   --port n          UDP port (default 45710)
+ *   --delay ms        hold every outgoing packet of this side ms ...
+ *   --jitter ms       ... plus [0, ms) ...
+ *   --loss p          ... and drop it with probability p (both sides in the local run)
+ *   --offset ms       server: serve its clock shifted by ms ...
+ *   --ppm ppm         ... and running ppm fast
+ *   --interval ms     client: exchange period (default 100)
+ *   --seconds n       stop after n seconds (default: until interrupted, 20 in the local run)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <stdexcept>
+
+#include "clock_sync.h"
+#include "dll_clock.h"
+
+using namespace autil;
+
+static volatile bool running = true;
+
+static void onSignal(int)
+{
+	running = false;
+}
+
+struct Options {
+	int port;
+	NetImpairment impairment;
+	double offsetMs, ppm;
+	int intervalMs;
+	int seconds;
+
+	Options() : port(45710), offsetMs(0.0), ppm(0.0), intervalMs(100), seconds(0) {}
+};
+
+static void usage()
+{
+	fprintf(stderr, "usage: autil-clocksync server | client <host> | (local run) [--port n] [--delay ms] [--jitter ms]"
+		" [--loss p] [--offset ms] [--ppm ppm] [--interval ms] [--seconds n]\n");
+}
+
+// false on an unknown option or a missing value
+static bool parseOptions(int argc, char **argv, int first, Options &o)
+{
+	for (int i = first; i < argc; i++) {
+		if (i + 1 >= argc)
+			return false;
+		const char *name = argv[i];
+		double v = atof(argv[++i]);
+		if (strcmp(name, "--port") == 0) o.port = (int)v;
+		else if (strcmp(name, "--delay") == 0) o.impairment.delayMs = v;
+		else if (strcmp(name, "--jitter") == 0) o.impairment.jitterMs = v;
+		else if (strcmp(name, "--loss") == 0) o.impairment.loss = v;
+		else if (strcmp(name, "--offset") == 0) o.offsetMs = v;
+		else if (strcmp(name, "--ppm") == 0) o.ppm = v;
+		else if (strcmp(name, "--interval") == 0) o.intervalMs = (int)v;
+		else if (strcmp(name, "--seconds") == 0) o.seconds = (int)v;
+		else return false;
+	}
+	return o.port > 0 && o.port <= 0xffff && o.intervalMs > 0;
+}
+
+static int serve(const Options &o)
+{
+	ClockSyncServer server(o.port);
+	server.setClockSkew((int64_t)llround(o.offsetMs * 1e6), o.ppm);
+	server.setImpairment(o.impairment);
+
+	for (int s = 0; running && (o.seconds <= 0 || s < o.seconds); s++)
+		sleep(1);
+	printf("served %llu requests\n", (unsigned long long)server.getNumRequests());
+	return 0;
+}
+
+// skewed: the server's skew is known (local run), also print the actual error
+static int sync(const std::string &host, const Options &o, bool skewed)
+{
+	ClockSync client(host, o.port, o.intervalMs);
+	client.setImpairment(o.impairment);
+
+	int64_t offsetNs = (int64_t)llround(o.offsetMs * 1e6);
+	for (int s = 0; running && (o.seconds <= 0 || s < o.seconds); s++) {
+		sleep(1);
+		printf("%3ds %s offset %+.6f ms  bound %7.1f us  rate %+8.3f ppm  rtt %7.3f ms  exchanges %llu lost %llu steps %llu",
+			s + 1, client.isLocked() ? "locked  " : "unlocked", client.getOffsetNs() * 1e-6, client.getErrorNs() * 1e-3,
+			client.getRatePpm(), client.getRoundTripNs() * 1e-6, (unsigned long long)client.getNumExchanges(),
+			(unsigned long long)client.getNumLost(), (unsigned long long)client.getNumSteps());
+		if (skewed && client.isLocked()) {
+			// as ClockSyncServer::now()
+			int64_t t = DllClock::now();
+			int64_t reference = t + offsetNs + (int64_t)llround(o.ppm * 1e-6 * (double)t);
+			printf("  error %+7.1f us", (client.toReference(t) - reference) * 1e-3);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	return client.isLocked() ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	bool server = argc > 1 && strcmp(argv[1], "server") == 0;
+	bool client = argc > 1 && strcmp(argv[1], "client") == 0;
+	if (client && argc < 3) {
+		usage();
+		return 2;
+	}
+
+	Options o;
+	if (!parseOptions(argc, argv, server ? 2 : client ? 3 : 1, o)) {
+		usage();
+		return 2;
+	}
+
+	try {
+		if (server)
+			return serve(o);
+		if (client)
+			return sync(argv[2], o, false);
+
+		// local run: impair both directions
+		if (o.offsetMs == 0.0 && o.ppm == 0.0) {
+			o.offsetMs = 2500.0;
+			o.ppm = 80.0;
+		}
+		if (o.seconds <= 0)
+			o.seconds = 20;
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			Options so = o;
+			so.seconds = 0;
+			_exit(serve(so));
+		}
+		usleep(100000);
+		int status = sync("127.0.0.1", o, true);
+		kill(pid, SIGTERM);
+		waitpid(pid, nullptr, 0);
+		return status;
+	}
+	catch (const std::exception &ex) {
+		fprintf(stderr, "%s\n", ex.what());
+		return 1;
+	}
+}
@@ -0,0 +1,165 @@
+/*
+ * autil-netloop: end to end check of AudioDriverNet between processes on this host
+ *
+ *   autil-netloop send <port> [rate] [channels]     AudioDriverNull paced at rate (default 48000) streaming a
+ *                                                   1 kHz sine (Float32 wire packets) to 127.0.0.1:<port>
+ *   autil-netloop receive <port> [port ..]          AudioDriverNet on the ports (2 channels each) at 48000, the
+ *                                                   first clocks the periods, prints ratio, fill and underruns
+ *                                                   every second
+ *   autil-netloop [seconds]                         both: forks a sender at 48000 and one at 48048 (+1000 ppm),
+ *                                                   receives them for seconds (default 10), exit status 1 if a
+ *                                                   stream did not arrive
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "audio_driver_null.h"
+#include "audio_driver_net.h"
+#include "udp_receiver.h"
+#include "signal_buffer.h"
+
+using namespace autil;
+
+static const int RATE = 48000;
+static const int DEMO_PORT = 45790;
+
+static volatile bool running = true;
+
+static void onSignal(int)
+{
+	running = false;
+}
+
+static int send(int port, int rate, int channels, int seconds)
+{
+	AudioDriverNull::StreamProperties props;
+	props.clock = AudioDriverNull::Clock::Paced;
+	props.captureSource = AudioDriverNull::CaptureSource::Loopback;
+	props.sampleRate = rate;
+	props.blockSize = 128;
+	props.numChannelsCapture = props.numChannelsPlayback = channels;
+	AudioDriverNull driver("netloop send", props);
+
+	// one second of a 1 kHz sine loops seamlessly, played back and captured by the loopback
+	SignalBuffer out("tone", channels, RATE), in("stream", channels, 4096);
+	for (int c = 0; c < channels; c++) {
+		for (int i = 0; i < RATE; i++)
+			out.m_timeQueue[(size_t)c * RATE + i] = 0.5f * sinf((float)(2.0 * M_PI * 1000.0 * i / RATE) + c);
+	}
+	in.setDebugReceiver("127.0.0.1", port, wire::PayloadType::Float32);
+
+	AudioDriverBase::Request(&driver).addBuffer(&out, AudioDriverBase::Connect::ToPlayback)
+		.addBuffer(&in, AudioDriverBase::Connect::ToCapture).execute();
+	printf("sending %d ch at %d Hz to 127.0.0.1:%d\n", channels, rate, port);
+	fflush(stdout);
+
+	for (int s = 0; running && (seconds <= 0 || s < seconds); s++)
+		sleep(1);
+
+	AudioDriverBase::Request(&driver).remove(&in).remove(&out).execute();
+	return 0;
+}
+
+static int receive(const std::vector<int> &ports, int seconds)
+{
+	AudioDriverNet::StreamProperties props;
+	for (int port : ports)
+		props.sources.push_back(AudioDriverNet::Source(port, 2));
+	props.sampleRate = RATE;
+	props.blockSize = 256;
+	AudioDriverNet driver("netloop receive", props);
+
+	SignalBuffer capture("capture", 2 * (uint32_t)ports.size(), 4096);
+	AudioDriverBase::Request(&driver).addBuffer(&capture, AudioDriverBase::Connect::ToCapture).execute();
+
+	for (int s = 0; running && (seconds <= 0 || s < seconds); s++) {
+		sleep(1);
+		printf("%3ds", s + 1);
+		for (int i = 0; i < driver.getNumSources(); i++) {
+			const UdpReceiver &rx = driver.getReceiver(i);
+			printf("  | :%d ratio %.6f fill %4u underruns %llu dropped %llu concealed %llu",
+				ports[i], driver.getClockRatio(i), driver.getBufferedFrames(i),
+				(unsigned long long)driver.getNumUnderruns(i), (unsigned long long)driver.getNumDroppedChunks(i),
+				(unsigned long long)rx.getNumConcealedFrames());
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	int status = 0;
+	for (int i = 0; i < driver.getNumSources(); i++) {
+		if (driver.getReceiver(i).getFramesWritten() == 0) {
+			printf("nothing received on port %d\n", ports[i]);
+			status = 1;
+		}
+	}
+
+	AudioDriverBase::Request(&driver).remove(&capture).execute();
+	return status;
+}
+
+static int demo(int seconds)
+{
+	// the senders outlive the receiver by a second, so its last report sees no gap
+	int rates[2] = { RATE, RATE + RATE / 1000 };
+	pid_t pids[2];
+	for (int i = 0; i < 2; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pids[i] == 0)
+			_exit(send(DEMO_PORT + i, rates[i], 2, seconds + 1));
+	}
+
+	int status = receive({ DEMO_PORT, DEMO_PORT + 1 }, seconds);
+	for (int i = 0; i < 2; i++) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], nullptr, 0);
+	}
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	try {
+		if (argc > 2 && strcmp(argv[1], "send") == 0) {
+			int rate = argc > 3 ? atoi(argv[3]) : RATE;
+			int channels = argc > 4 ? atoi(argv[4]) : 2;
+			if (rate <= 0 || channels <= 0) {
+				fprintf(stderr, "invalid rate or channels\n");
+				return 2;
+			}
+			return send(atoi(argv[2]), rate, channels, 0);
+		}
+		if (argc > 2 && strcmp(argv[1], "receive") == 0) {
+			std::vector<int> ports;
+			for (int i = 2; i < argc; i++)
+				ports.push_back(atoi(argv[i]));
+			return receive(ports, 0);
+		}
+		if (argc > 1 && (strcmp(argv[1], "send") == 0 || strcmp(argv[1], "receive") == 0)) {
+			fprintf(stderr, "usage: autil-netloop send <port> [rate] [channels] | receive <port> [port ..] | [seconds]\n");
+			return 2;
+		}
+		int seconds = argc > 1 ? atoi(argv[1]) : 0;
+		return demo(seconds > 0 ? seconds : 10);
+	}
+	catch (const std::exception &ex) {
+		fprintf(stderr, "%s\n", ex.what());
+		return 1;
+	}
+}
@@ -0,0 +1,148 @@
+/*
+ * autil-telemetry: live view of the driver state published with AudioDriverBase::enableTelemetry()
+ *
+ *   autil-telemetry                  list published drivers
+ *   autil-telemetry <name> [ms]      refresh every ms (default 1000)
+ *   autil-telemetry <name> once      print once and exit
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <string>
+#include <stdexcept>
+
+#include "telemetry.h"
+#include "callback_stats.h"
+
+using namespace autil;
+
+static volatile bool running = true;
+
+static void onSignal(int)
+{
+	running = false;
+}
+
+static bool processAlive(int pid)
+{
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static int listDrivers()
+{
+	auto names = TelemetryReader::list();
+	if (names.empty()) {
+		printf("no drivers publish telemetry\n");
+		return 1;
+	}
+	for (auto &name : names) {
+		try {
+			TelemetryReader reader(name);
+			printf("%-24s driver %-24s pid %d%s\n", name.c_str(), reader.getDriver().c_str(), reader.getPid(),
+				processAlive(reader.getPid()) ? "" : " (stale)");
+		}
+		catch (const std::exception &ex) {
+			printf("%-24s %s\n", name.c_str(), ex.what());
+		}
+	}
+	return 0;
+}
+
+// means over the refresh interval, from the difference of two reads
+static void show(const TelemetryReader &reader, const TelemetryData &t, const TelemetryData &prev)
+{
+	uint64_t periods = t.numPeriods - prev.numPeriods;
+	double periodUs = t.sampleRate ? 1e6 * t.period / t.sampleRate : 0.0;
+
+	printf("%s (pid %d)%s\n", reader.getDriver().c_str(), reader.getPid(),
+		processAlive(reader.getPid()) ? "" : " not running");
+	printf("  %s%s%s  %d Hz  block %d  period %d (%.0f us)  in %d  out %d\n",
+		t.running ? "running" : "stopped", t.paused ? " paused" : "", t.freewheel ? " freewheel" : "",
+		t.sampleRate, t.blockSize, t.period, periodUs, t.numChannelsCapture, t.numChannelsPlayback);
+	printf("  frame %llu  periods %llu (+%llu)\n", (unsigned long long)t.frame,
+		(unsigned long long)t.numPeriods, (unsigned long long)periods);
+	printf("  xruns %llu  recoveries %llu  frames lost %llu  late actions %llu  action overflows %llu  commit failures %llu\n",
+		(unsigned long long)t.numXruns, (unsigned long long)t.numRecoveries, (unsigned long long)t.framesLost,
+		(unsigned long long)t.numLateActions, (unsigned long long)t.numActionOverflows, (unsigned long long)t.numCommitFailures);
+	if (t.maxDelayCapture || t.maxDelayPlayback)
+		printf("  max delay capture %d  playback %d\n", t.maxDelayCapture, t.maxDelayPlayback);
+
+	printf("  load %5.1f%%  max %5.1f%%\n", t.load * 1e-2, t.loadMax * 1e-2);
+	printf("  %-12s %10s %10s %10s\n", "us", "last", "mean", "max");
+	for (int s = 0; s < CallbackStats::NUM_STAGES; s++) {
+		double mean = periods ? 1e-3 * (t.stages[s].sum - prev.stages[s].sum) / periods : 0.0;
+		printf("  %-12s %10.1f %10.1f %10.1f\n", CallbackStats::stageName(s),
+			t.stages[s].last * 1e-3, mean, t.stages[s].max * 1e-3);
+	}
+	double jitterMean = periods ? 1e-3 * (t.jitterSum - prev.jitterSum) / periods : 0.0;
+	printf("  %-12s %10.1f %10.1f %10.1f\n", "jitter", t.jitterLast * 1e-3, jitterMean, t.jitterMax * 1e-3);
+
+	if (t.numBuffers) {
+		printf("  buffers\n");
+		for (int i = 0; i < TelemetryData::MAX_ENTRIES; i++) {
+			auto &b = t.buffers[i];
+			if (!b.name[0])
+				continue;
+			double mean = periods ? 1e-3 * (b.nsSum - prev.buffers[i].nsSum) / periods : 0.0;
+			printf("  %2d %-24s %s %u ch  %u frames  %.1f us\n", i, b.name, b.isOutput ? "out" : "in ",
+				b.channels, b.size, mean);
+		}
+	}
+	if (t.numObservers) {
+		printf("  observers\n");
+		for (int i = 0; i < TelemetryData::MAX_ENTRIES; i++) {
+			auto &o = t.observers[i];
+			if (!o.used)
+				continue;
+			printf("  %2d %u buffers  hop %u  window end %llu  lost %llu\n", i, o.numBuffers, o.hopSize,
+				(unsigned long long)o.windowEnd, (unsigned long long)o.numLost);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		return listDrivers();
+
+	std::string name = argv[1];
+	bool once = argc > 2 && strcmp(argv[2], "once") == 0;
+	int intervalMs = (argc > 2 && !once) ? atoi(argv[2]) : 1000;
+	if (intervalMs <= 0)
+		intervalMs = 1000;
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	try {
+		TelemetryReader reader(name);
+		TelemetryData t, prev;
+		memset(&prev, 0, sizeof(prev));
+		bool tty = isatty(STDOUT_FILENO);
+
+		while (running) {
+			if (!reader.read(t)) {
+				printf("telemetry segment busy\n");
+			}
+			else {
+				if (tty && !once)
+					printf("\033[H\033[2J");
+				show(reader, t, prev);
+				fflush(stdout);
+				prev = t;
+			}
+			if (once)
+				break;
+			usleep(intervalMs * 1000);
+		}
+	}
+	catch (const std::exception &ex) {
+		fprintf(stderr, "%s\n", ex.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "tracer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace autil {
+	thread_local Tracer::Ring *Tracer::t_ring = nullptr;
+
+	Tracer::Tracer()
+	{
+		m_t0Ticks = now();
+		m_t0Ns = DllClock::now();
+	}
+
+	Tracer &Tracer::instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	Tracer::Ring *Tracer::registerThread(const char *name)
+	{
+		Tracer &tracer = instance();
+
+		if (!t_ring) {
+			Ring *r = new Ring();
+			memset(r->thread, 0, sizeof(r->thread));
+			r->head.store(0, std::memory_order_relaxed);
+			r->tail.store(0, std::memory_order_relaxed);
+#ifdef __linux__
+			r->tid = (uint64_t)syscall(SYS_gettid);
+#else
+			r->tid = (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+			snprintf(r->thread, sizeof(r->thread), "thread %llu", (unsigned long long)r->tid);
+
+			RttLocalLock ll(tracer.m_mtx);
+			tracer.m_rings.push_back(r);
+			t_ring = r;
+		}
+
+		if (name) {
+			RttLocalLock ll(tracer.m_mtx);
+			strncpy(t_ring->thread, name, sizeof(t_ring->thread) - 1);
+		}
+		return t_ring;
+	}
+
+	void Tracer::clear()
+	{
+		RttLocalLock ll(m_mtx);
+		for (auto r : m_rings)
+			r->tail.store(r->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+	}
+
+	bool Tracer::writeChromeJson(const std::string &path, double seconds)
+	{
+		std::ofstream out(path);
+		if (!out)
+			return false;
+
+		// ticks -> CLOCK_MONOTONIC, linear between construction and now
+		uint64_t t1Ticks = now();
+		int64_t t1Ns = DllClock::now();
+		double nsPerTick = (t1Ticks > m_t0Ticks) ? (double)(t1Ns - m_t0Ns) / (double)(t1Ticks - m_t0Ticks) : 1.0;
+		auto toUs = [&](uint64_t t) { return (m_t0Ns + ((double)t - (double)m_t0Ticks) * nsPerTick) * 1e-3; };
+		double sinceUs = seconds > 0 ? t1Ns * 1e-3 - seconds * 1e6 : 0.0;
+
+		int pid = 0;
+#ifdef __linux__
+		pid = (int)getpid();
+#endif
+
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+		bool first = true;
+		char line[256];
+
+		RttLocalLock ll(m_mtx);
+		std::vector<Event> events;
+		for (auto r : m_rings) {
+			snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%llu,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",\n", pid, (unsigned long long)r->tid, r->thread);
+			out << line;
+			first = false;
+
+			// copy, then drop what the writer overwrote meanwhile
+			uint64_t head = r->head.load(std::memory_order_acquire);
+			uint64_t begin = (std::max)(r->tail.load(std::memory_order_relaxed), head > RING_SIZE ? head - RING_SIZE : 0);
+			events.resize(head - begin);
+			for (uint64_t i = begin; i < head; i++)
+				events[i - begin] = r->events[i & (RING_SIZE - 1)];
+			uint64_t headAfter = r->head.load(std::memory_order_acquire);
+			size_t skip = (headAfter > RING_SIZE && headAfter - RING_SIZE > begin) ? (size_t)(headAfter - RING_SIZE - begin) : 0;
+
+			int depth = 0; // end events whose begin was overwritten are dropped
+			for (size_t i = (std::min)(skip, events.size()); i < events.size(); i++) {
+				const Event &e = events[i];
+				double ts = toUs(e.t);
+				if (ts < sinceUs)
+					continue;
+				if (e.type == End && depth == 0)
+					continue;
+				depth += (e.type == Begin) ? 1 : (e.type == End) ? -1 : 0;
+
+				const char *ph = (e.type == Begin) ? "B" : (e.type == End) ? "E" : "i";
+				snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":%d,\"tid\":%llu,\"args\":{\"arg\":%u}}",
+					e.name, ph, (e.type == Instant) ? "\"s\":\"t\"," : "", ts, pid, (unsigned long long)r->tid, e.arg);
+				out << line;
+			}
+		}
+		out << "\n]}\n";
+		return (bool)out;
+	}
+}
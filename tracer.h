@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define AUTIL_TRACE_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define AUTIL_TRACE_TSC
+#endif
+
+#include <rtt/rtt.h>
+
+#include "dll_clock.h"
+
+namespace autil {
+	/*
+	 * Timeline of what the audio and control threads did, for post-mortem analysis of xruns.
+	 * Each thread writes timestamped begin/end/instant events into its own fixed-size ring
+	 * (overwriting the oldest), an event is a TSC read and four stores. The rings are dumped
+	 * after the fact as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+	 *
+	 * Compiled in with AUTIL_TRACE (CMake WITH_TRACE), the AUTIL_TRACE_* macros are empty otherwise.
+	 * Event names must be string literals (only the pointer is stored).
+	 */
+	class Tracer {
+	public:
+		enum Type : uint8_t { Begin, End, Instant };
+
+		struct Event {
+			uint64_t t; // ticks, see now()
+			const char *name;
+			uint32_t arg;
+			uint8_t type;
+		};
+
+		static const uint32_t RING_SIZE = 1 << 14; // events per thread
+
+		struct Ring {
+			char thread[32];
+			uint64_t tid;
+			std::atomic<uint64_t> head; // events written
+			std::atomic<uint64_t> tail; // first event after clear()
+			Event events[RING_SIZE];
+		};
+
+		static Tracer &instance();
+
+		// ring of the calling thread, allocated on first use. Call from a thread's setup
+		// (before it is real-time) to keep the allocation out of the first traced period.
+		static Ring *registerThread(const char *name);
+
+		static inline uint64_t now() {
+#ifdef AUTIL_TRACE_TSC
+			return __rdtsc();
+#else
+			return (uint64_t)DllClock::now();
+#endif
+		}
+
+		static inline void emit(Type type, const char *name, uint32_t arg = 0) {
+			Ring *r = t_ring ? t_ring : registerThread(nullptr);
+			uint64_t h = r->head.load(std::memory_order_relaxed);
+			Event &e = r->events[h & (RING_SIZE - 1)];
+			e.t = now();
+			e.name = name;
+			e.arg = arg;
+			e.type = type;
+			r->head.store(h + 1, std::memory_order_release);
+		}
+
+		// all rings as Chrome trace JSON, events of the last `seconds` only if > 0
+		bool writeChromeJson(const std::string &path, double seconds = 0.0);
+		// discard recorded events
+		void clear();
+
+	private:
+		Tracer();
+
+		static thread_local Ring *t_ring;
+
+		RttMutex m_mtx;
+		std::vector<Ring *> m_rings; // never freed, other threads may still write
+
+		// tick to CLOCK_MONOTONIC mapping, calibrated between construction and dump
+		uint64_t m_t0Ticks;
+		int64_t m_t0Ns;
+	};
+
+	// begin/end pair for a C++ scope
+	struct TraceScope {
+		const char *name;
+		uint32_t arg;
+		inline TraceScope(const char *name, uint32_t arg = 0) : name(name), arg(arg) { Tracer::emit(Tracer::Begin, name, arg); }
+		inline ~TraceScope() { Tracer::emit(Tracer::End, name, arg); }
+	};
+}
+
+#define AUTIL_TRACE_CAT2(a, b) a##b
+#define AUTIL_TRACE_CAT(a, b) AUTIL_TRACE_CAT2(a, b)
+
+#ifdef AUTIL_TRACE
+#define AUTIL_TRACE_THREAD(name) autil::Tracer::registerThread(name)
+#define AUTIL_TRACE_SCOPE(...) autil::TraceScope AUTIL_TRACE_CAT(_traceScope, __LINE__)(__VA_ARGS__)
+#define AUTIL_TRACE_BEGIN(name, ...) autil::Tracer::emit(autil::Tracer::Begin, name, ##__VA_ARGS__)
+#define AUTIL_TRACE_END(name, ...) autil::Tracer::emit(autil::Tracer::End, name, ##__VA_ARGS__)
+#define AUTIL_TRACE_INSTANT(name, ...) autil::Tracer::emit(autil::Tracer::Instant, name, ##__VA_ARGS__)
+#else
+#define AUTIL_TRACE_THREAD(name) ((void)0)
+#define AUTIL_TRACE_SCOPE(...) ((void)0)
+#define AUTIL_TRACE_BEGIN(name, ...) ((void)0)
+#define AUTIL_TRACE_END(name, ...) ((void)0)
+#define AUTIL_TRACE_INSTANT(name, ...) ((void)0)
+#endif
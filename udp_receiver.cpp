@@ -0,0 +1,327 @@
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "udp_receiver.h"
+#include "net.h"
+#include "signal_buffer.h"
+#include "dll_clock.h"
+
+namespace autil {
+	static const int IDLE_FLUSH_MS = 50; // hand on held blocks when the stream pauses
+	static const uint32_t SHRINK_AFTER_BLOCKS = 1000;
+	static const uint32_t FADE_FRAMES = 64;
+	static const uint32_t MAX_CONCEAL_FRAMES = 65536; // sink mode, a SignalBuffer conceals up to its size
+
+	UdpReceiver::UdpReceiver(int port, SignalBuffer *buffer, const std::string &bindAddress, int receiveBufferBytes, size_t maxPacketBytes)
+		: m_buffer(buffer), m_channels(buffer ? buffer->channels : 0), m_maxPacketBytes(maxPacketBytes), m_source(0), m_sourcePort(0), m_tSource(0),
+		m_reassembler([this](const wire::Reassembler::Block &block) { onBlock(block); }, 4),
+		m_minDepth(2), m_maxDepth(64), m_depth(4), m_blocksSinceLate(0), m_lateSeen(0),
+		m_started(false), m_nextFrame(0), m_timestampFrame(0),
+		m_framesWritten(0), m_numPackets(0), m_numBlocks(0), m_numTruncated(0), m_numForeign(0), m_numDecimated(0), m_numConcealed(0),
+		m_running(true)
+	{
+		if (!buffer)
+			throw std::invalid_argument("UdpReceiver needs a SignalBuffer");
+
+		open(port, bindAddress, receiveBufferBytes);
+		std::cout << "Receiving UDP stream on " << bindAddress << ":" << port << " into SignalBuffer [" << buffer->name << "]" << std::endl;
+		m_thread = new RttThread([this]() { receive(); }, false, "net receive");
+	}
+
+	UdpReceiver::UdpReceiver(int port, uint32_t channels, Sink sink, const std::string &bindAddress, int receiveBufferBytes, size_t maxPacketBytes)
+		: m_buffer(nullptr), m_sink(sink), m_channels(channels), m_maxPacketBytes(maxPacketBytes), m_source(0), m_sourcePort(0), m_tSource(0),
+		m_reassembler([this](const wire::Reassembler::Block &block) { onBlock(block); }, 4),
+		m_minDepth(2), m_maxDepth(64), m_depth(4), m_blocksSinceLate(0), m_lateSeen(0),
+		m_started(false), m_nextFrame(0), m_timestampFrame(0),
+		m_framesWritten(0), m_numPackets(0), m_numBlocks(0), m_numTruncated(0), m_numForeign(0), m_numDecimated(0), m_numConcealed(0),
+		m_running(true)
+	{
+		if (!sink || channels == 0)
+			throw std::invalid_argument("UdpReceiver needs a sink and channels");
+
+		open(port, bindAddress, receiveBufferBytes);
+		std::cout << "Receiving UDP stream on " << bindAddress << ":" << port << std::endl;
+		m_thread = new RttThread([this]() { receive(); }, false, "net receive");
+	}
+
+	void UdpReceiver::open(int port, const std::string &bindAddress, int receiveBufferBytes)
+	{
+		m_soc = openUdpReceiveSocket(bindAddress, port, receiveBufferBytes);
+
+		m_packets.resize(MAX_BATCH * m_maxPacketBytes);
+		m_last.assign(m_channels, 0.0f);
+		m_scratch.assign(m_channels * (size_t)FADE_FRAMES, 0.0f);
+	}
+
+	UdpReceiver::~UdpReceiver()
+	{
+		m_running = false;
+		delete m_thread;
+		close(m_soc);
+	}
+
+	void UdpReceiver::setDepth(uint32_t minDepth, uint32_t maxDepth)
+	{
+		if (minDepth == 0 || maxDepth < minDepth)
+			throw std::invalid_argument("invalid jitter buffer depth range");
+		RttLocalLock ll(m_mtxObservers);
+		m_minDepth = minDepth;
+		m_maxDepth = maxDepth;
+		m_depth = std::min(std::max(m_depth, minDepth), maxDepth);
+		m_reassembler.setMaxPending(m_depth);
+	}
+
+	void UdpReceiver::addObserver(SignalBufferObserver *observer)
+	{
+		RttLocalLock ll(m_mtxObservers);
+		m_observers.push_back(observer);
+	}
+
+	void UdpReceiver::removeObserver(SignalBufferObserver *observer)
+	{
+		RttLocalLock ll(m_mtxObservers);
+		m_observers.erase(std::remove(m_observers.begin(), m_observers.end(), observer), m_observers.end());
+	}
+
+	wire::Timestamp UdpReceiver::getTimestamp(uint64_t *frame) const
+	{
+		RttLocalLock ll(m_mtxObservers);
+		if (frame)
+			*frame = m_timestampFrame;
+		return m_timestamp;
+	}
+
+	void UdpReceiver::receive()
+	{
+		std::vector<struct sockaddr_in> from(MAX_BATCH);
+#if defined(__linux__)
+		std::vector<struct mmsghdr> msgs(MAX_BATCH);
+		std::vector<struct iovec> iov(MAX_BATCH);
+		for (int i = 0; i < MAX_BATCH; i++) {
+			iov[i].iov_base = &m_packets[i * m_maxPacketBytes];
+			iov[i].iov_len = m_maxPacketBytes;
+		}
+#endif
+
+		while (m_running) {
+			struct pollfd pfd;
+			pfd.fd = m_soc;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int r = poll(&pfd, 1, IDLE_FLUSH_MS);
+			if (r <= 0) {
+				RttLocalLock ll(m_mtxObservers);
+				if (m_reassembler.hasPending())
+					m_reassembler.flush();
+				continue;
+			}
+
+#if defined(__linux__)
+			// everything that arrived meanwhile with one call
+			for (int i = 0; i < MAX_BATCH; i++) {
+				memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &from[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			}
+			int n = recvmmsg(m_soc, msgs.data(), MAX_BATCH, MSG_DONTWAIT, nullptr);
+			if (n <= 0)
+				continue;
+
+			RttLocalLock ll(m_mtxObservers);
+			for (int i = 0; i < n; i++) {
+				if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					m_numTruncated++;
+					continue;
+				}
+				push(&m_packets[i * m_maxPacketBytes], msgs[i].msg_len, from[i].sin_addr.s_addr, from[i].sin_port);
+			}
+#else
+			RttLocalLock ll(m_mtxObservers);
+			for (int i = 0; i < MAX_BATCH; i++) {
+				socklen_t fromLen = sizeof(struct sockaddr_in);
+				ssize_t len = recvfrom(m_soc, (char *)m_packets.data(), m_maxPacketBytes + 1, MSG_DONTWAIT, (struct sockaddr *)&from[0], &fromLen);
+				if (len < 0)
+					break;
+				if ((size_t)len > m_maxPacketBytes) {
+					m_numTruncated++;
+					continue;
+				}
+				push(m_packets.data(), (size_t)len, from[0].sin_addr.s_addr, from[0].sin_port);
+			}
+#endif
+		}
+		RttLocalLock ll(m_mtxObservers);
+		m_reassembler.flush();
+	}
+
+	void UdpReceiver::push(const uint8_t *packet, size_t bytes, uint32_t source, uint16_t sourcePort)
+	{
+		int64_t t = DllClock::now();
+		if (m_source != 0 && (source != m_source || sourcePort != m_sourcePort)) {
+			if (t - m_tSource < (int64_t)SOURCE_TIMEOUT_MS * 1000000) {
+				m_numForeign++;
+				return;
+			}
+			// the sender went silent: follow the new one from its first block
+			std::cout << "UdpReceiver: switching to a new sender" << std::endl;
+			m_reassembler.restart();
+			m_source = 0;
+		}
+		if (m_source == 0) {
+			m_source = source;
+			m_sourcePort = sourcePort;
+		}
+		m_tSource = t;
+
+		m_numPackets++;
+		m_reassembler.push(packet, bytes);
+		adaptDepth();
+	}
+
+	void UdpReceiver::adaptDepth()
+	{
+		// a late fragment arrived after its block was written: hold incomplete blocks longer
+		if (m_reassembler.getNumLate() != m_lateSeen) {
+			m_lateSeen = m_reassembler.getNumLate();
+			m_blocksSinceLate = 0;
+			if (m_depth < m_maxDepth) {
+				m_depth = std::min(m_depth * 2, m_maxDepth);
+				m_reassembler.setMaxPending(m_depth);
+			}
+		}
+		else if (m_blocksSinceLate >= SHRINK_AFTER_BLOCKS && m_depth > m_minDepth) {
+			m_blocksSinceLate = 0;
+			m_reassembler.setMaxPending(--m_depth);
+		}
+	}
+
+	void UdpReceiver::onBlock(const wire::Reassembler::Block &block)
+	{
+		// a preview does not continue the full rate stream
+		if (block.decimation != 1) {
+			m_numDecimated++;
+			return;
+		}
+
+		m_numBlocks++;
+		m_blocksSinceLate++;
+
+		if (block.channels != m_channels && m_numBlocks == 1)
+			std::cout << "UdpReceiver: stream has " << block.channels << " channels, expected " << m_channels << std::endl;
+
+		// overlapping blocks (e.g. ObserverPublisher windows with hop < window): only the frames past the stream
+		uint32_t skip = 0;
+		if (m_started && block.frame < m_nextFrame && block.frame + block.frames >= m_nextFrame)
+			skip = (uint32_t)(m_nextFrame - block.frame);
+
+		uint64_t concealLimit = m_buffer ? m_buffer->size : MAX_CONCEAL_FRAMES;
+		if (m_started && block.frame > m_nextFrame && block.frame - m_nextFrame <= concealLimit) {
+			conceal(block.frame - m_nextFrame);
+		}
+		else if (skip == 0 && (!m_started || block.frame != m_nextFrame)) {
+			// first block, sender restarted or paused longer than the buffer: continue from its frame without filling
+			if (m_started)
+				std::cout << "UdpReceiver: stream jumped from frame " << m_nextFrame << " to " << block.frame << std::endl;
+			m_started = true;
+			m_nextFrame = block.frame;
+			for (auto o : m_observers)
+				o->lastUpdate = (uint64_t)-1; // new hop grid
+		}
+
+		if (block.timestamp.valid()) {
+			m_timestamp = block.timestamp;
+			m_timestampFrame = block.frame;
+		}
+		if (skip < block.frames)
+			write(block.samples.data() + skip, block.channels, block.frames, block.frames - skip);
+
+		uint32_t nc = std::min(block.channels, m_channels);
+		for (uint32_t c = 0; c < nc; c++)
+			m_last[c] = block.frames ? block.samples[(size_t)c * block.frames + block.frames - 1] : 0.0f;
+	}
+
+	void UdpReceiver::conceal(uint64_t frames)
+	{
+		m_numConcealed += frames;
+
+		// fade from the last sample to silence (no click), then silence
+		uint32_t fade = (uint32_t)std::min<uint64_t>(frames, FADE_FRAMES);
+		for (uint32_t c = 0; c < m_channels; c++) {
+			float *out = &m_scratch[(size_t)c * fade];
+			for (uint32_t i = 0; i < fade; i++)
+				out[i] = m_last[c] * (float)(fade - 1 - i) / (float)fade;
+			m_last[c] = 0.0f;
+		}
+		write(m_scratch.data(), m_channels, fade, fade);
+		if (frames > fade)
+			write(nullptr, 0, 0, (uint32_t)(frames - fade));
+	}
+
+	void UdpReceiver::write(const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames)
+	{
+		if (m_sink) {
+			m_sink(samples, numChannels, stride, frames, m_nextFrame);
+			m_framesWritten += frames;
+			m_nextFrame += frames;
+			return;
+		}
+
+		uint32_t done = 0;
+		while (done < frames) {
+			uint64_t frame = m_nextFrame;
+
+			// split at the next observer commit point, so each commit stages the window ending on its hop grid
+			uint32_t n = std::min(frames - done, m_buffer->size);
+			for (auto o : m_observers) {
+				if (o->lastUpdate == (uint64_t)-1 || o->updateInterval == (uint32_t)-1)
+					continue;
+				uint64_t next = o->lastUpdate + o->updateInterval;
+				if (next > frame && next - frame < n)
+					n = (uint32_t)(next - frame);
+			}
+
+			if (samples && numChannels >= m_buffer->channels) {
+				for (uint32_t c = 0; c < m_buffer->channels; c++)
+					m_buffer->addBlock(c, const_cast<float *>(samples) + (size_t)c * stride + done, n);
+			}
+			else {
+				// fewer channels than the buffer (or silence): clear the period, then copy what there is
+				uint32_t pos = m_buffer->m_timeQueuePointer;
+				m_buffer->skip(n, true);
+				uint32_t ringSize = m_buffer->size + m_buffer->delay;
+				for (uint32_t c = 0; samples && c < numChannels; c++) {
+					const float *src = samples + (size_t)c * stride + done;
+					uint32_t untilEnd = std::min(n, ringSize - pos);
+					memcpy(m_buffer->getPtrTQ(c, pos), src, untilEnd * sizeof(float));
+					memcpy(m_buffer->getPtrTQ(c), src + untilEnd, (n - untilEnd) * sizeof(float));
+				}
+			}
+
+			done += n;
+			m_framesWritten += n;
+			m_nextFrame = frame + n;
+
+			for (auto o : m_observers) {
+				if (o->lastUpdate == (uint64_t)-1)
+					o->lastUpdate = frame;
+				if (o->updateInterval == (uint32_t)-1 || m_nextFrame < o->lastUpdate + o->updateInterval)
+					continue;
+				o->lastUpdate = m_nextFrame;
+				// queued observers count their losses, single slot ones drop the window while the consumer is busy
+				o->commit(m_nextFrame);
+			}
+		}
+	}
+}
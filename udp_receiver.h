@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <rtt/rtt.h>
+
+#include "wire_format.h"
+
+class SignalBuffer;
+class SignalBufferObserver;
+
+namespace autil {
+
+	/*
+	 * Receives a wire format stream (UdpSocket::sendFrames(), DebugStream) and reconstructs it into a
+	 * local SignalBuffer. Observers added here are committed on their hop grid like on a driver, so
+	 * analysis code runs unchanged on a remote stream.
+	 *
+	 * A receiver thread reads datagrams in batches (recvmmsg() on Linux) into preallocated buffers.
+	 * The wire::Reassembler is the jitter buffer: blocks are written in sequence order, a block with
+	 * missing fragments is held until it completes or `depth` newer blocks arrived. The depth adapts:
+	 * doubled on every late fragment, reduced by one after a run of blocks without. Missing slices
+	 * are zero, lost blocks (frame gaps) fade out from the last sample. The buffer follows the sender's
+	 * frame clock, observer windows are stamped with sender frames. Blocks overlapping frames already
+	 * written (ObserverPublisher windows with hop < window) continue the stream with their newer frames.
+	 * Block timestamps (time of the first frame on a ClockSync timebase) are kept for getTimestamp().
+	 *
+	 * Instead of a SignalBuffer the stream can go to a Sink (e.g. AudioDriverNet), called from the
+	 * receiver thread with consecutive frames, concealed ones included (samples == nullptr: silence).
+	 *
+	 * One stream per port: datagrams from other sources than the current sender are dropped. Once the
+	 * sender was silent for SOURCE_TIMEOUT_MS the next one is adopted (e.g. a restarted sender on a new port).
+	 * A multicast bindAddress joins the group, any number of receivers on a host can subscribe to it.
+	 */
+	class UdpReceiver {
+	public:
+		static const int MAX_BATCH = 64; // datagrams per recvmmsg()
+		static const int SOURCE_TIMEOUT_MS = 500;
+
+		// planar frames, channel c at samples + c * stride
+		typedef std::function<void(const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames, uint64_t frame)> Sink;
+
+		UdpReceiver(int port, SignalBuffer *buffer, const std::string &bindAddress = "0.0.0.0",
+			int receiveBufferBytes = 4 * 1024 * 1024, size_t maxPacketBytes = 9000);
+		UdpReceiver(int port, uint32_t channels, Sink sink, const std::string &bindAddress = "0.0.0.0",
+			int receiveBufferBytes = 4 * 1024 * 1024, size_t maxPacketBytes = 9000);
+		~UdpReceiver();
+
+		// jitter buffer depth range in blocks
+		void setDepth(uint32_t minDepth, uint32_t maxDepth);
+		inline uint32_t getDepth() const { return m_depth; }
+
+		void addObserver(SignalBufferObserver *observer);
+		void removeObserver(SignalBufferObserver *observer);
+
+		// frames written to the buffer (received and concealed)
+		inline uint64_t getFramesWritten() const { return m_framesWritten; }
+		// sender frame clock: frame of the next sample written, observer windows are stamped with it
+		inline uint64_t getFrame() const { return m_nextFrame; }
+		inline uint64_t getNumPackets() const { return m_numPackets; }
+		inline uint64_t getNumBlocks() const { return m_numBlocks; }
+		inline uint64_t getNumIncomplete() const { return m_reassembler.getNumIncomplete(); }
+		inline uint64_t getNumLate() const { return m_reassembler.getNumLate(); }
+		inline uint64_t getNumMalformed() const { return m_reassembler.getNumMalformed() + m_numTruncated; }
+		inline uint64_t getNumForeign() const { return m_numForeign; }
+		// reduced rate previews (wire::Header::decimation > 1), skipped
+		inline uint64_t getNumDecimated() const { return m_numDecimated; }
+		// frames of lost blocks filled by concealment
+		inline uint64_t getNumConcealedFrames() const { return m_numConcealed; }
+		// time of the latest timestamped block (invalid if none yet) and its sender frame, see ClockSync
+		wire::Timestamp getTimestamp(uint64_t *frame = nullptr) const;
+
+	private:
+		int m_soc;
+		SignalBuffer *m_buffer;
+		Sink m_sink;
+		uint32_t m_channels;
+		size_t m_maxPacketBytes;
+		std::vector<uint8_t> m_packets; // MAX_BATCH x m_maxPacketBytes
+		uint32_t m_source; // IPv4 address and port of the sender, 0 until the first packet
+		uint16_t m_sourcePort;
+		int64_t m_tSource; // DllClock::now() of its last datagram
+
+		wire::Reassembler m_reassembler;
+		uint32_t m_minDepth, m_maxDepth, m_depth;
+		uint32_t m_blocksSinceLate;
+		uint64_t m_lateSeen;
+
+		bool m_started;
+		volatile uint64_t m_nextFrame; // sender frame of the next sample to write
+		std::vector<float> m_last; // last sample per channel, start of the fade-out
+		std::vector<float> m_scratch; // fade-out
+
+		mutable RttMutex m_mtxObservers; // also guards the receiver state below
+		std::vector<SignalBufferObserver *> m_observers;
+		wire::Timestamp m_timestamp;
+		uint64_t m_timestampFrame;
+
+		volatile uint64_t m_framesWritten, m_numPackets, m_numBlocks, m_numTruncated, m_numForeign, m_numDecimated, m_numConcealed;
+
+		volatile bool m_running;
+		RttThread *m_thread;
+
+		void open(int port, const std::string &bindAddress, int receiveBufferBytes);
+		void receive();
+		void push(const uint8_t *packet, size_t bytes, uint32_t source, uint16_t sourcePort);
+		void onBlock(const wire::Reassembler::Block &block);
+		void adaptDepth();
+		// write planar frames (channel c at c * stride, nullptr: silence) to the buffer, committing observers on their grid
+		void write(const float *samples, uint32_t numChannels, uint32_t stride, uint32_t frames);
+		void conceal(uint64_t frames);
+	};
+}
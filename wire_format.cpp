@@ -0,0 +1,464 @@
+#include "wire_format.h"
+
+#include <string.h>
+#include <cmath>
+#include <algorithm>
+
+namespace autil {
+namespace wire {
+	// payload samples are stored in host order, all supported targets are little endian
+
+	static const int RICE_PARTITION = 32;
+	static const int RICE_ESCAPE = 24; // unary quotient limit, followed by the raw 32-bit value
+	static const int CHUNK = 256; // samples transformed per pass, multiple of RICE_PARTITION
+
+	const char *payloadName(PayloadType type)
+	{
+		switch (type) {
+		case PayloadType::Legacy: return "legacy";
+		case PayloadType::Int8: return "int8";
+		case PayloadType::Int16: return "int16";
+		case PayloadType::Float32: return "float32";
+		case PayloadType::RiceDelta: return "rice";
+		}
+		return "?";
+	}
+
+	void writeHeader(const Header &h, uint8_t *dst)
+	{
+		put32(dst + 0, MAGIC);
+		dst[4] = VERSION;
+		dst[5] = (uint8_t)h.payload;
+		put16(dst + 6, h.channels);
+		put32(dst + 8, h.frames);
+		put32(dst + 12, h.payloadBytes);
+		put64(dst + 16, h.sequence);
+		put64(dst + 24, h.frame);
+		put32(dst + 32, h.offset);
+		put32(dst + 36, h.blockFrames);
+		put16(dst + 40, h.firstChannel);
+		put16(dst + 42, h.totalChannels);
+		put16(dst + 44, h.fragment);
+		put16(dst + 46, h.numFragments);
+		put64(dst + 48, (uint64_t)h.timestamp.time);
+		put32(dst + 56, h.timestamp.clock);
+		put32(dst + 60, h.timestamp.error);
+		put32(dst + 64, h.decimation);
+		put32(dst + 68, 0);
+	}
+
+	bool readHeader(const uint8_t *src, size_t bytes, Header &h)
+	{
+		if (bytes < HEADER_BYTES || get32(src) != MAGIC || src[4] != VERSION)
+			return false;
+		h.payload = (PayloadType)src[5];
+		h.channels = get16(src + 6);
+		h.frames = get32(src + 8);
+		h.payloadBytes = get32(src + 12);
+		h.sequence = get64(src + 16);
+		h.frame = get64(src + 24);
+		h.offset = get32(src + 32);
+		h.blockFrames = get32(src + 36);
+		h.firstChannel = get16(src + 40);
+		h.totalChannels = get16(src + 42);
+		h.fragment = get16(src + 44);
+		h.numFragments = get16(src + 46);
+		h.timestamp.time = (int64_t)get64(src + 48);
+		h.timestamp.clock = get32(src + 56);
+		h.timestamp.error = get32(src + 60);
+		h.decimation = get32(src + 64);
+		return h.payload >= PayloadType::Int8 && h.payload <= PayloadType::RiceDelta
+			&& h.channels > 0 && (uint32_t)h.firstChannel + h.channels <= h.totalChannels
+			&& (uint64_t)h.offset + h.frames <= h.blockFrames
+			&& h.fragment < h.numFragments && h.decimation > 0;
+	}
+
+	size_t maxPayloadBytes(PayloadType type, uint32_t channels, uint32_t frames)
+	{
+		switch (type) {
+		case PayloadType::Int8: return channels * (4 + (size_t)frames);
+		case PayloadType::Int16: return channels * (4 + 2 * (size_t)frames);
+		case PayloadType::Float32:
+		case PayloadType::RiceDelta: return channels * 4 * (size_t)frames; // RiceDelta never exceeds raw
+		default: return 0;
+		}
+	}
+
+	static size_t encodeFloat(const float *const *channels, uint32_t numChannels, uint32_t frames, uint8_t *dst)
+	{
+		for (uint32_t c = 0; c < numChannels; c++)
+			memcpy(dst + c * frames * 4, channels[c], frames * 4);
+		return numChannels * frames * 4;
+	}
+
+	template<typename T>
+	static size_t encodeInt(const float *const *channels, uint32_t numChannels, uint32_t frames, uint8_t *dst, float full)
+	{
+		uint8_t *p = dst;
+		for (uint32_t c = 0; c < numChannels; c++) {
+			const float *x = channels[c];
+			// non-finite samples don't set the scale: NaN is sent as 0, +-Inf as +-full scale
+			float scale = 0.0f;
+			for (uint32_t i = 0; i < frames; i++) {
+				if (std::isfinite(x[i]))
+					scale = std::max(scale, std::abs(x[i]));
+			}
+			float q = scale > 0.0f ? full / scale : 0.0f;
+			if (!std::isfinite(q)) {
+				// denormal scale
+				scale = 0.0f;
+				q = 0.0f;
+			}
+			memcpy(p, &scale, 4);
+			p += 4;
+
+			T *out = (T *)p;
+			for (uint32_t i = 0; i < frames; i++) {
+				float v = x[i];
+				if (std::isfinite(v))
+					out[i] = (T)std::lrint(std::max(-full, std::min(full, v * q)));
+				else
+					out[i] = v > 0.0f ? (T)full : v < 0.0f ? (T)-full : 0;
+			}
+			p += frames * sizeof(T);
+		}
+		return p - dst;
+	}
+
+	template<typename T>
+	static void decodeInt(const uint8_t *p, uint32_t numChannels, uint32_t frames, float *const *channels, float full)
+	{
+		for (uint32_t c = 0; c < numChannels; c++) {
+			float scale;
+			memcpy(&scale, p, 4);
+			p += 4;
+			float q = scale / full;
+			const T *in = (const T *)p;
+			for (uint32_t i = 0; i < frames; i++)
+				channels[c][i] = in[i] * q;
+			p += frames * sizeof(T);
+		}
+	}
+
+	// f32 bit pattern to an unsigned integer with the same order as the float values
+	static inline uint32_t toOrdered(uint32_t u) { return (u & 0x80000000u) ? ~u : (u | 0x80000000u); }
+	static inline uint32_t fromOrdered(uint32_t m) { return (m & 0x80000000u) ? (m & 0x7fffffffu) : ~m; }
+
+	struct BitWriter {
+		uint8_t *p, *end;
+		uint64_t acc;
+		int n;
+		bool overflow;
+
+		BitWriter(uint8_t *p, uint8_t *end) : p(p), end(end), acc(0), n(0), overflow(false) {}
+
+		// bits <= 32
+		inline void put(uint32_t v, int bits) {
+			acc |= (uint64_t)v << n;
+			n += bits;
+			while (n >= 8) {
+				if (p == end) {
+					overflow = true;
+					return;
+				}
+				*p++ = (uint8_t)acc;
+				acc >>= 8;
+				n -= 8;
+			}
+		}
+		inline void flush() {
+			if (n > 0)
+				put(0, 8 - n);
+		}
+	};
+
+	struct BitReader {
+		const uint8_t *p, *end;
+		uint64_t acc;
+		int n;
+		bool underflow;
+
+		BitReader(const uint8_t *p, const uint8_t *end) : p(p), end(end), acc(0), n(0), underflow(false) {}
+
+		inline void fill() {
+			while (n <= 56 && p < end) {
+				acc |= (uint64_t)*p++ << n;
+				n += 8;
+			}
+		}
+		inline uint32_t get(int bits) {
+			if (n < bits)
+				fill();
+			if (n < bits) {
+				underflow = true;
+				return 0;
+			}
+			uint32_t v = (uint32_t)(acc & (((uint64_t)1 << bits) - 1));
+			acc >>= bits;
+			n -= bits;
+			return v;
+		}
+		// number of 1 bits before the terminating 0, at most limit (then without terminator)
+		inline int unary(int limit) {
+			int q = 0;
+			while (q < limit) {
+				if (n == 0)
+					fill();
+				if (n == 0) {
+					underflow = true;
+					return 0;
+				}
+				if (!(acc & 1)) {
+					acc >>= 1;
+					n--;
+					return q;
+				}
+				acc >>= 1;
+				n--;
+				q++;
+			}
+			return q;
+		}
+	};
+
+	// lossless: transform a chunk (branch-free loops the compiler vectorises), then Rice code each partition
+	// with its own parameter k (5 bits)
+	static size_t encodeRice(const float *const *channels, uint32_t numChannels, uint32_t frames, uint8_t *dst, size_t capacity)
+	{
+		BitWriter w(dst, dst + capacity);
+		uint32_t z[CHUNK];
+
+		for (uint32_t c = 0; c < numChannels; c++) {
+			const uint32_t *bits = (const uint32_t *)channels[c];
+			uint32_t prev = toOrdered(0);
+
+			for (uint32_t i0 = 0; i0 < frames; i0 += CHUNK) {
+				uint32_t len = std::min<uint32_t>(CHUNK, frames - i0);
+
+				// delta of the ordered representation, zigzag to unsigned
+				const uint32_t *x = bits + i0;
+				int32_t d0 = (int32_t)(toOrdered(x[0]) - prev);
+				z[0] = ((uint32_t)d0 << 1) ^ (uint32_t)(d0 >> 31);
+				for (uint32_t i = 1; i < len; i++) {
+					int32_t d = (int32_t)(toOrdered(x[i]) - toOrdered(x[i - 1]));
+					z[i] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+				}
+				prev = toOrdered(x[len - 1]);
+
+				for (uint32_t p0 = 0; p0 < len; p0 += RICE_PARTITION) {
+					uint32_t plen = std::min<uint32_t>(RICE_PARTITION, len - p0);
+					uint64_t sum = 0;
+					for (uint32_t i = 0; i < plen; i++)
+						sum += z[p0 + i];
+
+					int k = 0;
+					while (k < 31 && ((uint64_t)plen << (k + 1)) < sum)
+						k++;
+					w.put(k, 5);
+
+					for (uint32_t i = 0; i < plen; i++) {
+						uint32_t v = z[p0 + i];
+						uint32_t q = v >> k;
+						if (q < (uint32_t)RICE_ESCAPE) {
+							w.put((1u << q) - 1, q + 1); // q ones, one zero
+							if (k)
+								w.put(v & ((1u << k) - 1), k);
+						}
+						else {
+							w.put((1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+							w.put(v, 32);
+						}
+					}
+					if (w.overflow)
+						return 0;
+				}
+			}
+		}
+		w.flush();
+		return w.overflow ? 0 : w.p - dst;
+	}
+
+	static bool decodeRice(const uint8_t *payload, size_t bytes, uint32_t numChannels, uint32_t frames, float *const *channels)
+	{
+		BitReader r(payload, payload + bytes);
+
+		for (uint32_t c = 0; c < numChannels; c++) {
+			uint32_t *out = (uint32_t *)channels[c];
+			uint32_t prev = toOrdered(0);
+
+			for (uint32_t p0 = 0; p0 < frames; p0 += RICE_PARTITION) {
+				// CHUNK is a multiple of RICE_PARTITION, the encoder's partitions are on the same grid
+				uint32_t plen = std::min<uint32_t>(RICE_PARTITION, frames - p0);
+				int k = (int)r.get(5);
+
+				for (uint32_t i = 0; i < plen; i++) {
+					int q = r.unary(RICE_ESCAPE);
+					uint32_t v = (q < RICE_ESCAPE) ? (((uint32_t)q << k) | (k ? r.get(k) : 0)) : r.get(32);
+					int32_t d = (int32_t)((v >> 1) ^ (0u - (v & 1)));
+					prev += (uint32_t)d;
+					out[p0 + i] = fromOrdered(prev);
+				}
+				if (r.underflow)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	size_t encode(PayloadType &type, const float *const *channels, uint32_t numChannels, uint32_t frames, uint8_t *dst)
+	{
+		switch (type) {
+		case PayloadType::Int8:
+			return encodeInt<int8_t>(channels, numChannels, frames, dst, 127.0f);
+		case PayloadType::Int16:
+			return encodeInt<int16_t>(channels, numChannels, frames, dst, 32767.0f);
+		case PayloadType::RiceDelta: {
+			size_t bytes = encodeRice(channels, numChannels, frames, dst, maxPayloadBytes(PayloadType::Float32, numChannels, frames));
+			if (bytes)
+				return bytes;
+			// does not compress
+			type = PayloadType::Float32;
+			return encodeFloat(channels, numChannels, frames, dst);
+		}
+		case PayloadType::Float32:
+			return encodeFloat(channels, numChannels, frames, dst);
+		default:
+			return 0;
+		}
+	}
+
+	bool decode(const Header &h, const uint8_t *payload, float *const *channels)
+	{
+		if (h.payloadBytes < maxPayloadBytes(h.payload, h.channels, h.frames) && h.payload != PayloadType::RiceDelta)
+			return false;
+
+		switch (h.payload) {
+		case PayloadType::Int8:
+			decodeInt<int8_t>(payload, h.channels, h.frames, channels, 127.0f);
+			return true;
+		case PayloadType::Int16:
+			decodeInt<int16_t>(payload, h.channels, h.frames, channels, 32767.0f);
+			return true;
+		case PayloadType::Float32:
+			for (uint32_t c = 0; c < h.channels; c++)
+				memcpy(channels[c], payload + c * h.frames * 4, h.frames * 4);
+			return true;
+		case PayloadType::RiceDelta:
+			return decodeRice(payload, h.payloadBytes, h.channels, h.frames, channels);
+		default:
+			return false;
+		}
+	}
+
+	Reassembler::Reassembler(Handler handler, uint32_t maxPending, uint32_t maxBlockSamples)
+		: m_handler(handler), m_maxPending(std::max<uint32_t>(maxPending, 1)), m_maxBlockSamples(maxBlockSamples),
+		m_started(false), m_nextSequence(0), m_numMalformed(0), m_numLate(0), m_numIncomplete(0)
+	{
+	}
+
+	Reassembler::~Reassembler()
+	{
+		for (auto &p : m_pending)
+			delete p.second;
+		for (auto b : m_free)
+			delete b;
+	}
+
+	void Reassembler::release(std::map<uint64_t, Block *>::iterator it)
+	{
+		Block *b = it->second;
+		if (!b->complete())
+			m_numIncomplete++;
+		m_handler(*b);
+		m_nextSequence = it->first + 1;
+		m_pending.erase(it);
+		m_free.push_back(b);
+	}
+
+	bool Reassembler::push(const uint8_t *packet, size_t bytes)
+	{
+		Header h;
+		if (!readHeader(packet, bytes, h) || h.payloadBytes > bytes - HEADER_BYTES
+			|| (uint64_t)h.totalChannels * h.blockFrames > m_maxBlockSamples) {
+			m_numMalformed++;
+			return false;
+		}
+
+		if (!m_started) {
+			m_started = true;
+			m_nextSequence = h.sequence;
+		}
+		if (h.sequence + RESYNC_BLOCKS < m_nextSequence) {
+			flush();
+			m_nextSequence = h.sequence;
+		}
+		if (h.sequence < m_nextSequence) {
+			m_numLate++;
+			return true;
+		}
+
+		auto it = m_pending.find(h.sequence);
+		Block *b;
+		if (it == m_pending.end()) {
+			if (m_free.empty()) {
+				b = new Block();
+			}
+			else {
+				b = m_free.back();
+				m_free.pop_back();
+			}
+			b->sequence = h.sequence;
+			b->frame = h.frame;
+			b->timestamp = h.timestamp;
+			b->channels = h.totalChannels;
+			b->frames = h.blockFrames;
+			b->decimation = h.decimation;
+			b->numFragments = h.numFragments;
+			b->numReceived = 0;
+			b->samples.assign((size_t)h.totalChannels * h.blockFrames, 0.0f);
+			b->received.assign(h.numFragments, false);
+			it = m_pending.emplace(h.sequence, b).first;
+		}
+		else {
+			b = it->second;
+			if (b->channels != h.totalChannels || b->frames != h.blockFrames || b->numFragments != h.numFragments
+				|| b->decimation != h.decimation) {
+				m_numMalformed++;
+				return false;
+			}
+		}
+
+		if (!b->received[h.fragment]) {
+			m_ptrs.resize(h.channels);
+			for (uint32_t c = 0; c < h.channels; c++)
+				m_ptrs[c] = &b->samples[(size_t)(h.firstChannel + c) * b->frames + h.offset];
+			if (!decode(h, packet + HEADER_BYTES, m_ptrs.data())) {
+				m_numMalformed++;
+				return false;
+			}
+			b->received[h.fragment] = true;
+			b->numReceived++;
+			b->payload = h.payload;
+		}
+
+		// in order: complete blocks at the front, then the oldest ones beyond the window
+		while (!m_pending.empty() && m_pending.begin()->second->complete())
+			release(m_pending.begin());
+		while (m_pending.size() > m_maxPending)
+			release(m_pending.begin());
+		return true;
+	}
+
+	void Reassembler::flush()
+	{
+		while (!m_pending.empty())
+			release(m_pending.begin());
+	}
+
+	void Reassembler::restart()
+	{
+		flush();
+		m_started = false;
+	}
+}
+}
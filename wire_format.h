@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace autil {
+namespace wire {
+	/*
+	 * Versioned packet format of the debug/observer UDP streams: a fixed 72-byte header followed by
+	 * the planar payload of the packet's channels. The payload type is chosen by the sender and carried in
+	 * every header, receivers decode whatever arrives (and drop unknown versions).
+	 *
+	 * A block (totalChannels x blockFrames) larger than one packet is split into fragments, each a
+	 * rectangle of channels [firstChannel, firstChannel + channels) and frames [offset, offset + frames)
+	 * that decodes on its own, so a lost packet only loses its slice.
+	 *
+	 * header (little endian):
+	 *   0  u32 magic 'AUWF'      4  u8 version   5 u8 payload type   6 u16 channels
+	 *   8  u32 frames/channel   12  u32 payload bytes
+	 *   16 u64 sequence (per sender, +1 per block, same for all fragments)
+	 *   24 u64 frame of the first sample of the block
+	 *   32 u32 offset (frames)  36  u32 block frames
+	 *   40 u16 first channel    42  u16 total channels   44 u16 fragment   46 u16 fragments
+	 *   48 i64 time of the block's first frame (ns)
+	 *   56 u32 timebase of the time (0: none)  60 u32 time error bound (ns)
+	 *   64 u32 decimation (source frames per block frame, 1: full rate)  68 u32 zero
+	 *
+	 * Version 2 added the timestamp (bytes 48..63), see ClockSync. Version 3 the decimation of reduced
+	 * rate previews (ObserverPublisher), the block then covers blockFrames * decimation source frames.
+	 */
+	enum class PayloadType : uint8_t {
+		Legacy = 0, // no header: pre-versioned int8 packets of UdpSocket::sendBlock()
+		Int8 = 1, // per channel: f32 scale (absmax), int8 samples
+		Int16 = 2, // per channel: f32 scale (absmax), int16 samples
+		Float32 = 3, // raw f32
+		RiceDelta = 4, // lossless: f32 bits in sign-magnitude order, delta, zigzag, Rice coded per 32 samples
+	};
+	// RiceDelta only pays off on smooth, band-limited signals: the float bit patterns leave little to predict,
+	// a 440 Hz sine at 48 kHz encodes to about 80 % of Float32, a 50 Hz one to about 60 %, silence to a few %.
+	// Broadband noise does not compress, encode() then sends Float32 instead (and returns that type).
+
+	static const uint32_t MAGIC = 0x46575541; // "AUWF"
+	static const uint8_t VERSION = 3;
+	static const size_t HEADER_BYTES = 72;
+
+	// little endian fields of the packet formats (also ClockSync)
+	inline void put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+	inline void put32(uint8_t *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+	inline void put64(uint8_t *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+	inline uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+	inline uint32_t get32(const uint8_t *p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+	inline uint64_t get64(const uint8_t *p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+
+	/*
+	 * Time of a frame on a clock shared between nodes: CLOCK_MONOTONIC of the node whose timebase id is
+	 * `clock` (ClockSync::localClockId()). Times of blocks from different senders are comparable if the
+	 * timebases match, i.e. the senders sync to the same ClockSyncServer.
+	 */
+	struct Timestamp {
+		int64_t time; // ns
+		uint32_t clock; // timebase id, 0: no timestamp
+		uint32_t error; // bound of the time error, ns
+
+		Timestamp() : time(0), clock(0), error(0) {}
+		inline bool valid() const { return clock != 0; }
+	};
+
+	struct Header {
+		PayloadType payload;
+		uint16_t channels;
+		uint32_t frames;
+		uint32_t payloadBytes;
+		uint64_t sequence;
+		uint64_t frame;
+		uint32_t offset, blockFrames;
+		uint16_t firstChannel, totalChannels;
+		uint16_t fragment, numFragments;
+		Timestamp timestamp;
+		uint32_t decimation;
+	};
+
+	const char *payloadName(PayloadType type);
+
+	void writeHeader(const Header &h, uint8_t *dst);
+	// false if src is not a packet of this version or the fragment lies outside its block
+	bool readHeader(const uint8_t *src, size_t bytes, Header &h);
+
+	// upper bound of encode() for the buffer size
+	size_t maxPayloadBytes(PayloadType type, uint32_t channels, uint32_t frames);
+
+	// planar channels to payload, returns the payload bytes. RiceDelta falls back to Float32 (and
+	// changes type) when the block does not compress
+	size_t encode(PayloadType &type, const float *const *channels, uint32_t numChannels, uint32_t frames, uint8_t *dst);
+	// payload to planar channels (h.channels x h.frames), false on a malformed payload
+	bool decode(const Header &h, const uint8_t *payload, float *const *channels);
+
+	/*
+	 * Receiver side: collects the fragments of each block and hands blocks to the handler in sequence
+	 * order, once complete or when more than maxPending newer blocks are in flight (then the missing
+	 * slices are zero). Fragments of blocks already handed on are dropped as late, unless they are
+	 * RESYNC_BLOCKS behind: then the sender restarted and the pending blocks are flushed.
+	 */
+	class Reassembler {
+	public:
+		struct Block {
+			uint64_t sequence, frame;
+			Timestamp timestamp;
+			uint32_t channels, frames;
+			uint32_t decimation; // 1: full rate
+			uint16_t numFragments, numReceived;
+			PayloadType payload; // of the last fragment
+			std::vector<float> samples; // planar, channel c at c * frames
+			std::vector<bool> received; // per fragment
+
+			inline bool complete() const { return numReceived == numFragments; }
+		};
+		typedef std::function<void(const Block &block)> Handler;
+		static const uint64_t RESYNC_BLOCKS = 1024;
+
+		Reassembler(Handler handler, uint32_t maxPending = 8, uint32_t maxBlockSamples = 1 << 22);
+		~Reassembler();
+
+		// one datagram, false if it is malformed
+		bool push(const uint8_t *packet, size_t bytes);
+		// hand on all pending blocks
+		void flush();
+		// flush, then follow the sequence of the next datagram (a new sender)
+		void restart();
+
+		inline void setMaxPending(uint32_t maxPending) { m_maxPending = maxPending > 0 ? maxPending : 1; }
+		inline uint32_t getMaxPending() const { return m_maxPending; }
+		inline bool hasPending() const { return !m_pending.empty(); }
+
+		inline uint64_t getNumMalformed() const { return m_numMalformed; }
+		inline uint64_t getNumLate() const { return m_numLate; }
+		inline uint64_t getNumIncomplete() const { return m_numIncomplete; }
+
+	private:
+		Handler m_handler;
+		uint32_t m_maxPending, m_maxBlockSamples;
+		std::map<uint64_t, Block *> m_pending;
+		std::vector<Block *> m_free;
+		std::vector<float *> m_ptrs;
+		bool m_started;
+		uint64_t m_nextSequence; // blocks before this one were handed on
+		uint64_t m_numMalformed, m_numLate, m_numIncomplete;
+
+		void release(std::map<uint64_t, Block *>::iterator it);
+	};
+}
+}